@@ -11,14 +11,18 @@
 #define KERNEL_BASE_ADDR  0xffff000000000000
 #define STRAIGHT_MAP_ADDR 0x03000000
 #define STRAIGHT_MAP_END  0x3f000000
+#define HUGE_PAGE_SIZE    0  // Not supported.
 
 struct arch_task {
     vaddr_t syscall_stack;
     vaddr_t stack;
     /// The level-0 page table.
     uint64_t *page_table;
-    /// The user's page table paddr.
+    /// The user's page table paddr and the ASID.
     paddr_t ttbr0;
+    /// The ASID (Address Space ID) which tags the task's TLB entries. Tasks
+    /// with large task IDs share ASID 0 and flush its entries on every switch.
+    uint16_t asid;
 };
 
 static inline void *paddr2ptr(paddr_t addr) {
@@ -8,6 +8,18 @@ struct cpuvar *arm64_get_cpuvar(void) {
     return &cpuvars[mp_self()];
 }
 
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    ASSERT(cpu < NUM_CPUS_MAX);
+    return &cpuvars[cpu];
+}
+
+/// Multiprocessor is not supported on arm64: secondary CPUs stay parked in
+/// mpinit() and lock() is a no-op. Only the boot CPU runs tasks, so the
+/// scheduler uses only its runqueue.
+int mp_num_cpus(void) {
+    return 1;
+}
+
 void halt(void) {
     while (true) {
         __asm__ __volatile__("wfi");
@@ -18,7 +30,7 @@ void mp_start(void) {
     machine_mp_start();
 }
 
-void mp_reschedule(void) {
+void mp_reschedule(int cpu) {
     // TODO:
 }
 
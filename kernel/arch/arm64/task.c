@@ -1,4 +1,5 @@
 #include "asm.h"
+#include "vm.h"
 #include <boot.h>
 #include <string.h>
 #include <syscall.h>
@@ -14,9 +15,13 @@ static uint8_t exception_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(
 
 // Prepare the initial stack for arm64_task_switch().
 static void init_stack(struct task *task, vaddr_t pc) {
-    // Initialize the page table.
+    // Initialize the page table. The task ID is also used as the ASID: flush
+    // TLB entries left by the previous task with the same ID.
     memset(task->arch.page_table, 0, PAGE_SIZE);
-    task->arch.ttbr0 = ptr2paddr(task->arch.page_table);
+    task->arch.asid = (task->tid < ASID_MAX) ? task->tid : 0;
+    task->arch.ttbr0 =
+        ptr2paddr(task->arch.page_table) | TTBR_ASID(task->arch.asid);
+    arm64_flush_asid(task->arch.asid);
 
     vaddr_t exception_stack = (vaddr_t) exception_stacks[task->tid];
     uint64_t *sp = (uint64_t *) (exception_stack + STACK_SIZE);
@@ -46,12 +51,13 @@ void arch_task_destroy(struct task *task) {
 void arm64_task_switch(vaddr_t *prev_sp, vaddr_t next_sp);
 
 void arch_task_switch(struct task *prev, struct task *next) {
+    // TLB entries are tagged with ASIDs: we don't need to flush them.
     ARM64_MSR(ttbr0_el1, next->arch.ttbr0);
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
-    __asm__ __volatile__("tlbi vmalle1is");
-    __asm__ __volatile__("dsb ish");
     __asm__ __volatile__("isb");
+    if (!next->arch.asid) {
+        // The shared ASID: entries may belong to another task.
+        arm64_flush_asid(0);
+    }
 
     arm64_task_switch(&prev->arch.stack, next->arch.stack);
 }
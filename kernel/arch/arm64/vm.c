@@ -5,6 +5,9 @@
 #include <syscall.h>
 #include <task.h>
 
+/// The maximum number of pages to be invalidated by TLBI one by one.
+#define TLBI_PAGES_MAX 32
+
 static uint64_t *traverse_page_table(uint64_t *table, vaddr_t vaddr,
                                      paddr_t kpage, uint64_t attrs) {
     ASSERT(vaddr < KERNEL_BASE_ADDR);
@@ -14,7 +17,7 @@ static uint64_t *traverse_page_table(uint64_t *table, vaddr_t vaddr,
     for (int level = 4; level > 1; level--) {
         int index = NTH_LEVEL_INDEX(level, vaddr);
         if (!table[index]) {
-            if (!attrs) {
+            if (!attrs || !kpage) {
                 return NULL;
             }
 
@@ -55,31 +58,44 @@ error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
         return (kpage) ? ERR_TRY_AGAIN : ERR_EMPTY;
     }
 
-    *entry = paddr | attrs | ARM64_PAGE_ACCESS | ARM64_PAGE_TABLE;
-
-    // FIXME: Flush only the affected page.
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
-    __asm__ __volatile__("tlbi vmalle1is");
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
+    *entry =
+        paddr | attrs | ARM64_PAGE_ACCESS | ARM64_PAGE_TABLE | ARM64_PAGE_NG;
     return OK;
 }
 
-error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
+error_t arch_vm_unmap(struct task *task, vaddr_t vaddr, size_t *num_pages) {
     uint64_t *entry = traverse_page_table(task->arch.page_table, vaddr, 0, 0);
     if (!entry) {
         return ERR_NOT_FOUND;
     }
 
     *entry = 0;
-    // FIXME: Flush only the affected page.
+    *num_pages = 1;
+    return OK;
+}
+
+/// Invalidates all TLB entries tagged with the ASID.
+void arm64_flush_asid(uint16_t asid) {
+    __asm__ __volatile__("dsb ishst");
+    __asm__ __volatile__("tlbi aside1is, %0" ::"r"(TTBR_ASID(asid)));
     __asm__ __volatile__("dsb ish");
     __asm__ __volatile__("isb");
-    __asm__ __volatile__("tlbi vmalle1is");
+}
+
+void arch_vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    if (num_pages > TLBI_PAGES_MAX) {
+        arm64_flush_asid(task->arch.asid);
+        return;
+    }
+
+    __asm__ __volatile__("dsb ishst");
+    for (size_t i = 0; i < num_pages; i++) {
+        uint64_t operand =
+            TTBR_ASID(task->arch.asid) | ((vaddr + i * PAGE_SIZE) >> 12);
+        __asm__ __volatile__("tlbi vae1is, %0" ::"r"(operand));
+    }
     __asm__ __volatile__("dsb ish");
     __asm__ __volatile__("isb");
-    return OK;
 }
 
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
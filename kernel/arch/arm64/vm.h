@@ -1,5 +1,6 @@
 #ifndef __ARM64_VM_H__
 #define __ARM64_VM_H__
+#include <types.h>
 
 #define NTH_LEVEL_INDEX(level, vaddr)                                          \
     (((vaddr) >> ((((level) -1) * 9) + 12)) & 0x1ff)
@@ -7,9 +8,16 @@
 
 #define ARM64_PAGE_TABLE  0x3
 #define ARM64_PAGE_ACCESS (1ULL << 10)
+#define ARM64_PAGE_NG     (1ULL << 11)
 // Readonly from both kernel and user.
 #define ARM64_PAGE_MEMATTR_READONLY (0b11 << 6)
 // Readable/writable from both kernel and user.
 #define ARM64_PAGE_MEMATTR_READWRITE (0b01 << 6)
 
+// 8-bit ASIDs (TCR_EL1.AS == 0).
+#define ASID_MAX       256
+#define TTBR_ASID(asid) ((uint64_t)(asid) << 48)
+
+void arm64_flush_asid(uint16_t asid);
+
 #endif
@@ -8,6 +8,7 @@
 #define IRQ_MAX           32
 #define STRAIGHT_MAP_ADDR 0  // Unused.
 #define STRAIGHT_MAP_END  0  // Unused.
+#define HUGE_PAGE_SIZE    0  // Not supported.
 
 struct arch_task {};
 
@@ -8,7 +8,15 @@ void halt(void) {
 void mp_start(void) {
 }
 
-void mp_reschedule(void) {
+int mp_num_cpus(void) {
+    return 1;
+}
+
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    return &cpuvar;
+}
+
+void mp_reschedule(int cpu) {
 }
 
 void lock(void) {
@@ -7,10 +7,14 @@ error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
     return OK;
 }
 
-error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
+error_t arch_vm_unmap(struct task *task, vaddr_t vaddr, size_t *num_pages) {
+    *num_pages = 1;
     return OK;
 }
 
+void arch_vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages) {
+}
+
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
     return 0;
 }
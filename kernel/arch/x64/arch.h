@@ -15,6 +15,7 @@
 #define KERNEL_BASE_ADDR  0xffff800000000000
 #define STRAIGHT_MAP_ADDR 0x0000000010000000
 #define STRAIGHT_MAP_END  0xffff800000000000
+#define HUGE_PAGE_SIZE    (2 * 1024 * 1024)
 
 struct arch_task {
     uint64_t rsp;
@@ -24,6 +25,12 @@ struct arch_task {
     uint64_t gsbase;
     uint64_t fsbase;
     paddr_t pml4;
+    /// The bitmap of CPUs that may have stale TLB entries tagged with this
+    /// task's PCID. A CPU flushes them when it switches into the task.
+    uint32_t tlb_stale_cpus;
+    /// The CPU whose FPU registers were last loaded from (or have not yet been
+    /// saved into) this task's XSAVE area, or -1.
+    int fpu_cpu;
 #ifdef CONFIG_HYPERVISOR
     struct vmx vmx;
 #endif
@@ -136,6 +143,8 @@ struct idtr {
 #define CR4_OSFXSR     (1ul << 9)
 #define CR4_OSXMMEXCPT (1ul << 10)
 #define CR4_VMXE       (1ul << 13)
+#define CR4_PCIDE      (1ul << 17)
+#define CR3_NOFLUSH    (1ul << 63)
 
 //
 //  Extended Control Register 0 (XCR0)
@@ -182,6 +191,13 @@ struct tss {
 extern char __kernel_pml4[];  // paddr_t
 #define PAGE_ENTRY_NUM 512
 
+//
+//  PCID
+//
+#define PCID_MAX             4096
+#define INVPCID_TYPE_ADDR    0
+#define INVPCID_TYPE_CONTEXT 1
+
 //
 //  PIC
 //
@@ -214,6 +230,7 @@ extern char __kernel_pml4[];  // paddr_t
 #define IOAPIC_IOWIN_OFFSET             0x10
 #define VECTOR_IPI_RESCHEDULE           32
 #define VECTOR_IPI_HALT                 33
+#define VECTOR_IPI_TLB_SHOOTDOWN        34
 #define VECTOR_IRQ_BASE                 48
 #define IOAPIC_ADDR                     0xfec00000
 #define IOAPIC_REG_IOAPICVER            0x01
@@ -231,8 +248,10 @@ static inline void write_apic(paddr_t addr, uint32_t data) {
 //
 //  APIC Timer.
 //
-#define APIC_TIMER_DIV 0x03
-#define TICK_HZ        1000
+#define APIC_TIMER_DIV      0x03
+#define APIC_TIMER_MASKED   (1 << 16)
+#define APIC_TIMER_PERIODIC (1 << 17)
+#define TICK_HZ             1000
 
 //
 //  MP
@@ -262,6 +281,17 @@ struct arch_cpuvar {
     struct tss tss;
     struct gdtr gdtr;
     struct idtr idtr;
+#ifdef CONFIG_TICKLESS_IDLE
+    // Set to 1 if the periodic timer interrupt is stopped.
+    uint8_t tickless;
+    // The number of ticks programmed in the one-shot timer (0 if masked).
+    uint32_t tickless_ticks;
+#endif
+    // The task whose FPU registers are loaded in this CPU (lazy FPU switching).
+    struct task *fpu_owner;
+    // Set to 1 while another CPU waits for this CPU to flush the TLB entries
+    // of the current task (see mp_tlb_shootdown()).
+    uint8_t tlb_shootdown;
 };
 
 struct cpuvar;
@@ -346,6 +376,10 @@ static inline void asm_write_cr0(uint64_t value) {
     __asm__ __volatile__("mov %0, %%cr0" :: "r"(value));
 }
 
+static inline void asm_clts(void) {
+    __asm__ __volatile__("clts");
+}
+
 static inline void asm_write_cr3(uint64_t value) {
     __asm__ __volatile__("mov %0, %%cr3" :: "r"(value));
 }
@@ -370,6 +404,21 @@ static inline void asm_invlpg(uint64_t vaddr) {
     __asm__ __volatile__("invlpg (%0)" :: "b"(vaddr) : "memory");
 }
 
+static inline void asm_invpcid(uint64_t type, uint64_t pcid, vaddr_t vaddr) {
+    struct {
+        uint64_t pcid;
+        uint64_t vaddr;
+    } __packed desc = {.pcid = pcid, .vaddr = vaddr};
+    __asm__ __volatile__("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+static inline void asm_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                             uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
 static inline void asm_swapgs(void) {
     __asm__ __volatile__("swapgs");
 }
@@ -840,7 +840,9 @@ static void init_vmcs(struct vmcs *vmcs, struct saved_msrs *msrs,
     asm_vmwrite(VMCS_CR4_READ_SHADOW, 0);
 
     // Populate host states.
-    asm_vmwrite(VMCS_HOST_CR0, asm_read_cr0());
+    // The guest owns the FPU while it's running: keep CR0.TS cleared on
+    // VM-exit (see arch_task_switch).
+    asm_vmwrite(VMCS_HOST_CR0, asm_read_cr0() & ~CR0_TS);
     asm_vmwrite(VMCS_HOST_CR4, asm_read_cr4());
     asm_vmwrite(VMCS_HOST_CS_SEL, KERNEL_CS);
     asm_vmwrite(VMCS_HOST_DS_SEL, 0);
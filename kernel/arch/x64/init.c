@@ -3,6 +3,7 @@
 #include "serial.h"
 #include "task.h"
 #include "trap.h"
+#include "vm.h"
 #include <arch.h>
 #include <boot.h>
 #include <bootinfo.h>
@@ -106,9 +107,10 @@ static void syscall_init(void) {
     asm_wrmsr(MSR_EFER, asm_rdmsr(MSR_EFER) | EFER_SCE);
 }
 
-static void calibrate_apic_timer(void) {
-    static uint32_t calibrated_count = 0;
+/// The APIC timer count per tick.
+static uint32_t calibrated_count = 0;
 
+static void calibrate_apic_timer(void) {
     // Use PIT to determine the frequency of APIC timer. On some real machines
     // like my laptop this calibration does not work properly :/
     if (!calibrated_count) {
@@ -146,30 +148,89 @@ static void calibrate_apic_timer(void) {
 static void apic_timer_init(void) {
     write_apic(APIC_REG_TIMER_DIV, APIC_TIMER_DIV);
     calibrate_apic_timer();
-    write_apic(APIC_REG_LVT_TIMER, (VECTOR_IRQ_BASE + TIMER_IRQ) | 0x20000);
+    write_apic(APIC_REG_LVT_TIMER,
+               (VECTOR_IRQ_BASE + TIMER_IRQ) | APIC_TIMER_PERIODIC);
+}
+
+#ifdef CONFIG_TICKLESS_IDLE
+/// Stops the periodic timer interrupt on the idle CPU if possible. Instead,
+/// the timer fires once when the nearest task timer expires.
+static void tickless_enter(void) {
+    unsigned ticks;
+    if (!task_tickless_enter(&ticks)) {
+        return;
+    }
+
+    ticks = MIN(ticks, UINT32_MAX / calibrated_count);
+    if (ticks) {
+        // One-shot mode.
+        write_apic(APIC_REG_LVT_TIMER, VECTOR_IRQ_BASE + TIMER_IRQ);
+        write_apic(APIC_REG_TIMER_INITCNT, ticks * calibrated_count);
+    } else {
+        // No timers to wait for. Sleep until an IRQ or IPI arrives.
+        write_apic(APIC_REG_LVT_TIMER,
+                   (VECTOR_IRQ_BASE + TIMER_IRQ) | APIC_TIMER_MASKED);
+    }
+
+    ARCH_CPUVAR->tickless = 1;
+    ARCH_CPUVAR->tickless_ticks = ticks;
 }
 
+/// Restarts the periodic timer interrupt and accounts the ticks elapsed during
+/// the sleep. Called on every interrupt with the lock held.
+void x64_tickless_exit(bool timer_expired) {
+    if (!ARCH_CPUVAR->tickless) {
+        return;
+    }
+
+    unsigned elapsed = 0;
+    unsigned ticks = ARCH_CPUVAR->tickless_ticks;
+    if (ticks) {
+        uint32_t consumed =
+            ticks * calibrated_count - read_apic(APIC_REG_TIMER_CURRENT);
+        elapsed = consumed / calibrated_count;
+        if (timer_expired) {
+            // The last tick is accounted in handle_timer_irq().
+            elapsed = ticks - 1;
+        }
+    }
+
+    ARCH_CPUVAR->tickless = 0;
+    write_apic(APIC_REG_LVT_TIMER,
+               (VECTOR_IRQ_BASE + TIMER_IRQ) | APIC_TIMER_PERIODIC);
+    write_apic(APIC_REG_TIMER_INITCNT, calibrated_count);
+    task_tickless_exit(elapsed);
+}
+#endif
+
 static void apic_init(void) {
     asm_wrmsr(MSR_APIC_BASE, (asm_rdmsr(MSR_APIC_BASE) & 0xfffff100) | 0x0800);
     write_apic(APIC_REG_SPURIOUS_INT, 1 << 8);
     write_apic(APIC_REG_TPR, 0);
     write_apic(APIC_REG_LOGICAL_DEST, 0x01000000);
     write_apic(APIC_REG_DEST_FORMAT, 0xffffffff);
-    write_apic(APIC_REG_LVT_TIMER, 1 << 16 /* masked */);
+    write_apic(APIC_REG_LVT_TIMER, APIC_TIMER_MASKED);
     write_apic(APIC_REG_LVT_ERROR, 1 << 16 /* masked */);
 }
 
 static struct cpuvar x64_cpuvars[CPU_NUM_MAX];
 
+struct cpuvar *mp_cpuvar_of(int cpu) {
+    ASSERT(cpu < CPU_NUM_MAX);
+    return &x64_cpuvars[cpu];
+}
+
 static void common_setup(void) {
     STATIC_ASSERT(sizeof(struct cpuvar) <= CPUVAR_SIZE_MAX);
     STATIC_ASSERT(IS_ALIGNED(CPUVAR_SIZE_MAX, PAGE_SIZE));
 
-    // Enable some CPU features.
-    asm_write_cr0((asm_read_cr0() | CR0_MP | CR0_NX) & (~CR0_EM) & (~CR0_TS));
+    // Enable some CPU features. CR0.TS is set so that the first FPU
+    // instruction traps into the #NM handler (lazy FPU switching).
+    asm_write_cr0((asm_read_cr0() | CR0_MP | CR0_NX | CR0_TS) & (~CR0_EM));
     asm_write_cr4(asm_read_cr4() | CR4_FSGSBASE | CR4_OSXSAVE | CR4_OSFXSR
                   | CR4_OSXMMEXCPT);
     asm_xsetbv(0, asm_xgetbv(0) | XCR0_SSE | XCR0_AVX);
+    x64_pcid_init();
 
     // Set RDGSBASE to enable the CPUVAR macro.
     ASSERT(mp_self() < CPU_NUM_MAX);
@@ -238,12 +299,23 @@ void mpinit(void) {
     lock();
     INFO("Booting CPU #%d...", mp_self());
     common_setup();
+#ifndef CONFIG_X64_SMP_SCHEDULING
+    // Tasks run only on the BSP until the big kernel lock is split.
+    unlock();
+    while (true) {
+        __asm__ __volatile__("cli; hlt");
+    }
+#endif
     mpmain();
 }
 
 __noreturn void arch_idle(void) {
-    task_switch();
     while (true) {
+        // Run tasks if exist. It returns when this CPU becomes idle again.
+        task_switch();
+#ifdef CONFIG_TICKLESS_IDLE
+        tickless_enter();
+#endif
         unlock();
         asm_stihlt();
         asm_cli();
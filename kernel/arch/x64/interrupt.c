@@ -71,6 +71,14 @@ void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
         }
     }
 
+    if (vec == VECTOR_IPI_TLB_SHOOTDOWN) {
+        // Don't take the big lock: the requesting CPU holds it until we
+        // flush the TLB.
+        ack_irq();
+        mp_handle_tlb_shootdown();
+        return;
+    }
+
     ack_irq();
     bool needs_unlock = true;
     switch (vec) {
@@ -105,12 +113,26 @@ void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
             handle_page_fault(addr, ip, fault);
             break;
         }
+        case EXP_DEVICE_NOT_AVAILABLE:
+            lock();
+            if (frame->cs == KERNEL_CS) {
+                PANIC("#NM: the kernel must not use the FPU!");
+            }
+
+            switch_fpu();
+            break;
         case VECTOR_IPI_RESCHEDULE:
             lock();
+#ifdef CONFIG_TICKLESS_IDLE
+            x64_tickless_exit(false);
+#endif
             task_switch();
             break;
         default:
             lock();
+#ifdef CONFIG_TICKLESS_IDLE
+            x64_tickless_exit(vec == VECTOR_IRQ_BASE + TIMER_IRQ);
+#endif
             if (vec <= 20) {
                 WARN_DBG("Exception #%d\n", vec);
                 dump_frame(frame);
@@ -1,6 +1,7 @@
 #ifndef __INTERRUPT_H__
 #define __INTERRUPT_H__
 
+#include <config.h>
 #include <types.h>
 
 #define EXP_DEVICE_NOT_AVAILABLE 7
@@ -36,5 +37,8 @@ long x64_handle_syscall(long n, long a1, long a2, long a3, long a4, long a5);
 struct task;
 void release_task_irq(struct task *task);
 void interrupt_init(void);
+#ifdef CONFIG_TICKLESS_IDLE
+void x64_tickless_exit(bool timer_expired);
+#endif
 
 #endif
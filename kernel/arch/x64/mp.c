@@ -11,8 +11,15 @@ extern char mpboot_end[];
 
 static int num_cpus = 1;
 
+/// Returns the number of CPUs which run tasks. Unless
+/// CONFIG_X64_SMP_SCHEDULING is enabled, APs are parked in mpinit() and only
+/// the BSP runs tasks.
 int mp_num_cpus(void) {
+#ifdef CONFIG_X64_SMP_SCHEDULING
     return num_cpus;
+#else
+    return 1;
+#endif
 }
 
 static void udelay(int usec) {
@@ -104,7 +111,7 @@ static void start_aps(void) {
     memcpy(paddr2ptr((paddr_t) __mp_boot_gdtr),
            paddr2ptr((paddr_t) boot_gdtr), sizeof(struct gdtr));
     // Send IPI to APs to boot them.
-    for (int cpu = 1; cpu < mp_num_cpus(); cpu++) {
+    for (int cpu = 1; cpu < num_cpus; cpu++) {
         TRACE("starting CPU #%d...", cpu);
         send_ipi(0, IPI_DEST_UNICAST, cpu, IPI_MODE_INIT);
         udelay(20000);
@@ -119,8 +126,33 @@ void mp_start(void) {
     start_aps();
 }
 
-void mp_reschedule(void) {
-    send_ipi(VECTOR_IPI_RESCHEDULE, IPI_DEST_ALL_BUT_SELF, 0, IPI_MODE_FIXED);
+void mp_reschedule(int cpu) {
+    send_ipi(VECTOR_IPI_RESCHEDULE, IPI_DEST_UNICAST, cpu, IPI_MODE_FIXED);
+}
+
+/// Makes the CPU flush the TLB entries of the task running on it and waits
+/// until it's done. The caller must hold the big lock.
+void mp_tlb_shootdown(int cpu) {
+    struct arch_cpuvar *arch = &mp_cpuvar_of(cpu)->arch;
+    __atomic_store_n(&arch->tlb_shootdown, 1, __ATOMIC_RELEASE);
+    send_ipi(VECTOR_IPI_TLB_SHOOTDOWN, IPI_DEST_UNICAST, cpu, IPI_MODE_FIXED);
+    while (__atomic_load_n(&arch->tlb_shootdown, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+/// Handles a TLB shootdown request from another CPU, if any. It's called
+/// from the IPI handler and while spinning in lock(): the requesting CPU holds
+/// the big lock and interrupts are disabled while we wait for it.
+void mp_handle_tlb_shootdown(void) {
+    if (!__atomic_load_n(&ARCH_CPUVAR->tlb_shootdown, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // Reloading CR3 flushes the TLB entries of the current page table (and
+    // its PCID if PCID is enabled).
+    asm_write_cr3(asm_read_cr3());
+    __atomic_store_n(&ARCH_CPUVAR->tlb_shootdown, 0, __ATOMIC_RELEASE);
 }
 
 static void halt_other_cpus(void) {
@@ -136,6 +168,7 @@ void lock(void) {
     }
 
     while (!__sync_bool_compare_and_swap(&big_lock, UNLOCKED, LOCKED)) {
+        mp_handle_tlb_shootdown();
         __asm__ __volatile__("pause");
     }
 
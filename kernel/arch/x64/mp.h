@@ -110,5 +110,7 @@ enum ipi_mode {
 #define NO_LOCK_OWNER -1
 
 void panic_unlock(void);
+void mp_tlb_shootdown(int cpu);
+void mp_handle_tlb_shootdown(void);
 
 #endif
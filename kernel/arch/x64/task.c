@@ -28,12 +28,15 @@ error_t arch_task_create(struct task *task, vaddr_t ip) {
     task->arch.xsave = xsave;
     task->arch.gsbase = 0;
     task->arch.fsbase = 0;
+    task->arch.fpu_cpu = -1;
 
 #ifdef CONFIG_HYPERVISOR
     task->arch.vmx.launched = false;
 #endif
 
-    // Initialize the page table.
+    // Initialize the page table. The task ID is also used as the PCID: flush
+    // TLB entries left by the previous task with the same ID on all CPUs.
+    task->arch.tlb_stale_cpus = 0xffffffff;
     task->arch.pml4 = ptr2paddr(pml4_tables[task->tid]);
     uint64_t *table = paddr2ptr(task->arch.pml4);
     memcpy(table, paddr2ptr((paddr_t) __kernel_pml4), PAGE_SIZE);
@@ -69,6 +72,24 @@ error_t arch_task_create(struct task *task, vaddr_t ip) {
 }
 
 void arch_task_destroy(struct task *task) {
+    task->arch.fpu_cpu = -1;
+}
+
+/// Makes the FPU available to the task and loads its FPU registers unless
+/// they're already loaded in the current CPU.
+static void fpu_acquire(struct task *task) {
+    asm_clts();
+    if (ARCH_CPUVAR->fpu_owner != task || task->arch.fpu_cpu != mp_self()) {
+        asm_xrstor(task->arch.xsave, asm_xgetbv(0));
+        ARCH_CPUVAR->fpu_owner = task;
+        task->arch.fpu_cpu = mp_self();
+    }
+}
+
+/// The #NM (device not available) exception handler: the current task has
+/// executed a FPU instruction for the first time since it's switched into.
+void switch_fpu(void) {
+    fpu_acquire(CURRENT);
 }
 
 static void update_tss_iomap(struct task *task) {
@@ -88,7 +109,7 @@ void arch_task_switch(struct task *prev, struct task *next) {
     prev->arch.fsbase = asm_rdfsbase();
     asm_wrfsbase(next->arch.fsbase);
     // Switch the page table.
-    asm_write_cr3(next->arch.pml4);
+    x64_load_page_table(next);
     // Enable ABI emulation if needed.
     ARCH_CPUVAR->abi_emu = (next->flags & TASK_ABI_EMU) ? 1 : 0;
 
@@ -103,11 +124,28 @@ void arch_task_switch(struct task *prev, struct task *next) {
     ARCH_CPUVAR->tss.rsp0 = next->arch.interrupt_stack;
     // Update the I/O bitmap.
     update_tss_iomap(next);
-    // Save and restore FPU registers. This may be expensive operation: I
-    // think we should implement "lazy FPU switching".
-    uint64_t xsave_mask = asm_xgetbv(0);
-    asm_xsave(prev->arch.xsave, xsave_mask);
-    asm_xrstor(next->arch.xsave, xsave_mask);
+
+    // Lazy FPU switching: XSAVE/XRSTOR are expensive and most tasks (servers
+    // and drivers) never touch the FPU. We save the FPU registers only if prev
+    // has used them in this time slice (CR0.TS is cleared in switch_fpu) and
+    // defer restoring next's ones until it executes a FPU instruction.
+    bool fpu_enabled = (asm_read_cr0() & CR0_TS) == 0;
+    if (fpu_enabled && ARCH_CPUVAR->fpu_owner == prev) {
+        asm_xsave(prev->arch.xsave, asm_xgetbv(0));
+    }
+
+    if (next->flags & TASK_HV) {
+        // The guest uses the FPU without trapping into the host.
+        fpu_acquire(next);
+    } else if (ARCH_CPUVAR->fpu_owner == next
+               && next->arch.fpu_cpu == mp_self()) {
+        // The FPU registers still hold next's state.
+        if (!fpu_enabled) {
+            asm_clts();
+        }
+    } else if (fpu_enabled) {
+        asm_write_cr0(asm_read_cr0() | CR0_TS);
+    }
 
     // Restore registers (resume the next thread).
     switch_context(&prev->arch.rsp, &next->arch.rsp);
@@ -1,20 +1,73 @@
 #include "vm.h"
+#include "mp.h"
 #include <arch.h>
 #include <printk.h>
 #include <string.h>
 #include <task.h>
 
-static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
+/// The maximum number of pages to be invalidated by INVLPG one by one.
+#define INVLPG_MAX 32
+
+/// Whether PCID (Process-Context Identifiers) is enabled. If so, each task's
+/// TLB entries are tagged with its task ID and survive context switches.
+static bool pcid_enabled = false;
+/// Whether INVPCID instruction is available.
+static bool invpcid_supported = false;
+
+STATIC_ASSERT(CONFIG_NUM_TASKS <= PCID_MAX);
+STATIC_ASSERT(CPU_NUM_MAX <= 32 /* the bitmap size of tlb_stale_cpus */);
+
+/// Enables PCID if it's supported. Called on each CPU.
+void x64_pcid_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx & (1 << 17)) == 0) {
+        return;
+    }
+
+    asm_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    invpcid_supported = (ebx & (1 << 10)) != 0;
+
+    // The current CR3 (the kernel's page table) uses PCID 0.
+    ASSERT((asm_read_cr3() & 0xfff) == 0);
+    asm_write_cr4(asm_read_cr4() | CR4_PCIDE);
+    pcid_enabled = true;
+}
+
+/// Switches the page table into the task's one. If PCID is enabled, TLB
+/// entries are kept unless this CPU may have stale ones for the task.
+void x64_load_page_table(struct task *task) {
+    if (!pcid_enabled) {
+        asm_write_cr3(task->arch.pml4);
+        return;
+    }
+
+    uint32_t self = 1u << mp_self();
+    uint64_t cr3 = task->arch.pml4 | task->tid;
+    if (task->arch.tlb_stale_cpus & self) {
+        // Loading CR3 without CR3_NOFLUSH flushes TLB entries for the PCID.
+        task->arch.tlb_stale_cpus &= ~self;
+    } else {
+        cr3 |= CR3_NOFLUSH;
+    }
+
+    asm_write_cr3(cr3);
+}
+
+/// Returns the page table entry for `vaddr` in the `target` level: 1 for a
+/// 4KiB page and 2 for a 2MiB page (HUGE_PAGE_SIZE). If the page is covered by
+/// a huge page, it returns the huge page's entry instead.
+static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr, int target,
                                      paddr_t kpage, uint64_t attrs) {
     ASSERT(vaddr < KERNEL_BASE_ADDR);
     ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
     ASSERT(IS_ALIGNED(kpage, PAGE_SIZE));
 
     uint64_t *table = paddr2ptr(pml4);
-    for (int level = 4; level > 1; level--) {
+    for (int level = 4; level > target; level--) {
         int index = NTH_LEVEL_INDEX(level, vaddr);
         if (!table[index]) {
-            if (!attrs) {
+            if (!attrs || !kpage) {
                 return NULL;
             }
 
@@ -24,6 +77,11 @@ static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
             return NULL;
         }
 
+        if (table[index] & X64_PAGE_HUGE) {
+            // A huge page: there're no lower level tables.
+            return &table[index];
+        }
+
         // Update attributes if given.
         table[index] = table[index] | attrs;
 
@@ -31,7 +89,16 @@ static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
         table = (uint64_t *) paddr2ptr(ENTRY_PADDR(table[index]));
     }
 
-    return &table[NTH_LEVEL_INDEX(1, vaddr)];
+    return &table[NTH_LEVEL_INDEX(target, vaddr)];
+}
+
+/// Returns the physical address mapped to `vaddr` by the entry.
+static paddr_t entry2paddr(uint64_t entry, vaddr_t vaddr) {
+    if (entry & X64_PAGE_HUGE) {
+        return HUGE_ENTRY_PADDR(entry) + (vaddr & (HUGE_PAGE_SIZE - 1));
+    }
+
+    return ENTRY_PADDR(entry);
 }
 
 error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
@@ -48,28 +115,119 @@ error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
             break;
     }
 
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, kpage, attrs);
+    int level = 1;
+    if (flags & MAP_HUGE) {
+        ASSERT(IS_ALIGNED(vaddr, HUGE_PAGE_SIZE));
+        ASSERT(IS_ALIGNED(paddr, HUGE_PAGE_SIZE));
+        level = 2;
+    }
+
+    uint64_t *entry =
+        traverse_page_table(task->arch.pml4, vaddr, level, kpage, attrs);
     if (!entry) {
         return (kpage) ? ERR_TRY_AGAIN : ERR_EMPTY;
     }
 
-    *entry = paddr | attrs;
-    asm_invlpg(vaddr);
+    if (level == 1 && (*entry & X64_PAGE_HUGE)) {
+        // The page is already mapped as a part of a huge page. We don't split
+        // it: accept only if it's mapped as requested.
+        bool same = entry2paddr(*entry, vaddr) == paddr
+                    && (*entry & X64_PAGE_WRITABLE)
+                           == (attrs & X64_PAGE_WRITABLE);
+        return same ? OK : ERR_ALREADY_EXISTS;
+    }
+
+    if (level == 2 && *entry && !(*entry & X64_PAGE_HUGE)) {
+        // A page table is in the entry. Don't replace it with the huge page:
+        // pages mapped in it would be discarded and the table (a kpage owned
+        // by the pager) would be leaked. The caller maps 4KiB pages instead.
+        return ERR_ALREADY_EXISTS;
+    }
+
+    *entry = paddr | attrs | ((level == 2) ? X64_PAGE_HUGE : 0);
     return OK;
 }
 
-error_t arch_vm_unmap(struct task *task, vaddr_t vaddr) {
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 0, 0);
+/// Unmaps the page. `*num_pages` is the number of pages the caller is going to
+/// unmap from `vaddr` and it's updated to the number of unmapped pages.
+///
+/// A huge page is unmapped only as a whole: if only a part of it is to be
+/// unmapped, it returns ERR_NOT_ACCEPTABLE.
+error_t arch_vm_unmap(struct task *task, vaddr_t vaddr, size_t *num_pages) {
+    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 1, 0, 0);
     if (!entry) {
         return ERR_NOT_FOUND;
     }
 
+    if (*entry & X64_PAGE_HUGE) {
+        if (!IS_ALIGNED(vaddr, HUGE_PAGE_SIZE)
+            || *num_pages < HUGE_PAGE_SIZE / PAGE_SIZE) {
+            return ERR_NOT_ACCEPTABLE;
+        }
+
+        *num_pages = HUGE_PAGE_SIZE / PAGE_SIZE;
+    } else {
+        *num_pages = 1;
+    }
+
     *entry = 0;
-    asm_invlpg(vaddr);
     return OK;
 }
 
+void arch_vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    if (task != CURRENT && task->cpu != mp_self()
+        && mp_cpuvar_of(task->cpu)->current_task == task) {
+        // The task is running on another CPU. Marking its TLB entries stale
+        // takes effect only when the CPU switches into the task next time:
+        // make it flush them now. The task keeps running on the CPU until we
+        // release the big lock.
+        mp_tlb_shootdown(task->cpu);
+    }
+
+    if (pcid_enabled) {
+        // Other CPUs flush the TLB entries when they switch into the task next
+        // time.
+        task->arch.tlb_stale_cpus |= ~(1u << mp_self());
+
+        if (task != CURRENT) {
+            if (!invpcid_supported) {
+                // We can't invalidate TLB entries of other PCIDs. Flush them
+                // when switching into the task.
+                task->arch.tlb_stale_cpus |= 1u << mp_self();
+                return;
+            }
+
+            if (num_pages > INVLPG_MAX) {
+                asm_invpcid(INVPCID_TYPE_CONTEXT, task->tid, 0);
+                return;
+            }
+
+            for (size_t i = 0; i < num_pages; i++) {
+                asm_invpcid(INVPCID_TYPE_ADDR, task->tid,
+                            vaddr + i * PAGE_SIZE);
+            }
+            return;
+        }
+    } else if (task != CURRENT) {
+        // The TLB is flushed when switching the page table (CR3), and the
+        // task's entries on the CPU running it have been shot down above: no
+        // stale entries remain in any CPU.
+        return;
+    }
+
+    if (num_pages > INVLPG_MAX) {
+        // Reloading CR3 is cheaper than invalidating each page. It flushes
+        // only the current PCID's entries if PCID is enabled.
+        asm_write_cr3(asm_read_cr3());
+        return;
+    }
+
+    for (size_t i = 0; i < num_pages; i++) {
+        asm_invlpg(vaddr + i * PAGE_SIZE);
+    }
+}
+
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr) {
-    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 0, 0);
-    return (entry) ? ENTRY_PADDR(*entry) : 0;
+    uint64_t *entry = traverse_page_table(task->arch.pml4, vaddr, 1, 0, 0);
+    return (entry && *entry) ? entry2paddr(*entry, vaddr) : 0;
 }
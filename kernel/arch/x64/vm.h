@@ -5,7 +5,8 @@
 
 #define NTH_LEVEL_INDEX(level, vaddr)                                          \
     (((vaddr) >> ((((level) -1) * 9) + 12)) & 0x1ff)
-#define ENTRY_PADDR(entry) ((entry) &0x7ffffffffffff000)
+#define ENTRY_PADDR(entry)      ((entry) &0x7ffffffffffff000)
+#define HUGE_ENTRY_PADDR(entry) ((entry) &0x7fffffffffe00000)
 
 #define X64_PF_PRESENT (1 << 0)
 #define X64_PF_WRITE   (1 << 1)
@@ -14,5 +15,10 @@
 #define X64_PAGE_PRESENT  (1 << 0)
 #define X64_PAGE_WRITABLE (1 << 1)
 #define X64_PAGE_USER     (1 << 2)
+#define X64_PAGE_HUGE     (1 << 7)
+
+struct task;
+void x64_pcid_init(void);
+void x64_load_page_table(struct task *task);
 
 #endif
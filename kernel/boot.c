@@ -123,8 +123,10 @@ static void map_bootelf(struct bootinfo *bootinfo,
 /// Initializes the kernel and starts the first task.
 __noreturn void kmain(struct bootinfo *bootinfo) {
     printf("\nBooting Resea " VERSION " (" GIT_REVISION ")...\n");
-    task_init();
+    // Boot other CPUs first: task_init() initializes runqueues for all CPUs.
+    // They wait for us in lock() until we start context switching.
     mp_start();
+    task_init();
 
     // Look for the boot elf header.
     char name[CONFIG_TASK_NAME_LEN];
@@ -159,8 +161,5 @@ __noreturn void mpmain(void) {
 
     // Start context switching and enable interrupts...
     INFO("Booted CPU #%d", mp_self());
-    if (!mp_is_bsp()) {
-        PANIC("TODO: Support context switching in SMP");
-    }
     arch_idle();
 }
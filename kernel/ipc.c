@@ -42,6 +42,81 @@ static void resume_sender(struct task *receiver, task_t src) {
     receiver->src = src;
 }
 
+/// Copies a message from the user. If it's a short message (MSG_SHORT), only
+/// the header and first few words are copied.
+static void copy_message_from_user(struct message *dst,
+                                   __user const struct message *m) {
+    memcpy_from_user(dst, m, MESSAGE_SHORT_LEN);
+    size_t len = message_len(dst->type);
+    if (len > MESSAGE_SHORT_LEN) {
+        memcpy_from_user((uint8_t *) dst + MESSAGE_SHORT_LEN,
+                         (__user const uint8_t *) m + MESSAGE_SHORT_LEN,
+                         len - MESSAGE_SHORT_LEN);
+    }
+}
+
+static bool has_ool(int type) {
+    return !IS_ERROR(type) && (type & MSG_OOL) != 0;
+}
+
+/// Copies the OoL payload to be sent into the current task's kernel buffer.
+/// Since it may cause page faults, it must be done before the point of no
+/// return in the send phase.
+static error_t copy_ool_from_user(struct message *m) {
+    if (m->ool_len > CONFIG_OOL_BUFFER_LEN) {
+        return ERR_TOO_LARGE;
+    }
+
+    memcpy_from_user(CURRENT->ool_kbuf, (__user const void *) m->ool_ptr,
+                     m->ool_len);
+    return OK;
+}
+
+/// Returns true if the receiver has registered a receive buffer large enough
+/// for the OoL payload in `m`.
+static bool ool_acceptable(struct task *dst, struct message *m) {
+    return dst->ool_buf && m->ool_len <= dst->ool_len;
+}
+
+/// Hands the OoL payload over to the receiver by swapping the kernel buffers:
+/// the receiver's one is not in use since it's waiting for a message.
+static void deliver_ool(struct task *dst) {
+    uint8_t *kbuf = dst->ool_kbuf;
+    dst->ool_kbuf = CURRENT->ool_kbuf;
+    CURRENT->ool_kbuf = kbuf;
+}
+
+/// Copies the received OoL payload into the receive buffer registered by the
+/// current task and updates `m->ool_ptr` to point to it. It may cause page
+/// faults. The sender has checked that the buffer is available (see
+/// ool_acceptable()) but just in case, `m->ool_ptr` is set to NULL if not.
+static void copy_ool_to_user(struct message *m) {
+    if (!ool_acceptable(CURRENT, m)) {
+        WARN_DBG("%s: no OoL receive buffer for %d bytes, dropping the payload",
+                 CURRENT->name, (int) m->ool_len);
+        m->ool_ptr = NULL;
+        return;
+    }
+
+    memcpy_to_user((__user void *) CURRENT->ool_buf, CURRENT->ool_kbuf,
+                   m->ool_len);
+    m->ool_ptr = (void *) CURRENT->ool_buf;
+
+    // The buffer is consumed. The task needs to register a new one.
+    CURRENT->ool_buf = 0;
+    CURRENT->ool_len = 0;
+}
+
+/// Lends the current task's priority to `dst` if it's calling `dst` (see
+/// ipc()). It must be called after the user copies in the send phase: they
+/// may cause a page fault, which calls the pager and lends the priority to it
+/// in the meantime.
+static void lend_priority(struct task *dst, task_t src, unsigned flags) {
+    if ((flags & IPC_CALL) == IPC_CALL && src == dst->tid) {
+        task_lend_priority(CURRENT, dst);
+    }
+}
+
 /// Sends and receives a message. Note that `m` is a user pointer if
 /// IPC_KERNEL is not set!
 static error_t ipc_slowpath(struct task *dst, task_t src,
@@ -55,13 +130,22 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
         if (flags & IPC_KERNEL) {
             memcpy(&tmp_m, (const void *) m, sizeof(struct message));
         } else {
-            memcpy_from_user(&tmp_m, m, sizeof(struct message));
+            copy_message_from_user(&tmp_m, m);
+            if (has_ool(tmp_m.type)) {
+                error_t err = copy_ool_from_user(&tmp_m);
+                if (err != OK) {
+                    return err;
+                }
+            }
         }
 
+        lend_priority(dst, src, flags);
+
         // Check whether the destination (receiver) task is ready for receiving.
         bool receiver_is_ready =
             dst->state == TASK_BLOCKED
             && (dst->src == IPC_ANY || dst->src == CURRENT->tid);
+        bool resumed_by_receiver = !receiver_is_ready;
         if (!receiver_is_ready) {
             if (flags & IPC_NOBLOCK) {
                 return ERR_WOULD_BLOCK;
@@ -81,6 +165,17 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
             }
         }
 
+        if ((flags & IPC_KERNEL) == 0 && has_ool(tmp_m.type)
+            && !ool_acceptable(dst, &tmp_m)) {
+            // Let the receiver accept other senders instead of waiting for us
+            // unless it waits for our reply.
+            if (resumed_by_receiver && dst->callee != CURRENT) {
+                resume_sender(dst, IPC_ANY);
+            }
+
+            return ERR_TOO_LARGE;
+        }
+
         // We've gone beyond the point of no return. We must not abort the
         // sending from here: don't return an error or cause a page fault!
         //
@@ -88,7 +183,15 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
 
         // Copy the message.
         tmp_m.src = (flags & IPC_KERNEL) ? KERNEL_TASK : CURRENT->tid;
-        memcpy(&dst->m, &tmp_m, sizeof(dst->m));
+        memcpy(&dst->m, &tmp_m, message_len(tmp_m.type));
+        if ((flags & IPC_KERNEL) == 0 && has_ool(tmp_m.type)) {
+            deliver_ool(dst);
+        }
+
+        // If it's a reply, the receiver no longer lends its priority to us.
+        if (dst->callee == CURRENT) {
+            task_return_priority(dst);
+        }
 
         // Resume the receiver task.
         task_resume(dst);
@@ -110,7 +213,9 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
             tmp_m.notifications.data = CURRENT->notifications;
             CURRENT->notifications = 0;
         } else {
-            if ((flags & IPC_NOBLOCK) != 0) {
+            // If it's combined with IPC_SEND (ipc_replyrecv), IPC_NOBLOCK
+            // applies only to the send phase.
+            if ((flags & IPC_NOBLOCK) != 0 && (flags & IPC_SEND) == 0) {
                 return ERR_WOULD_BLOCK;
             }
 
@@ -122,14 +227,18 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
 
             // Copy into `tmp_m` since memcpy_to_user may cause a page fault and
             // CURRENT->m will be overwritten by page fault mesages.
-            memcpy(&tmp_m, &CURRENT->m, sizeof(struct message));
+            memcpy(&tmp_m, &CURRENT->m, message_len(CURRENT->m.type));
         }
 
         // Received a message. Copy it into the receiver buffer.
         if (flags & IPC_KERNEL) {
             memcpy((void *) m, &tmp_m, sizeof(struct message));
         } else {
-            memcpy_to_user(m, &tmp_m, sizeof(struct message));
+            if (has_ool(tmp_m.type)) {
+                copy_ool_to_user(&tmp_m);
+            }
+
+            memcpy_to_user(m, &tmp_m, message_len(tmp_m.type));
         }
     }
 
@@ -139,13 +248,8 @@ static error_t ipc_slowpath(struct task *dst, task_t src,
 /// The IPC fastpath: an IPC implementation optimized for the common case.
 ///
 /// Note that `m` is a user pointer if IPC_KERNEL is not set!
-error_t ipc(struct task *dst, task_t src, __user struct message *m,
-            unsigned flags) {
-    if (dst == CURRENT) {
-        WARN_DBG("%s: tried to send a message to myself", CURRENT->name);
-        return ERR_INVALID_ARG;
-    }
-
+static error_t ipc_fastpath(struct task *dst, task_t src,
+                            __user struct message *m, unsigned flags) {
 #ifdef CONFIG_IPC_FASTPATH
     // Check if the message can be sent in the fastpath.
     DEBUG_ASSERT((flags & IPC_SEND) == 0 || dst);
@@ -162,32 +266,71 @@ error_t ipc(struct task *dst, task_t src, __user struct message *m,
         return ipc_slowpath(dst, src, m, flags);
     }
 
-    // THe send phase: copy the message and resume the receiver task. Note
-    // that this user copy may cause a page fault.
-    memcpy_from_user(&dst->m, m, sizeof(struct message));
+    // THe send phase: copy the message into the receiver's buffer. Note that
+    // this user copy may cause a page fault.
+    copy_message_from_user(&dst->m, m);
+    if (has_ool(dst->m.type)) {
+        // OoL payloads are handled in the slowpath. It's fine to have
+        // overwritten the receiver's buffer: it's waiting for a message.
+        return ipc_slowpath(dst, src, m, flags);
+    }
+
+    lend_priority(dst, src, flags);
     dst->m.src = CURRENT->tid;
-    task_resume(dst);
+    if (dst->callee == CURRENT) {
+        task_return_priority(dst);
+    }
 
 #    ifdef CONFIG_TRACE_IPC
     TRACE("IPC: %s: %s -> %s (fastpath)", msgtype2str(dst->m.type),
           CURRENT->name, dst->name);
 #    endif
 
-    // The receive phase: wait for a message, copy it into the user's
-    // buffer, and return to the user.
+    // The receive phase: wait for a message. Instead of resuming the receiver
+    // through the runqueue, switch into it directly: the current task is
+    // going to be blocked anyway.
     resume_sender(CURRENT, src);
     task_block(CURRENT);
-    task_switch();
+    task_switch_to(dst);
+
+    if (has_ool(CURRENT->m.type)) {
+        // Copy into `tmp_m` since copying the OoL payload may cause a page
+        // fault and CURRENT->m will be overwritten by page fault messages.
+        struct message tmp_m;
+        memcpy(&tmp_m, &CURRENT->m, message_len(CURRENT->m.type));
+        copy_ool_to_user(&tmp_m);
+        memcpy_to_user(m, &tmp_m, message_len(tmp_m.type));
+        return OK;
+    }
 
     // This user copy should not cause a page fault since we've filled the
     // page in the user copy above.
-    memcpy_to_user(m, &CURRENT->m, sizeof(struct message));
+    memcpy_to_user(m, &CURRENT->m, message_len(CURRENT->m.type));
     return OK;
 #else
     return ipc_slowpath(dst, src, m, flags);
 #endif  // CONFIG_IPC_FASTPATH
 }
 
+/// Sends and/or receives a message.
+///
+/// Note that `m` is a user pointer if IPC_KERNEL is not set!
+error_t ipc(struct task *dst, task_t src, __user struct message *m,
+            unsigned flags) {
+    if (dst == CURRENT) {
+        WARN_DBG("%s: tried to send a message to myself", CURRENT->name);
+        return ERR_INVALID_ARG;
+    }
+
+    // If it's a call, the current task lends its priority to the callee
+    // (including the pager in the page fault handler) until it replies.
+    // Otherwise, tasks with priorities between them may delay the reply
+    // indefinitely. The send phase lends it in lend_priority().
+    error_t err = ipc_fastpath(dst, src, m, flags);
+    task_return_priority(CURRENT);
+    return err;
+}
+
 // Notifies notifications to the task.
 void notify(struct task *dst, notifications_t notifications) {
     if (dst->state == TASK_BLOCKED && dst->src == IPC_ANY) {
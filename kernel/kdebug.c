@@ -11,11 +11,14 @@ error_t kdebug_run(const char *cmdline, char *buf, size_t len) {
     } else if (strcmp(cmdline, "help") == 0) {
         INFO("Kernel debugger commands:");
         INFO("");
-        INFO("  ps - List tasks.");
-        INFO("  q  - Quit the emulator.");
+        INFO("  ps   - List tasks.");
+        INFO("  cpus - Show per-CPU scheduler states and IPI counters.");
+        INFO("  q    - Quit the emulator.");
         INFO("");
     } else if (strcmp(cmdline, "ps") == 0) {
         task_dump();
+    } else if (strcmp(cmdline, "cpus") == 0) {
+        task_dump_cpus();
     } else if (strcmp(cmdline, "q") == 0) {
 #ifdef CONFIG_SEMIHOSTING
         arch_semihosting_halt();
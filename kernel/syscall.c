@@ -121,6 +121,18 @@ static error_t sys_ipc(task_t dst, task_t src, __user struct message *m,
     return ipc(dst_task, src, m, flags);
 }
 
+/// Registers a receive buffer for an OoL payload. The kernel copies the next
+/// received OoL payload into the buffer and unregisters it.
+static error_t sys_ool_recv(vaddr_t buf, size_t len) {
+    if (is_kernel_addr_range(buf, len)) {
+        return ERR_INVALID_ARG;
+    }
+
+    CURRENT->ool_buf = buf;
+    CURRENT->ool_len = len;
+    return OK;
+}
+
 /// Sends notifications.
 static error_t sys_notify(task_t dst, notifications_t notifications) {
     struct task *dst_task = task_lookup(dst);
@@ -132,10 +144,13 @@ static error_t sys_notify(task_t dst, notifications_t notifications) {
     return OK;
 }
 
-/// Sets task's timer.
-static error_t sys_timer_set(msec_t timeout) {
-    CURRENT->timeout = timeout;
-    return OK;
+/// Sets task's timer. Returns the remaining time of the previous timer.
+static msec_t sys_timer_set(msec_t timeout) {
+    if (timeout < 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    return task_set_timer(CURRENT, timeout);
 }
 
 /// Acquires an IRQ ownership.
@@ -177,8 +192,8 @@ static error_t sys_vm_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
         return ERR_NOT_PERMITTED;
     }
 
-    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(src, PAGE_SIZE)
-        || !IS_ALIGNED(kpage, PAGE_SIZE)) {
+    if ((flags & MAP_HUGE) || !IS_ALIGNED(vaddr, PAGE_SIZE)
+        || !IS_ALIGNED(src, PAGE_SIZE) || !IS_ALIGNED(kpage, PAGE_SIZE)) {
         return ERR_INVALID_ARG;
     }
 
@@ -210,10 +225,149 @@ static error_t sys_vm_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
         return ERR_INVALID_TASK;
     }
 
-    return vm_map(task, vaddr, paddr, kpage_paddr, flags);
+    error_t err = vm_map(task, vaddr, paddr, kpage_paddr, flags);
+    if (err == OK) {
+        vm_flush(task, vaddr, 1);
+    }
+
+    return err;
+}
+
+/// Returns true if the source pages starting at `src` are mapped to physically
+/// contiguous pages from `paddr` and can be mapped as a huge page.
+static bool is_huge_page_mappable(vaddr_t src, paddr_t paddr) {
+    if (!IS_ALIGNED(paddr, HUGE_PAGE_SIZE)) {
+        return false;
+    }
+
+    for (offset_t off = 0; off < HUGE_PAGE_SIZE; off += PAGE_SIZE) {
+        if (resolve_paddr(src + off) != paddr + off
+            || is_kernel_paddr(paddr + off)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Maps contiguous memory pages in the task's virtual memory space at once.
+/// The kernel consumes `kpages` for page table structures from the front and
+/// returns the number of consumed ones in `used_kpages`.
+///
+/// If it runs out of kpages, it returns ERR_TRY_AGAIN. The caller should call
+/// this again with new kpages: already mapped pages are simply overwritten.
+///
+/// If the arch supports huge pages and the addresses are aligned, pages are
+/// mapped as huge pages to save TLB entries.
+static error_t sys_vm_map_range(task_t tid,
+                                __user struct vm_map_range *urange) {
+    if (!CAPABLE(CURRENT, CAP_MAP)) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    struct vm_map_range range;
+    memcpy_from_user(&range, urange, sizeof(range));
+    if ((range.flags & MAP_HUGE) || !IS_ALIGNED(range.vaddr, PAGE_SIZE)
+        || !IS_ALIGNED(range.src, PAGE_SIZE)
+        || range.num_kpages > VM_MAP_KPAGES_MAX
+        || range.num_pages > ((size_t) -1) / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    if (is_kernel_addr_range(range.vaddr, range.num_pages * PAGE_SIZE)) {
+        WARN_DBG("vaddr %p points to a kernel memory area", range.vaddr);
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    paddr_t kpages[VM_MAP_KPAGES_MAX];
+    for (unsigned i = 0; i < range.num_kpages; i++) {
+        if (!IS_ALIGNED(range.kpages[i], PAGE_SIZE)) {
+            return ERR_INVALID_ARG;
+        }
+
+        kpages[i] = resolve_paddr(range.kpages[i]);
+        if (!kpages[i]) {
+            return ERR_NOT_FOUND;
+        }
+
+        if (is_kernel_paddr(kpages[i])) {
+            WARN_DBG("kpage %p points to a kernel memory area",
+                     range.kpages[i]);
+            return ERR_NOT_ACCEPTABLE;
+        }
+    }
+
+    struct task *task = task_lookup(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    error_t err = OK;
+    unsigned used = 0;
+    size_t i = 0;
+    // Pages below this address are mapped with 4KiB pages: a page table is
+    // already there.
+    vaddr_t no_huge_end = 0;
+    while (i < range.num_pages) {
+        offset_t off = i * PAGE_SIZE;
+        paddr_t paddr = resolve_paddr(range.src + off);
+        if (!paddr) {
+            err = ERR_NOT_FOUND;
+            break;
+        }
+
+        if (is_kernel_paddr(paddr)) {
+            WARN_DBG("paddr %p points to a kernel memory area", paddr);
+            err = ERR_NOT_ACCEPTABLE;
+            break;
+        }
+
+        vaddr_t vaddr = range.vaddr + off;
+        size_t num_pages = 1;
+        unsigned flags = range.flags;
+        if (HUGE_PAGE_SIZE && IS_ALIGNED(vaddr, HUGE_PAGE_SIZE)
+            && vaddr >= no_huge_end
+            && range.num_pages - i >= HUGE_PAGE_SIZE / PAGE_SIZE
+            && is_huge_page_mappable(range.src + off, paddr)) {
+            num_pages = HUGE_PAGE_SIZE / PAGE_SIZE;
+            flags |= MAP_HUGE;
+        }
+
+        paddr_t kpage = (used < range.num_kpages) ? kpages[used] : 0;
+        err = vm_map(task, vaddr, paddr, kpage, flags);
+        if (err == ERR_TRY_AGAIN) {
+            // The kpage is consumed. Try the same page again.
+            used++;
+            continue;
+        }
+
+        if (err == ERR_ALREADY_EXISTS && (flags & MAP_HUGE)) {
+            // A page table is already in use for the huge page. Map 4KiB
+            // pages in it instead.
+            no_huge_end = vaddr + HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (err == ERR_EMPTY) {
+            // Ran out of kpages.
+            err = ERR_TRY_AGAIN;
+            break;
+        }
+
+        if (err != OK) {
+            break;
+        }
+
+        i += num_pages;
+    }
+
+    vm_flush(task, range.vaddr, i);
+    memcpy_to_user(&urange->used_kpages, &used, sizeof(used));
+    return err;
 }
 
-/// Unmaps a memory page from the task's virtual memory space.
+/// Unmaps a memory page from the task's virtual memory space. It returns
+/// ERR_NOT_ACCEPTABLE if the page is a part of a huge page.
 static error_t sys_vm_unmap(task_t tid, vaddr_t vaddr) {
     if (!CAPABLE(CURRENT, CAP_MAP)) {
         return ERR_NOT_PERMITTED;
@@ -228,7 +382,54 @@ static error_t sys_vm_unmap(task_t tid, vaddr_t vaddr) {
         return ERR_INVALID_TASK;
     }
 
-    return vm_unmap(task, vaddr);
+    size_t num_pages = 1;
+    error_t err = vm_unmap(task, vaddr, &num_pages);
+    if (err == OK) {
+        vm_flush(task, vaddr, 1);
+    }
+
+    return err;
+}
+
+/// Unmaps contiguous memory pages from the task's virtual memory space. Pages
+/// which are not mapped are ignored. Huge pages must be unmapped as a whole:
+/// if the range covers only a part of a huge page, it returns
+/// ERR_NOT_ACCEPTABLE.
+static error_t sys_vm_unmap_range(task_t tid, vaddr_t vaddr, size_t num_pages) {
+    if (!CAPABLE(CURRENT, CAP_MAP)) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE)
+        || num_pages > ((size_t) -1) / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    if (is_kernel_addr_range(vaddr, num_pages * PAGE_SIZE)) {
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    struct task *task = task_lookup(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    size_t i = 0;
+    while (i < num_pages) {
+        size_t unmapped = num_pages - i;
+        error_t err = vm_unmap(task, vaddr + i * PAGE_SIZE, &unmapped);
+        if (err == ERR_NOT_FOUND) {
+            unmapped = 1;
+        } else if (err != OK) {
+            vm_flush(task, vaddr, i);
+            return err;
+        }
+
+        i += unmapped;
+    }
+
+    vm_flush(task, vaddr, num_pages);
+    return OK;
 }
 
 /// Writes log messages into the arch's console (typically a serial port) and
@@ -344,6 +545,15 @@ long handle_syscall(int n, long a1, long a2, long a3, long a4, long a5) {
         case SYS_VM_UNMAP:
             ret = sys_vm_unmap(a1, a2);
             break;
+        case SYS_VM_MAP_RANGE:
+            ret = sys_vm_map_range(a1, (__user struct vm_map_range *) a2);
+            break;
+        case SYS_VM_UNMAP_RANGE:
+            ret = sys_vm_unmap_range(a1, a2, a3);
+            break;
+        case SYS_OOL_RECV:
+            ret = sys_ool_recv(a1, a2);
+            break;
         case SYS_IRQ_ACQUIRE:
             ret = sys_irq_acquire(a1);
             break;
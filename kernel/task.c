@@ -11,14 +11,213 @@
 
 /// All tasks.
 static struct task tasks[CONFIG_NUM_TASKS];
-/// A queue of runnable tasks excluding currently running tasks. Lower index
-/// means higher priority.
-static list_t runqueues[TASK_PRIORITY_MAX];
 /// IRQ owners.
 static struct task *irq_owners[IRQ_MAX];
+/// Kernel buffers for OoL payloads (see `task->ool_kbuf`).
+static uint8_t ool_kbufs[CONFIG_NUM_TASKS][CONFIG_OOL_BUFFER_LEN];
+/// The number of ticks elapsed since the boot. It's updated only by the BSP.
+static uint64_t uptime_ticks = 0;
+/// A binary min-heap of tasks whose timer is set, keyed on `task->timeout`.
+static struct task *timer_heap[CONFIG_NUM_TASKS];
+/// The number of tasks in `timer_heap`.
+static int timer_heap_len = 0;
+
+static void runqueue_lock(struct cpuvar *cpuvar) {
+    while (__sync_lock_test_and_set(&cpuvar->runqueue_lock, 1)) {}
+}
+
+static void runqueue_unlock(struct cpuvar *cpuvar) {
+    __sync_lock_release(&cpuvar->runqueue_lock);
+}
 
+/// Appends a task into the runqueue of the CPU `task->cpu`.
 static void enqueue_task(struct task *task) {
-    list_push_back(&runqueues[task->priority], &task->runqueue_next);
+    struct cpuvar *cpuvar = mp_cpuvar_of(task->cpu);
+    runqueue_lock(cpuvar);
+    list_push_back(&cpuvar->runqueues[task->priority], &task->runqueue_next);
+    cpuvar->num_runnable++;
+    runqueue_unlock(cpuvar);
+}
+
+/// Removes a task from the runqueue if it's queued.
+static void dequeue_task(struct task *task) {
+    struct cpuvar *cpuvar = mp_cpuvar_of(task->cpu);
+    runqueue_lock(cpuvar);
+    if (task->runqueue_next.next) {
+        list_remove(&task->runqueue_next);
+        cpuvar->num_runnable--;
+    }
+    runqueue_unlock(cpuvar);
+}
+
+/// Pops the runnable task with the highest priority from the CPU's runqueue.
+/// Tasks with the same priority are popped in round-robin fashion.
+static struct task *pop_task(struct cpuvar *cpuvar) {
+    // Peek the counter without the lock to avoid touching other CPU's
+    // cacheline when it has nothing to give.
+    if (!cpuvar->num_runnable) {
+        return NULL;
+    }
+
+    struct task *task = NULL;
+    runqueue_lock(cpuvar);
+    for (int i = 0; i < TASK_PRIORITY_MAX; i++) {
+        task = LIST_POP_FRONT(&cpuvar->runqueues[i], struct task,
+                              runqueue_next);
+        if (task) {
+            cpuvar->num_runnable--;
+            break;
+        }
+    }
+    runqueue_unlock(cpuvar);
+    return task;
+}
+
+/// Steals a runnable task from other CPUs. It visits CPUs in round-robin
+/// order starting from the next one so that idle CPUs don't pile on the
+/// same victim.
+static struct task *steal_task(void) {
+    int num_cpus = mp_num_cpus();
+    for (int i = 1; i < num_cpus; i++) {
+        int cpu = (mp_self() + i) % num_cpus;
+        struct task *task = pop_task(mp_cpuvar_of(cpu));
+        if (task) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/// Returns true if the CPU is idle and has nothing to do.
+static bool cpu_is_idle(int cpu) {
+    struct cpuvar *cpuvar = mp_cpuvar_of(cpu);
+    return cpuvar->current_task == &cpuvar->idle_task && !cpuvar->num_runnable;
+}
+
+/// Determines the CPU to run a resumed task on.
+static int pick_cpu(struct task *task) {
+    // Keep the task on the local CPU. It's the common case in IPC: the current
+    // task will be blocked soon to wait for a reply from `task`.
+    if (task->cpu == mp_self() || cpu_is_idle(task->cpu)) {
+        return task->cpu;
+    }
+
+    if (CURRENT == IDLE_TASK) {
+        return mp_self();
+    }
+
+    // The CPU which the task ran on is busy. Migrate the task to an idle CPU
+    // if exists.
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        if (cpu != mp_self() && cpu_is_idle(cpu)) {
+            return cpu;
+        }
+    }
+
+    return task->cpu;
+}
+
+/// Asks the CPU which the task is queued in to reschedule if needed.
+static void kick_cpu(struct task *task) {
+    if (task->cpu == mp_self()) {
+        // The task will be picked by the local scheduler. No IPI is needed.
+        get_cpuvar()->num_ipis_skipped++;
+        return;
+    }
+
+    // Interrupt the CPU only if the task should preempt the running one.
+    struct cpuvar *cpuvar = mp_cpuvar_of(task->cpu);
+    struct task *running = cpuvar->current_task;
+    if (running == &cpuvar->idle_task || running->priority > task->priority) {
+        mp_reschedule(task->cpu);
+        get_cpuvar()->num_ipis_sent++;
+    } else {
+        get_cpuvar()->num_ipis_skipped++;
+    }
+}
+
+static void timer_heap_set(int i, struct task *task) {
+    timer_heap[i] = task;
+    task->timer_index = i;
+}
+
+static void timer_heap_sift_up(int i) {
+    struct task *task = timer_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->timeout <= task->timeout) {
+            break;
+        }
+
+        timer_heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+
+    timer_heap_set(i, task);
+}
+
+static void timer_heap_sift_down(int i) {
+    struct task *task = timer_heap[i];
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= timer_heap_len) {
+            break;
+        }
+
+        if (child + 1 < timer_heap_len
+            && timer_heap[child + 1]->timeout < timer_heap[child]->timeout) {
+            child++;
+        }
+
+        if (task->timeout <= timer_heap[child]->timeout) {
+            break;
+        }
+
+        timer_heap_set(i, timer_heap[child]);
+        i = child;
+    }
+
+    timer_heap_set(i, task);
+}
+
+/// Removes the task from the timer heap if its timer is set.
+static void timer_heap_remove(struct task *task) {
+    int i = task->timer_index;
+    if (i < 0) {
+        return;
+    }
+
+    task->timer_index = -1;
+    task->timeout = 0;
+    timer_heap_len--;
+    if (i == timer_heap_len) {
+        return;
+    }
+
+    // Fill the hole with the last element and restore the heap property.
+    timer_heap_set(i, timer_heap[timer_heap_len]);
+    timer_heap_sift_up(i);
+    timer_heap_sift_down(timer_heap[i]->timer_index);
+}
+
+static void timer_heap_push(struct task *task) {
+    DEBUG_ASSERT(task->timer_index < 0);
+    DEBUG_ASSERT(timer_heap_len < CONFIG_NUM_TASKS);
+    timer_heap_set(timer_heap_len, task);
+    timer_heap_len++;
+    timer_heap_sift_up(timer_heap_len - 1);
+}
+
+/// Advances the clock and notifies tasks whose timer has expired. It costs
+/// O(expired timers) regardless of the number of tasks.
+static void advance_clock(unsigned ticks) {
+    uptime_ticks += ticks;
+    while (timer_heap_len > 0 && timer_heap[0]->timeout <= uptime_ticks) {
+        struct task *task = timer_heap[0];
+        timer_heap_remove(task);
+        notify(task, NOTIFY_TIMER);
+    }
 }
 
 /// Returns the task struct for the task ID. It returns NULL if the ID is
@@ -91,14 +290,22 @@ error_t task_create(struct task *task, const char *name, vaddr_t ip,
     task->pager = pager;
     task->src = IPC_DENY;
     task->timeout = 0;
+    task->timer_index = -1;
     task->quantum = 0;
     task->priority = TASK_PRIORITY_MAX - 1;
+    task->base_priority = TASK_PRIORITY_MAX - 1;
+    task->callee = NULL;
+    task->ool_buf = 0;
+    task->ool_len = 0;
+    task->cpu = mp_self();
     task->ref_count = 0;
     bitmap_fill(task->caps, sizeof(task->caps), (flags & TASK_ALL_CAPS) != 0);
     strncpy2(task->name, name, sizeof(task->name));
     list_init(&task->senders);
+    list_init(&task->donors);
     list_nullify(&task->runqueue_next);
     list_nullify(&task->sender_next);
+    list_nullify(&task->donor_next);
 
     if (pager) {
         pager->ref_count++;
@@ -133,8 +340,10 @@ error_t task_destroy(struct task *task) {
     }
 
     TRACE("destroying %s...", task->name);
-    list_remove(&task->runqueue_next);
+    dequeue_task(task);
+    timer_heap_remove(task);
     list_remove(&task->sender_next);
+    task_return_priority(task);
     arch_task_destroy(task);
     task->state = TASK_UNUSED;
 
@@ -148,6 +357,12 @@ error_t task_destroy(struct task *task) {
         list_remove(&sender->sender_next);
     }
 
+    // Take back the priority lent by the callers.
+    LIST_FOR_EACH (donor, &task->donors, struct task, donor_next) {
+        list_remove(&donor->donor_next);
+        donor->callee = NULL;
+    }
+
     // Release IRQ ownership.
     for (unsigned irq = 0; irq < IRQ_MAX; irq++) {
         if (irq_owners[irq] == task) {
@@ -193,8 +408,44 @@ void task_block(struct task *task) {
 void task_resume(struct task *task) {
     DEBUG_ASSERT(task->state == TASK_BLOCKED);
     task->state = TASK_RUNNABLE;
+    task->cpu = pick_cpu(task);
     enqueue_task(task);
-    mp_reschedule();
+    kick_cpu(task);
+}
+
+/// Computes the effective priority of the task: the highest one among its
+/// own priority and the ones lent by its callers.
+static int effective_priority(struct task *task) {
+    int priority = task->base_priority;
+    LIST_FOR_EACH (donor, &task->donors, struct task, donor_next) {
+        priority = MIN(priority, donor->priority);
+    }
+
+    return priority;
+}
+
+/// Updates the effective priority of the task and the tasks it's calling
+/// (nested calls).
+static void update_priority(struct task *task) {
+    while (task) {
+        int priority = effective_priority(task);
+        if (priority == task->priority) {
+            break;
+        }
+
+        // Move the task into the runqueue for the new priority if it's queued.
+        bool queued = task->state == TASK_RUNNABLE && task->runqueue_next.next;
+        if (queued) {
+            dequeue_task(task);
+        }
+
+        task->priority = priority;
+        if (queued) {
+            enqueue_task(task);
+        }
+
+        task = task->callee;
+    }
 }
 
 /// Updates the scheduling policy for the task.
@@ -203,13 +454,31 @@ error_t task_schedule(struct task *task, int priority) {
         return ERR_INVALID_ARG;
     }
 
-    task->priority = priority;
-    if (task->state == TASK_RUNNABLE) {
-        list_remove(&task->runqueue_next);
-        enqueue_task(task);
+    task->base_priority = priority;
+    update_priority(task);
+    return OK;
+}
+
+/// Lends the task's priority to `callee` until the task receives the reply
+/// (or aborts the call). Called when the task starts calling `callee`.
+void task_lend_priority(struct task *task, struct task *callee) {
+    DEBUG_ASSERT(task->callee == NULL);
+    task->callee = callee;
+    list_push_back(&callee->donors, &task->donor_next);
+    update_priority(callee);
+}
+
+/// Takes back the priority lent by `task_lend_priority()`. It does nothing if
+/// the task has already taken it back.
+void task_return_priority(struct task *task) {
+    struct task *callee = task->callee;
+    if (!callee) {
+        return;
     }
 
-    return OK;
+    list_remove(&task->donor_next);
+    task->callee = NULL;
+    update_priority(callee);
 }
 
 /// Picks the next task to run.
@@ -219,14 +488,17 @@ static struct task *scheduler(struct task *current) {
         enqueue_task(current);
     }
 
-    // Look for the task with the highest priority. Tasks with the same priority
-    // is scheduled in round-robin fashion.
-    for (int i = 0; i < TASK_PRIORITY_MAX; i++) {
-        struct task *next =
-            LIST_POP_FRONT(&runqueues[i], struct task, runqueue_next);
-        if (next) {
-            return next;
-        }
+    // Look for the task with the highest priority in the local runqueue.
+    struct task *next = pop_task(get_cpuvar());
+    if (next) {
+        return next;
+    }
+
+    // This CPU has nothing to do. Try stealing a task from busy CPUs.
+    next = steal_task();
+    if (next) {
+        next->cpu = mp_self();
+        return next;
     }
 
     return IDLE_TASK;
@@ -252,6 +524,28 @@ void task_switch(void) {
     stack_check();
 }
 
+/// Switches into `next` directly without going through the runqueues: used
+/// in the IPC fastpath to hand the CPU over to the receiver. The current task
+/// must have been blocked. `next` inherits the remaining time slice of the
+/// current task.
+void task_switch_to(struct task *next) {
+    stack_check();
+
+    struct task *prev = CURRENT;
+    DEBUG_ASSERT(prev != next);
+    DEBUG_ASSERT(prev->state == TASK_BLOCKED);
+    DEBUG_ASSERT(next->state == TASK_BLOCKED);
+    DEBUG_ASSERT(!next->runqueue_next.next);
+
+    next->state = TASK_RUNNABLE;
+    next->cpu = mp_self();
+    next->quantum = MAX(prev->quantum, 0);
+    CURRENT = next;
+    arch_task_switch(prev, next);
+
+    stack_check();
+}
+
 /// Starts receiving notifications by IRQs.
 error_t task_listen_irq(struct task *task, unsigned irq) {
     if (irq >= IRQ_MAX) {
@@ -282,6 +576,8 @@ error_t task_unlisten_irq(unsigned irq) {
 
 /// Maps a memory page in the task's virtual memory space. `kpage` is a memory
 /// page which provides a memory page for arch-specific page table structures.
+///
+/// It doesn't flush the TLB: call vm_flush() after updating the page table.
 __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                          paddr_t kpage, unsigned flags) {
     DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
@@ -291,7 +587,8 @@ __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
     // Prevent corrupting kernel memory. Note that the user is still able to
     // bypass this check to access the kernel memory by mapping the page table
     // structures.
-    if (is_kernel_addr_range(vaddr, PAGE_SIZE)) {
+    size_t len = (flags & MAP_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    if (is_kernel_addr_range(vaddr, len)) {
         WARN_DBG("vaddr %p points to a kernel memory area", vaddr);
         return ERR_NOT_ACCEPTABLE;
     }
@@ -300,8 +597,13 @@ __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
     return arch_vm_map(task, vaddr, paddr, kpage, flags);
 }
 
-/// Unmaps a memory page from the task's virtual memory space.
-error_t vm_unmap(struct task *task, vaddr_t vaddr) {
+/// Unmaps a memory page from the task's virtual memory space. Call vm_flush()
+/// after updating the page table.
+///
+/// `*num_pages` is the number of pages to be unmapped from `vaddr`. It's
+/// updated to the number of pages actually unmapped: more than one if it's a
+/// huge page. A part of a huge page can't be unmapped (ERR_NOT_ACCEPTABLE).
+error_t vm_unmap(struct task *task, vaddr_t vaddr, size_t *num_pages) {
     DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
 
     paddr_t paddr = vm_resolve(task, vaddr);
@@ -309,33 +611,90 @@ error_t vm_unmap(struct task *task, vaddr_t vaddr) {
         return ERR_NOT_FOUND;
     }
 
-    return arch_vm_unmap(task, vaddr);
+    return arch_vm_unmap(task, vaddr, num_pages);
+}
+
+/// Flushes the TLB entries of the pages in the task's virtual memory space.
+/// Updating multiple pages and then flushing them at once is much cheaper
+/// than flushing each page.
+void vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    arch_vm_flush(task, vaddr, num_pages);
+}
+
+/// Sets the task's timer. It cancels the timer if `timeout` is 0. Returns the
+/// remaining time of the previous timer in milliseconds (0 if it's not set).
+msec_t task_set_timer(struct task *task, msec_t timeout) {
+    msec_t remaining = 0;
+    if (task->timer_index >= 0 && task->timeout > uptime_ticks) {
+        uint64_t ticks = task->timeout - uptime_ticks;
+        remaining = (ticks * 1000 + TICK_HZ - 1) / TICK_HZ;
+    }
+
+    timer_heap_remove(task);
+    if (timeout > 0) {
+        uint64_t ticks = ((uint64_t) timeout * TICK_HZ + 999) / 1000;
+        task->timeout = uptime_ticks + ticks;
+        timer_heap_push(task);
+    }
+
+    return remaining;
+}
+
+/// Determines whether the current (idle) CPU is allowed to stop the periodic
+/// timer interrupt. If so, it returns true and sets `*ticks` to the number of
+/// ticks until the nearest timer expires (0 if no timers are set).
+bool task_tickless_enter(unsigned *ticks) {
+    DEBUG_ASSERT(CURRENT == IDLE_TASK);
+    if (get_cpuvar()->num_runnable) {
+        return false;
+    }
+
+    *ticks = 0;
+    if (!mp_is_bsp()) {
+        // Only the BSP keeps the time. Other CPUs are woken up by IPIs.
+        return true;
+    }
+
+    // The clock is updated only when the BSP wakes up. Keep ticking if other
+    // CPUs are running tasks: they may set timers based on the clock.
+    for (int cpu = 1; cpu < mp_num_cpus(); cpu++) {
+        if (!cpu_is_idle(cpu)) {
+            return false;
+        }
+    }
+
+    if (timer_heap_len > 0) {
+        if (timer_heap[0]->timeout <= uptime_ticks) {
+            return false;
+        }
+
+        uint64_t delta = timer_heap[0]->timeout - uptime_ticks;
+        *ticks = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+    }
+
+    return true;
+}
+
+/// Accounts the ticks elapsed while the CPU stopped the periodic timer.
+void task_tickless_exit(unsigned elapsed) {
+    if (mp_is_bsp()) {
+        advance_clock(elapsed);
+    }
 }
 
 /// Handles timer interrupts. The timer fires this handler every 1/TICK_HZ
 /// seconds.
 void handle_timer_irq(void) {
-    bool resumed_by_timeout = false;
     if (mp_is_bsp()) {
-        // Handle task timeouts.
-        for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
-            struct task *task = &tasks[i];
-            if (task->state == TASK_UNUSED || !task->timeout) {
-                continue;
-            }
-
-            task->timeout--;
-            if (!task->timeout) {
-                notify(task, NOTIFY_TIMER);
-                resumed_by_timeout = true;
-            }
-        }
+        advance_clock(1);
     }
 
-    // Switch task if the current task has spend its time slice.
+    // Switch task if the current task has spend its time slice or the idle
+    // CPU got tasks to run (e.g. resumed by timeouts).
     DEBUG_ASSERT(CURRENT == IDLE_TASK || CURRENT->quantum >= 0);
     CURRENT->quantum--;
-    if (CURRENT->quantum < 0 || (CURRENT == IDLE_TASK && resumed_by_timeout)) {
+    if (CURRENT->quantum < 0
+        || (CURRENT == IDLE_TASK && get_cpuvar()->num_runnable)) {
         task_switch();
     }
 }
@@ -395,15 +754,37 @@ void task_dump(void) {
     }
 }
 
+/// Prints the per-CPU scheduler states. Used for debugging.
+void task_dump_cpus(void) {
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        struct cpuvar *cpuvar = mp_cpuvar_of(cpu);
+        struct task *current = cpuvar->current_task;
+        INFO("CPU #%d: current=%s, runnable=%u, ipis_sent=%u, ipis_skipped=%u",
+             cpu, current ? current->name : "(none)", cpuvar->num_runnable,
+             cpuvar->num_ipis_sent, cpuvar->num_ipis_skipped);
+    }
+}
+
 /// Initializes the task subsystem.
 void task_init(void) {
-    for (int i = 0; i < TASK_PRIORITY_MAX; i++) {
-        list_init(&runqueues[i]);
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        struct cpuvar *cpuvar = mp_cpuvar_of(cpu);
+        for (int i = 0; i < TASK_PRIORITY_MAX; i++) {
+            list_init(&cpuvar->runqueues[i]);
+        }
+
+        cpuvar->runqueue_lock = 0;
+        cpuvar->num_runnable = 0;
+        cpuvar->num_ipis_sent = 0;
+        cpuvar->num_ipis_skipped = 0;
     }
 
     for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
         tasks[i].state = TASK_UNUSED;
         tasks[i].tid = i + 1;
+        // Don't reinitialize it in task_create(): the buffers are swapped
+        // between tasks.
+        tasks[i].ool_kbuf = ool_kbufs[i];
     }
 
     for (int i = 0; i < IRQ_MAX; i++) {
@@ -70,22 +70,51 @@ struct task {
     /// always picks the runnable task with the highest priority. If there're
     /// multiple runnable tasks with the same highest priority, the kernel
     /// schedules in round-robin fashion.
+    ///
+    /// This is the effective priority: while a task with higher priority is
+    /// calling this task (and waiting for the reply), the caller lends its
+    /// priority to this task (priority inheritance).
     int priority;
+    /// The task priority set by `task_schedule()`.
+    int base_priority;
+    /// The task which this task is calling, i.e. the task that this task has
+    /// lent its priority to. NULL if it's not in ipc_call().
+    struct task *callee;
+    /// The tasks calling this task.
+    list_t donors;
+    /// A (intrusive) list element in `callee->donors`.
+    list_elem_t donor_next;
     /// The message buffer.
     struct message m;
+    /// The kernel buffer for OoL payloads (CONFIG_OOL_BUFFER_LEN bytes). It
+    /// holds the payload being sent or the received one which is not yet
+    /// copied into `ool_buf`. It is swapped with the receiver's one when a
+    /// message with an OoL payload is delivered.
+    uint8_t *ool_kbuf;
+    /// The receive buffer for an OoL payload registered by the task (a user
+    /// pointer). 0 if it's not registered.
+    vaddr_t ool_buf;
+    /// The length of `ool_buf` in bytes.
+    size_t ool_len;
     /// The acceptable sender task ID. If it's IPC_ANY, the task accepts
     /// messages from any tasks.
     task_t src;
     /// The pending notifications. It's cleared when the task received them as
     /// an message (NOTIFICATIONS_MSG).
     notifications_t notifications;
-    /// The IPC timeout in milliseconds. When it become 0, the kernel notify the
-    /// task with `NOTIFY_TIMER`.
-    msec_t timeout;
+    /// The absolute time (in ticks) when the task's timer expires. When it
+    /// comes, the kernel notifies the task with `NOTIFY_TIMER`. It's 0 if the
+    /// timer is not set.
+    uint64_t timeout;
+    /// The index in the timer heap. It's -1 if the timer is not set.
+    int timer_index;
     /// The queue of tasks that are waiting for this task to get ready for
     /// receiving a message. If this task gets ready, it resumes all threads in
     /// this queue.
     list_t senders;
+    /// The CPU whose runqueue the task is queued in (or the CPU which the task
+    /// has run on most recently).
+    int cpu;
     /// A (intrusive) list element in the runqueue.
     list_elem_t runqueue_next;
     /// A (intrusive) list element in a sender queue.
@@ -99,6 +128,19 @@ struct cpuvar {
     struct arch_cpuvar arch;
     struct task *current_task;
     struct task idle_task;
+    /// Queues of runnable tasks assigned to this CPU excluding the currently
+    /// running task. Lower index means higher priority.
+    list_t runqueues[TASK_PRIORITY_MAX];
+    /// The spinlock protecting `runqueues` and `num_runnable`. Other CPUs
+    /// acquire it to enqueue a task or to steal one.
+    int runqueue_lock;
+    /// The number of tasks in `runqueues`.
+    unsigned num_runnable;
+    /// The number of reschedule IPIs sent from this CPU.
+    unsigned num_ipis_sent;
+    /// The number of reschedule IPIs omitted because the woken task runs on
+    /// this CPU or the target CPU is running a task with higher priority.
+    unsigned num_ipis_skipped;
 };
 
 __mustuse error_t task_create(struct task *task, const char *name, vaddr_t ip,
@@ -111,15 +153,24 @@ error_t task_schedule(struct task *task, int priority);
 struct task *task_lookup(task_t tid);
 struct task *task_lookup_unchecked(task_t tid);
 void task_switch(void);
+void task_switch_to(struct task *next);
+void task_lend_priority(struct task *task, struct task *callee);
+void task_return_priority(struct task *task);
 __mustuse error_t vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                          paddr_t kpage, unsigned flags);
-__mustuse error_t vm_unmap(struct task *task, vaddr_t vaddr);
+__mustuse error_t vm_unmap(struct task *task, vaddr_t vaddr,
+                           size_t *num_pages);
+void vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages);
 __mustuse error_t task_listen_irq(struct task *task, unsigned irq);
 __mustuse error_t task_unlisten_irq(unsigned irq);
+msec_t task_set_timer(struct task *task, msec_t timeout);
+bool task_tickless_enter(unsigned *ticks);
+void task_tickless_exit(unsigned elapsed);
 void handle_timer_irq(void);
 void handle_irq(unsigned irq);
 void handle_page_fault(vaddr_t addr, vaddr_t ip, unsigned fault);
 void task_dump(void);
+void task_dump_cpus(void);
 void task_init(void);
 
 // Implemented in arch.
@@ -129,7 +180,8 @@ void unlock(void);
 void mp_start(void);
 int mp_self(void);
 int mp_num_cpus(void);
-void mp_reschedule(void);
+struct cpuvar *mp_cpuvar_of(int cpu);
+void mp_reschedule(int cpu);
 __mustuse error_t arch_task_create(struct task *task, vaddr_t ip);
 void arch_task_destroy(struct task *task);
 void arch_task_switch(struct task *prev, struct task *next);
@@ -137,7 +189,9 @@ void arch_enable_irq(unsigned irq);
 void arch_disable_irq(unsigned irq);
 __mustuse error_t arch_vm_map(struct task *task, vaddr_t vaddr, paddr_t paddr,
                               paddr_t kpage, unsigned flags);
-__mustuse error_t arch_vm_unmap(struct task *task, vaddr_t vaddr);
+__mustuse error_t arch_vm_unmap(struct task *task, vaddr_t vaddr,
+                                  size_t *num_pages);
+void arch_vm_flush(struct task *task, vaddr_t vaddr, size_t num_pages);
 paddr_t vm_resolve(struct task *task, vaddr_t vaddr);
 
 #endif
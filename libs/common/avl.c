@@ -0,0 +1,156 @@
+#include <avl.h>
+#include <print_macros.h>
+
+static int height(struct avl_node *node) {
+    return node ? node->height : 0;
+}
+
+static void update_height(struct avl_node *node) {
+    node->height = MAX(height(node->left), height(node->right)) + 1;
+}
+
+/// Returns true if `a` should be placed on the left side of `b`. Nodes with
+/// the same key are ordered by their addresses so that we can locate the
+/// exact node to be removed.
+static bool is_less(struct avl_node *a, struct avl_node *b) {
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+
+    return (vaddr_t) a < (vaddr_t) b;
+}
+
+static struct avl_node *rotate_right(struct avl_node *node) {
+    struct avl_node *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+    return left;
+}
+
+static struct avl_node *rotate_left(struct avl_node *node) {
+    struct avl_node *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+    return right;
+}
+
+/// Restores the balance of the subtree and returns its new root.
+static struct avl_node *rebalance(struct avl_node *node) {
+    update_height(node);
+    int balance = height(node->left) - height(node->right);
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static struct avl_node *insert_node(struct avl_node *root,
+                                    struct avl_node *node) {
+    if (!root) {
+        return node;
+    }
+
+    if (is_less(node, root)) {
+        root->left = insert_node(root->left, node);
+    } else {
+        root->right = insert_node(root->right, node);
+    }
+
+    return rebalance(root);
+}
+
+/// Detaches the leftmost node in the subtree. It's returned through `min`.
+static struct avl_node *remove_min(struct avl_node *root,
+                                   struct avl_node **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = remove_min(root->left, min);
+    return rebalance(root);
+}
+
+static struct avl_node *remove_node(struct avl_node *root,
+                                    struct avl_node *node) {
+    ASSERT(root != NULL);
+    if (root == node) {
+        if (!node->right) {
+            return node->left;
+        }
+
+        struct avl_node *min;
+        struct avl_node *right = remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = right;
+        return rebalance(min);
+    }
+
+    if (is_less(node, root)) {
+        root->left = remove_node(root->left, node);
+    } else {
+        root->right = remove_node(root->right, node);
+    }
+
+    return rebalance(root);
+}
+
+/// Inserts a node. `node->key` must be initialized by the caller.
+void avl_insert(struct avl_tree *tree, struct avl_node *node) {
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    tree->root = insert_node(tree->root, node);
+}
+
+/// Removes a node. The node must be in the tree.
+void avl_remove(struct avl_tree *tree, struct avl_node *node) {
+    tree->root = remove_node(tree->root, node);
+}
+
+/// Looks for a node whose key is `key`. If there're multiple ones, it returns
+/// one of them. Returns NULL if it does not exist.
+struct avl_node *avl_find(struct avl_tree *tree, uintptr_t key) {
+    struct avl_node *node = tree->root;
+    while (node) {
+        if (key == node->key) {
+            return node;
+        }
+
+        node = (key < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/// Looks for the node with the largest key less than or equal to `key`.
+/// Returns NULL if it does not exist.
+struct avl_node *avl_find_le(struct avl_tree *tree, uintptr_t key) {
+    struct avl_node *found = NULL;
+    struct avl_node *node = tree->root;
+    while (node) {
+        if (node->key <= key) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,54 @@
+#ifndef __AVL_H__
+#define __AVL_H__
+
+#include <types.h>
+
+//  An intrusive AVL tree keyed by an unsigned integer. Duplicated keys are
+//  allowed.
+//
+//  Usage:
+//
+//    struct element {
+//        struct avl_node node;
+//        int foo;
+//    };
+//
+//    struct avl_tree tree;
+//    avl_init(&tree);
+//    elem->node.key = 123;
+//    avl_insert(&tree, &elem->node);
+//
+//    struct avl_node *node = avl_find(&tree, 123);
+//    if (node) {
+//        struct element *elem = AVL_CONTAINER(node, struct element, node);
+//        printf("foo: %d", elem->foo);
+//    }
+//
+#define AVL_CONTAINER(node, container, field)                                  \
+    ((container *) ((vaddr_t)(node) -offsetof(container, field)))
+
+struct avl_node {
+    struct avl_node *left;
+    struct avl_node *right;
+    int height;
+    uintptr_t key;
+};
+
+struct avl_tree {
+    struct avl_node *root;
+};
+
+static inline void avl_init(struct avl_tree *tree) {
+    tree->root = NULL;
+}
+
+static inline bool avl_is_empty(struct avl_tree *tree) {
+    return tree->root == NULL;
+}
+
+void avl_insert(struct avl_tree *tree, struct avl_node *node);
+void avl_remove(struct avl_tree *tree, struct avl_node *node);
+struct avl_node *avl_find(struct avl_tree *tree, uintptr_t key);
+struct avl_node *avl_find_le(struct avl_tree *tree, uintptr_t key);
+
+#endif
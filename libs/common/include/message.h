@@ -44,4 +44,15 @@ struct message {
 STATIC_ASSERT(sizeof(struct message) == MESSAGE_SIZE);
 IDL_STATIC_ASSERTS /* some assertions defined in idl.h */
 
+/// The size of a short message: the header and a few words of fields.
+#define MESSAGE_SHORT_LEN                                                      \
+    (offsetof(struct message, raw) + MESSAGE_SHORT_PAYLOAD_LEN)
+STATIC_ASSERT(MESSAGE_SHORT_LEN <= MESSAGE_SIZE);
+
+/// Returns the number of bytes in a message of `type` to be copied. Short
+/// messages and error messages carry only the header and a few words.
+static inline size_t message_len(int type) {
+    return (type < 0 || (type & MSG_SHORT)) ? MESSAGE_SHORT_LEN : MESSAGE_SIZE;
+}
+
 #endif
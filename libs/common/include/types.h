@@ -138,6 +138,9 @@ typedef int error_t;
 #define SYS_VM_UNMAP      14
 #define SYS_IRQ_ACQUIRE   15
 #define SYS_IRQ_RELEASE   16
+#define SYS_VM_MAP_RANGE   17
+#define SYS_VM_UNMAP_RANGE 18
+#define SYS_OOL_RECV       19
 
 // Task flags.
 #define TASK_ALL_CAPS (1 << 0)
@@ -150,6 +153,30 @@ typedef int error_t;
 #define MAP_TYPE(flags)    ((flags) &0b11)
 #define MAP_TYPE_READONLY  (0b01 << 0)
 #define MAP_TYPE_READWRITE (0b10 << 0)
+#define MAP_HUGE           (1 << 2) /* Internally used by kernel. */
+
+/// The maximum number of kpages passed to SYS_VM_MAP_RANGE at once.
+#define VM_MAP_KPAGES_MAX 8
+
+/// The arguments of SYS_VM_MAP_RANGE.
+struct vm_map_range {
+    /// The start address of the pages to be mapped.
+    vaddr_t vaddr;
+    /// The start address of the source pages in the caller's address space.
+    vaddr_t src;
+    /// The number of pages to be mapped.
+    size_t num_pages;
+    /// Map flags (MAP_TYPE_*).
+    unsigned flags;
+    /// The number of memory pages in `kpages`.
+    unsigned num_kpages;
+    /// The number of memory pages in `kpages` consumed by the kernel. Filled
+    /// by the kernel.
+    unsigned used_kpages;
+    /// Memory pages (in the caller's address space) for arch-specific page
+    /// table structures. The kernel consumes them from the front.
+    vaddr_t kpages[VM_MAP_KPAGES_MAX];
+};
 
 // IPC source task IDs.
 #define IPC_ANY 0 /* So-called "open receive". */
@@ -166,7 +193,14 @@ typedef int error_t;
 // Flags in the message type (m->type).
 #define MSG_STR      (1 << 30)
 #define MSG_OOL      (1 << 29)
+#define MSG_SHORT    (1 << 28)
 #define MSG_ID(type) ((type) &0xffff)
+/// The OoL payload is passed through the vm server instead of the kernel
+/// buffer. Internally used by the IPC library.
+#define MSG_OOL_PAGES (1 << 27)
+
+/// The maximum size of message fields in a short message (MSG_SHORT).
+#define MESSAGE_SHORT_PAYLOAD_LEN (4 * sizeof(uintptr_t))
 
 // Notifications.
 typedef uint8_t notifications_t;
@@ -174,6 +208,7 @@ typedef uint8_t notifications_t;
 #define NOTIFY_IRQ     (1 << 1)
 #define NOTIFY_ABORTED (1 << 2)
 #define NOTIFY_ASYNC   (1 << 3)
+#define NOTIFY_CHANNEL (1 << 4)
 
 // Page Fault exception error codes.
 #define EXP_PF_PRESENT (1 << 0)
@@ -38,6 +38,9 @@ struct elf32_ehdr {
 } __packed;
 
 #define PT_NOTE 4
+#define PF_X    (1 << 0)
+#define PF_W    (1 << 1)
+#define PF_R    (1 << 2)
 struct elf64_phdr {
     uint32_t p_type;
     uint32_t p_flags;
@@ -1,69 +1,239 @@
 #include <resea/async.h>
 #include <resea/ipc.h>
 #include <resea/malloc.h>
+#include <resea/printf.h>
+#include <resea/task.h>
 #include <string.h>
 
-#define NUM_BUCKETS 32
+/// The number of message nodes allocated at once.
+#define NODES_PER_SLAB 16
+/// The maximum size of a batch: the size of the receiver's ool buffer.
+#define BATCH_LEN_MAX CONFIG_OOL_BUFFER_LEN
 
-/// A hash table of async message queues.
-static list_t *queues[NUM_BUCKETS];
+/// Async message queues indexed by the peer task ID.
+static struct async_queue *queues[CONFIG_NUM_TASKS + 1];
+/// Unused message nodes. They're allocated in slabs and never freed so that
+/// async_send() doesn't call malloc() for every message.
+static list_t free_nodes = {.prev = &free_nodes, .next = &free_nodes};
+#ifndef CONFIG_NOMMU
+/// The buffer to pack a batch into.
+static uint8_t *batch_buf = NULL;
+#endif
 
-static list_t *get_queue(task_t dst) {
-    unsigned index = dst % NUM_BUCKETS;
-    list_t *q = queues[index];
+static struct async_queue *get_queue(task_t tid) {
+    if (tid <= 0 || tid > CONFIG_NUM_TASKS) {
+        return NULL;
+    }
+
+    struct async_queue *q = queues[tid];
     if (!q) {
         q = malloc(sizeof(*q));
-        list_init(q);
-        queues[index] = q;
+        list_init(&q->pending);
+        list_init(&q->received);
+        q->num_pending = 0;
+        queues[tid] = q;
     }
 
     return q;
 }
 
+static struct async_message *alloc_node(void) {
+    if (list_is_empty(&free_nodes)) {
+        struct async_message *slab =
+            malloc(sizeof(struct async_message) * NODES_PER_SLAB);
+        for (int i = 0; i < NODES_PER_SLAB; i++) {
+            list_push_back(&free_nodes, &slab[i].next);
+        }
+    }
+
+    return LIST_POP_FRONT(&free_nodes, struct async_message, next);
+}
+
+static void free_node(struct async_message *am) {
+    list_push_back(&free_nodes, &am->next);
+}
+
+/// Removes the first pending message. Its ool payload has been sent so we
+/// free it here.
+static void pop_pending(struct async_queue *q) {
+    struct async_message *am =
+        LIST_POP_FRONT(&q->pending, struct async_message, next);
+    if (am->m.type & MSG_OOL) {
+        free(am->m.ool_ptr);
+    }
+
+    q->num_pending--;
+    free_node(am);
+}
+
+/// Enqueues a message. If the message has a ool payload, the queue takes
+/// the ownership of it: it's freed once the message has been delivered.
+/// Returns ERR_WOULD_BLOCK if there are already CONFIG_ASYNC_QUEUE_LEN
+/// pending messages for `dst`.
 error_t async_send(task_t dst, struct message *m) {
-    list_t *q = get_queue(dst);
-    struct async_message *am = malloc(sizeof(*am));
+    struct async_queue *q = get_queue(dst);
+    if (!q) {
+        return ERR_INVALID_TASK;
+    }
+
+    if (q->num_pending >= CONFIG_ASYNC_QUEUE_LEN) {
+        return ERR_WOULD_BLOCK;
+    }
+
+    struct async_message *am = alloc_node();
     am->dst = dst;
     memcpy(&am->m, m, sizeof(am->m));
-    list_nullify(&am->next);
-    list_push_back(q, &am->next);
+    if ((m->type & MSG_OOL) && (m->type & MSG_STR)) {
+        am->m.ool_len = strlen(m->ool_ptr) + 1;
+    }
+
+    list_push_back(&q->pending, &am->next);
+    q->num_pending++;
+
+    // Notify the destination task that a new async message is available. We
+    // don't need to notify it again until it pulls messages: async_reply()
+    // notifies if there are remaining ones.
+    if (q->num_pending > 1) {
+        return OK;
+    }
 
-    // Notify the destination task that a new async message is available.
     return ipc_notify(dst, NOTIFY_ASYNC);
 }
 
-error_t async_recv(task_t src, struct message *m) {
-    m->type = ASYNC_MSG;
-    return ipc_call(src, m);
+/// Packs pending messages into a single ASYNC_BATCH_MSG and sends it. Returns
+/// false if less than two messages fit in a batch.
+static bool reply_batch(task_t dst, struct async_queue *q) {
+#ifdef CONFIG_NOMMU
+    return false;
+#else
+    if (!batch_buf) {
+        batch_buf = malloc(BATCH_LEN_MAX);
+    }
+
+    size_t len = 0;
+    unsigned num = 0;
+    LIST_FOR_EACH (am, &q->pending, struct async_message, next) {
+        size_t ool_len = (am->m.type & MSG_OOL) ? am->m.ool_len : 0;
+        if (len + sizeof(am->m) + ool_len > BATCH_LEN_MAX) {
+            break;
+        }
+
+        memcpy(&batch_buf[len], &am->m, sizeof(am->m));
+        len += sizeof(am->m);
+        if (ool_len) {
+            memcpy(&batch_buf[len], am->m.ool_ptr, ool_len);
+            len += ool_len;
+        }
+
+        num++;
+    }
+
+    if (num < 2) {
+        return false;
+    }
+
+    struct message m;
+    m.type = ASYNC_BATCH_MSG;
+    m.async_batch.messages = batch_buf;
+    m.async_batch.messages_len = len;
+    ipc_reply(dst, &m);
+
+    while (num-- > 0) {
+        pop_pending(q);
+    }
+
+    return true;
+#endif
 }
 
-error_t async_reply(task_t dst) {
-    bool sent = false;
-    LIST_FOR_EACH (am, get_queue(dst), struct async_message, next) {
-        if (am->dst == dst) {
-            if (sent) {
-                // Notify that we have more messages for `dst`.
-                ipc_notify(dst, NOTIFY_ASYNC);
-            } else {
-                ipc_reply(dst, &am->m);
-                list_remove(&am->next);
-                free(am);
-                sent = true;
+/// Unpacks an ASYNC_BATCH_MSG into `q->received`.
+static void unpack_batch(struct async_queue *q, struct message *batch) {
+    uint8_t *buf = batch->async_batch.messages;
+    size_t len = batch->async_batch.messages_len;
+    size_t offset = 0;
+    while (offset + sizeof(struct message) <= len) {
+        struct async_message *am = alloc_node();
+        memcpy(&am->m, &buf[offset], sizeof(am->m));
+        offset += sizeof(am->m);
+
+        if (am->m.type & MSG_OOL) {
+            size_t ool_len = am->m.ool_len;
+            if (ool_len > len - offset) {
+                WARN_DBG("invalid async batch from #%d", batch->src);
+                free_node(am);
+                break;
             }
+
+            // The receiver frees the payload by free(m->ool_ptr).
+            am->m.ool_ptr = malloc(ool_len + 1);
+            memcpy(am->m.ool_ptr, &buf[offset], ool_len);
+            ((char *) am->m.ool_ptr)[ool_len] = '\0';
+            offset += ool_len;
         }
+
+        am->dst = task_self();
+        am->m.src = batch->src;
+        list_push_back(&q->received, &am->next);
     }
 
-    // Return ER_NOT_FOUND if there're no messages asynchronously sent to `dst`
-    // in the queue.
-    return (sent) ? OK : ERR_NOT_FOUND;
+    free(buf);
 }
 
-bool async_is_empty(task_t dst) {
-    LIST_FOR_EACH (am, get_queue(dst), struct async_message, next) {
-        if (am->dst == dst) {
-            return false;
+error_t async_recv(task_t src, struct message *m) {
+    struct async_queue *q = get_queue(src);
+    if (!q || list_is_empty(&q->received)) {
+        m->type = ASYNC_MSG;
+        error_t err = ipc_call(src, m);
+        if (err != OK || m->type != ASYNC_BATCH_MSG) {
+            return err;
+        }
+
+        unpack_batch(q, m);
+        if (list_is_empty(&q->received)) {
+            m->type = INVALID_MSG;
+            return OK;
         }
     }
 
-    return true;
+    struct async_message *am =
+        LIST_POP_FRONT(&q->received, struct async_message, next);
+    memcpy(m, &am->m, sizeof(*m));
+    free_node(am);
+
+    // We've received remaining messages in the batch. The caller pulls one
+    // message per NOTIFY_ASYNC so notify ourselves.
+    if (!list_is_empty(&q->received)) {
+        ipc_notify(task_self(), NOTIFY_ASYNC);
+    }
+
+    return OK;
+}
+
+/// Replies to a ASYNC_MSG from `dst`. It sends as many pending messages as
+/// possible in one batch.
+error_t async_reply(task_t dst) {
+    struct async_queue *q = get_queue(dst);
+    if (!q || list_is_empty(&q->pending)) {
+        // No messages asynchronously sent to `dst` in the queue.
+        return ERR_NOT_FOUND;
+    }
+
+    if (q->num_pending == 1 || !reply_batch(dst, q)) {
+        struct async_message *am =
+            LIST_CONTAINER(q->pending.next, struct async_message, next);
+        ipc_reply(dst, &am->m);
+        pop_pending(q);
+    }
+
+    if (q->num_pending > 0) {
+        // Notify that we have more messages for `dst`.
+        ipc_notify(dst, NOTIFY_ASYNC);
+    }
+
+    return OK;
+}
+
+bool async_is_empty(task_t dst) {
+    struct async_queue *q = get_queue(dst);
+    return !q || list_is_empty(&q->pending);
 }
@@ -0,0 +1,199 @@
+#include <resea/channel.h>
+#include <resea/ipc.h>
+#include <resea/printf.h>
+#include <string.h>
+
+static bool is_power_of_two(size_t n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+/// Maps the shared memory region. `len` is set to its size in bytes.
+static error_t map_shm(int shm_id, vaddr_t *vaddr, size_t *len) {
+    struct message m;
+    m.type = SHM_MAP_MSG;
+    m.shm_map.shm_id = shm_id;
+    m.shm_map.writable = true;
+    error_t err = ipc_call(VM_TASK, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    *vaddr = m.shm_map_reply.vaddr;
+    *len = m.shm_map_reply.size * PAGE_SIZE;
+    return OK;
+}
+
+/// Initializes the local end. `entry_size` and `num_entries` must have been
+/// validated: don't read them from the header again since the peer can
+/// rewrite it anytime.
+static void init_channel(struct channel *ch, task_t peer, bool producer,
+                         int shm_id, vaddr_t vaddr, uint32_t entry_size,
+                         uint32_t num_entries) {
+    struct channel_header *header = (struct channel_header *) vaddr;
+    ch->header = header;
+    ch->entries = (uint8_t *) vaddr + sizeof(*header);
+    ch->shm_id = shm_id;
+    ch->peer = peer;
+    ch->producer = producer;
+    ch->mask = num_entries - 1;
+    ch->entry_size = entry_size;
+    if (producer) {
+        ch->index = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        ch->peer_index = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    } else {
+        ch->index = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+        ch->peer_index = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    }
+}
+
+/// Creates a channel on a new shared memory region. `num_entries` must be a
+/// power of two. Pass `ch->shm_id` to the peer to let it channel_open() the
+/// other end.
+error_t channel_create(struct channel *ch, task_t peer, bool producer,
+                       size_t entry_size, size_t num_entries) {
+    // Both fit in the header's 32-bit fields and their product can't
+    // overflow.
+    if (!entry_size || entry_size > UINT32_MAX || !is_power_of_two(num_entries)
+        || num_entries > UINT32_MAX / 2) {
+        return ERR_INVALID_ARG;
+    }
+
+    size_t len = sizeof(struct channel_header) + entry_size * num_entries;
+    struct message m;
+    m.type = SHM_CREATE_MSG;
+    m.shm_create.size = ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+    error_t err = ipc_call(VM_TASK, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    int shm_id = m.shm_create_reply.shm_id;
+    vaddr_t vaddr;
+    size_t shm_len;
+    if ((err = map_shm(shm_id, &vaddr, &shm_len)) != OK) {
+        return err;
+    }
+
+    struct channel_header *header = (struct channel_header *) vaddr;
+    header->entry_size = entry_size;
+    header->num_entries = num_entries;
+    header->head = 0;
+    header->tail = 0;
+    header->producer_sleeping = 0;
+    header->consumer_sleeping = 0;
+
+    init_channel(ch, peer, producer, shm_id, vaddr, entry_size, num_entries);
+    return OK;
+}
+
+/// Opens the other end of a channel created by channel_create().
+error_t channel_open(struct channel *ch, task_t peer, bool producer,
+                     int shm_id) {
+    vaddr_t vaddr;
+    size_t len;
+    error_t err = map_shm(shm_id, &vaddr, &len);
+    if (err != OK) {
+        return err;
+    }
+
+    // The header is written by the peer. Make sure that the entries fit in
+    // the region.
+    struct channel_header *header = (struct channel_header *) vaddr;
+    uint32_t entry_size =
+        __atomic_load_n(&header->entry_size, __ATOMIC_RELAXED);
+    uint32_t num_entries =
+        __atomic_load_n(&header->num_entries, __ATOMIC_RELAXED);
+    if (!entry_size || !is_power_of_two(num_entries)
+        || num_entries > UINT32_MAX / 2 || len < sizeof(*header)
+        || num_entries > (len - sizeof(*header)) / entry_size) {
+        WARN_DBG("invalid channel header in shm #%d", shm_id);
+        return ERR_INVALID_ARG;
+    }
+
+    init_channel(ch, peer, producer, shm_id, vaddr, entry_size, num_entries);
+    return OK;
+}
+
+/// Enqueues an entry. The consumer won't see it until channel_flush() is
+/// called. Returns ERR_WOULD_BLOCK if the ring is full.
+error_t channel_push(struct channel *ch, const void *entry) {
+    DEBUG_ASSERT(ch->producer);
+
+    if (ch->index - ch->peer_index > ch->mask) {
+        ch->peer_index = __atomic_load_n(&ch->header->tail, __ATOMIC_ACQUIRE);
+        if (ch->index - ch->peer_index > ch->mask) {
+            return ERR_WOULD_BLOCK;
+        }
+    }
+
+    memcpy(&ch->entries[(ch->index & ch->mask) * ch->entry_size], entry,
+           ch->entry_size);
+    ch->index++;
+    return OK;
+}
+
+/// Dequeues an entry. The producer won't be able to reuse the entry until
+/// channel_flush() is called. Returns ERR_EMPTY if the ring is empty.
+error_t channel_pop(struct channel *ch, void *entry) {
+    DEBUG_ASSERT(!ch->producer);
+
+    if (ch->index == ch->peer_index) {
+        ch->peer_index = __atomic_load_n(&ch->header->head, __ATOMIC_ACQUIRE);
+        if (ch->index == ch->peer_index) {
+            return ERR_EMPTY;
+        }
+    }
+
+    memcpy(entry, &ch->entries[(ch->index & ch->mask) * ch->entry_size],
+           ch->entry_size);
+    ch->index++;
+    return OK;
+}
+
+/// Publishes pushed (or popped) entries to the peer and wakes it up if it's
+/// sleeping. Call this once per batch: the peer gets at most one
+/// notification for a batch.
+void channel_flush(struct channel *ch) {
+    struct channel_header *header = ch->header;
+    uint32_t *index = (ch->producer) ? &header->head : &header->tail;
+    uint32_t *peer_sleeping = (ch->producer) ? &header->consumer_sleeping
+                                             : &header->producer_sleeping;
+
+    __atomic_store_n(index, ch->index, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in channel_prepare_sleep(): either we see the
+    // sleeping flag or the peer sees the updated index.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(peer_sleeping, __ATOMIC_RELAXED)) {
+        __atomic_store_n(peer_sleeping, 0, __ATOMIC_RELAXED);
+        ipc_notify(ch->peer, NOTIFY_CHANNEL);
+    }
+}
+
+/// Prepares to wait for the peer. Returns true if the ring is still empty
+/// (for the consumer) or full (for the producer): the caller should wait for
+/// NOTIFY_CHANNEL then. Otherwise, the caller should retry.
+bool channel_prepare_sleep(struct channel *ch) {
+    struct channel_header *header = ch->header;
+    channel_flush(ch);
+
+    uint32_t *sleeping = (ch->producer) ? &header->producer_sleeping
+                                        : &header->consumer_sleeping;
+    __atomic_store_n(sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    bool can_sleep;
+    if (ch->producer) {
+        ch->peer_index = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        can_sleep = ch->index - ch->peer_index > ch->mask;
+    } else {
+        ch->peer_index = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        can_sleep = ch->index == ch->peer_index;
+    }
+
+    if (!can_sleep) {
+        __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    return can_sleep;
+}
@@ -1,69 +1,87 @@
-#include <list.h>
 #include <resea/handle.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
 
-// The number of buckets in `handles`.
-#define NUM_BUCKETS 32
-// The maximum number of handles per task.
-#define HANDLE_MAX 128
-
-/// A hash table of handles.
-static list_t *handles[NUM_BUCKETS];
+/// The initial number of entries in a handle table.
+#define INITIAL_CAPACITY 16
 
 struct handle_entry {
-    list_elem_t next;
-    task_t owner;
     void *data;
-    handle_t handle;
+    /// The next free handle in the free list (0 if it's the last one).
+    handle_t next_free;
+    bool in_use;
 };
 
-static struct handle_entry *get_entry(task_t owner, handle_t handle) {
-    unsigned index = handle % NUM_BUCKETS;
-    list_t *list = handles[index];
-    if (!list) {
+/// The handles owned by a task. A handle is an index into `entries` plus 1.
+struct handle_table {
+    struct handle_entry *entries;
+    /// The number of entries allocated for `entries`.
+    unsigned capacity;
+    /// The number of entries which have been used so far: `entries` beyond
+    /// this are not yet initialized.
+    unsigned num_used;
+    /// The last freed handle (0 if there're no free handles).
+    handle_t free_head;
+};
+
+/// Handle tables indexed by the owner task ID.
+static struct handle_table *tables[CONFIG_NUM_TASKS + 1];
+
+static struct handle_table *get_table(task_t owner) {
+    if (owner <= 0 || owner > CONFIG_NUM_TASKS) {
         return NULL;
     }
 
-    LIST_FOR_EACH (e, list, struct handle_entry, next) {
-        if (e->owner == owner && e->handle == handle) {
-            return e;
-        }
+    return tables[owner];
+}
+
+static struct handle_entry *get_entry(task_t owner, handle_t handle) {
+    struct handle_table *table = get_table(owner);
+    if (!table || handle <= 0 || (unsigned) handle > table->num_used) {
+        return NULL;
     }
 
-    return NULL;
+    struct handle_entry *e = &table->entries[handle - 1];
+    return e->in_use ? e : NULL;
 }
 
 handle_t handle_alloc(task_t owner) {
-    // Look for an unused handle ID for the task.
-    handle_t new_handle = 0;
-    for (handle_t handle = 1; handle <= HANDLE_MAX; handle++) {
-        if (!get_entry(owner, handle)) {
-            new_handle = handle;
-            break;
-        }
+    if (owner <= 0 || owner > CONFIG_NUM_TASKS) {
+        return ERR_INVALID_TASK;
     }
 
-    if (!new_handle) {
-        return ERR_NO_MEMORY;
+    struct handle_table *table = tables[owner];
+    if (!table) {
+        table = malloc(sizeof(*table));
+        table->capacity = INITIAL_CAPACITY;
+        table->entries = malloc(sizeof(*table->entries) * table->capacity);
+        table->num_used = 0;
+        table->free_head = 0;
+        tables[owner] = table;
     }
 
-    // Allocate a bucket if needed.
-    unsigned index = new_handle % NUM_BUCKETS;
-    list_t *list = handles[index];
-    if (!list) {
-        list = malloc(sizeof(*list));
-        list_init(list);
-        handles[index] = list;
+    // Reuse the last freed handle if exists.
+    handle_t handle = table->free_head;
+    if (handle) {
+        table->free_head = table->entries[handle - 1].next_free;
+    } else {
+        if (table->num_used == CONFIG_HANDLE_MAX) {
+            return ERR_NO_MEMORY;
+        }
+
+        if (table->num_used == table->capacity) {
+            table->capacity = MIN(table->capacity * 2, CONFIG_HANDLE_MAX);
+            table->entries = realloc(
+                table->entries, sizeof(*table->entries) * table->capacity);
+        }
+
+        handle = ++table->num_used;
     }
 
-    // Add a handle entry into the bucket.
-    struct handle_entry *e = malloc(sizeof(*e));
-    e->handle = new_handle;
-    e->owner = owner;
+    struct handle_entry *e = &table->entries[handle - 1];
     e->data = NULL;
-    list_push_back(list, &e->next);
-    return new_handle;
+    e->in_use = true;
+    return handle;
 }
 
 void *handle_get(task_t owner, handle_t handle) {
@@ -83,17 +101,25 @@ void handle_free(task_t owner, handle_t handle) {
         return;
     }
 
-    list_remove(&e->next);
-    free(e);
+    struct handle_table *table = tables[owner];
+    e->in_use = false;
+    e->next_free = table->free_head;
+    table->free_head = handle;
 }
 
 void handle_free_all(task_t owner, void (*before_free)(void *data)) {
-    for (handle_t handle = 1; handle <= HANDLE_MAX; handle++) {
-        struct handle_entry *e = get_entry(owner, handle);
-        if (e && e->owner == owner) {
-            before_free(e->data);
-            list_remove(&e->next);
-            free(e);
+    struct handle_table *table = get_table(owner);
+    if (!table) {
+        return;
+    }
+
+    for (unsigned i = 0; i < table->num_used; i++) {
+        if (table->entries[i].in_use) {
+            before_free(table->entries[i].data);
         }
     }
+
+    free(table->entries);
+    free(table);
+    tables[owner] = NULL;
 }
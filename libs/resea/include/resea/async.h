@@ -11,6 +11,17 @@ struct async_message {
     struct message m;
 };
 
+/// Async messages exchanged with a peer task.
+struct async_queue {
+    /// Messages to be sent to the peer (FIFO).
+    list_t pending;
+    /// The number of messages in `pending`.
+    unsigned num_pending;
+    /// Messages received from the peer in a batch but not yet returned by
+    /// async_recv().
+    list_t received;
+};
+
 error_t async_send(task_t dst, struct message *m);
 error_t async_recv(task_t src, struct message *m);
 bool async_is_empty(task_t dst);
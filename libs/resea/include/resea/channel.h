@@ -0,0 +1,73 @@
+#ifndef __RESEA_CHANNEL_H__
+#define __RESEA_CHANNEL_H__
+
+#include <types.h>
+
+//  A single-producer/single-consumer ring buffer on a shared memory region.
+//  The producer and the consumer exchange fixed-size entries (typically
+//  descriptors) without system calls. The peer is notified (NOTIFY_CHANNEL)
+//  only when it's sleeping.
+//
+//  Producer:
+//
+//    channel_create(&ch, peer, true, sizeof(struct desc), 256);
+//    /* Send ch.shm_id to the consumer. */
+//    while (channel_push(&ch, &desc) == OK) { ... }
+//    channel_flush(&ch);
+//
+//  Consumer:
+//
+//    channel_open(&ch, peer, false, shm_id);
+//    while (true) {
+//        while (channel_pop(&ch, &desc) == OK) { ... }
+//        channel_flush(&ch);
+//        if (channel_prepare_sleep(&ch)) {
+//            ipc_recv(IPC_ANY, &m);  /* Wait for NOTIFY_CHANNEL. */
+//        }
+//    }
+//
+
+#define CHANNEL_CACHE_LINE_SIZE 64
+
+/// The header at the beginning of the shared memory region. The producer and
+/// the consumer write their own cache lines.
+struct channel_header {
+    uint32_t entry_size;
+    uint32_t num_entries;
+    /// The number of entries pushed so far. Written by the producer.
+    uint32_t head __aligned(CHANNEL_CACHE_LINE_SIZE);
+    /// Set by the producer when it waits for free entries.
+    uint32_t producer_sleeping;
+    /// The number of entries popped so far. Written by the consumer.
+    uint32_t tail __aligned(CHANNEL_CACHE_LINE_SIZE);
+    /// Set by the consumer when it waits for new entries.
+    uint32_t consumer_sleeping;
+} __aligned(CHANNEL_CACHE_LINE_SIZE);
+
+/// A local end of a channel.
+struct channel {
+    struct channel_header *header;
+    uint8_t *entries;
+    int shm_id;
+    /// The task at the other end.
+    task_t peer;
+    bool producer;
+    uint32_t mask;
+    uint32_t entry_size;
+    /// Our index (`head` for the producer, `tail` for the consumer) including
+    /// entries not yet published by channel_flush().
+    uint32_t index;
+    /// The last known peer's index.
+    uint32_t peer_index;
+};
+
+error_t channel_create(struct channel *ch, task_t peer, bool producer,
+                       size_t entry_size, size_t num_entries);
+error_t channel_open(struct channel *ch, task_t peer, bool producer,
+                     int shm_id);
+error_t channel_push(struct channel *ch, const void *entry);
+error_t channel_pop(struct channel *ch, void *entry);
+void channel_flush(struct channel *ch);
+bool channel_prepare_sleep(struct channel *ch);
+
+#endif
@@ -2,40 +2,105 @@
 #define __RESEA_MALLOC_H__
 
 #include <config.h>
+#include <list.h>
 #include <types.h>
 
-#define MALLOC_FREE        0x0a110ced0a110cedULL /* hexspeak of "alloced" */
-#define MALLOC_IN_USE      0xdea110cddea110cdULL /* hexspeak of "deallocd" */
-#define MALLOC_REDZONE_LEN 16
-#define MALLOC_FRAME_LEN   (sizeof(struct malloc_chunk) + MALLOC_REDZONE_LEN)
+#define MALLOC_FREE   0x0a110ced0a110cedULL /* hexspeak of "alloced" */
+#define MALLOC_IN_USE 0xdea110cddea110cdULL /* hexspeak of "deallocd" */
+#ifdef CONFIG_MALLOC_REDZONE
+#    define MALLOC_REDZONE_LEN 16
+#else
+#    define MALLOC_REDZONE_LEN 0
+#endif
+#define MALLOC_FRAME_LEN (sizeof(struct malloc_chunk) + MALLOC_REDZONE_LEN)
 
 #define MALLOC_REDZONE_UNDFLOW_MARKER 0x5a
 #define MALLOC_REDZONE_OVRFLOW_MARKER 0x5b
 
+/// Flags in the lower bits of `malloc_chunk.len`.
+#define MALLOC_CHUNK_LARGE  (1 << 0)
+#define MALLOC_CHUNK_IN_USE (1 << 1)
+#define MALLOC_CHUNK_FLAGS  (MALLOC_CHUNK_LARGE | MALLOC_CHUNK_IN_USE)
+
+/// The number of size classes served from slabs.
+#define MALLOC_NUM_CLASSES 14
+/// The largest size class. Larger chunks are allocated from the heap directly.
+#define MALLOC_SLAB_OBJ_MAX 2048
+/// The size of a slab in bytes.
+#define MALLOC_SLAB_LEN (4 * PAGE_SIZE)
+/// The number of free lists for large chunks: one for each power of two.
+#define MALLOC_NUM_BINS (sizeof(size_t) * 8)
+/// Chunks larger than this are allocated in their own spans (memory pages
+/// from the vm server) and returned to the vm server when they're freed.
+#define MALLOC_SPAN_THRESHOLD (32 * PAGE_SIZE)
+/// The minimum size of a span allocated when the heap runs out.
+#define MALLOC_SPAN_LEN_MIN (64 * PAGE_SIZE)
+
 /// The header of allocated/free memory chunks. The data area follows
-//  immediately after this header (`data` points to the area).
+/// immediately after this header (`data` points to the area).
+///
+/// There're two kinds of chunks: objects in a slab (a size class) and large
+/// chunks allocated from the heap directly. A slab itself is a large chunk.
 struct malloc_chunk {
-    struct malloc_chunk *next;
-    size_t capacity;
-    size_t size;
+    union {
+        /// The size of the previous chunk in the heap (large chunks only).
+        /// It's zero if this is the first chunk.
+        size_t prev_len;
+        /// The slab which this object belongs to (objects only).
+        struct malloc_slab *slab;
+    };
+    /// The size of this chunk including the header and the redzone. The
+    /// lower bits are MALLOC_CHUNK_* flags.
+    size_t len;
+#ifdef CONFIG_MALLOC_REDZONE
     uint64_t magic;
+    /// The size requested to malloc().
+    size_t size;
     uint8_t underflow_redzone[MALLOC_REDZONE_LEN];
+#endif
     uint8_t data[];
-    // `overflow_redzone` follows immediately after `data`.
+    // `overflow_redzone` follows immediately after `data` if
+    // CONFIG_MALLOC_REDZONE is enabled.
     // uint8_t overflow_redzone[MALLOC_REDZONE_LEN];
 };
 
 #ifdef ARCH_X64
 /// Ensure that it's aligned to 16 bytes for performance (SSE instructions
 /// requires 128-bit-aligned memory address).
-STATIC_ASSERT(sizeof(struct malloc_chunk) == 48);
+STATIC_ASSERT(sizeof(struct malloc_chunk) % 16 == 0);
 #endif
 
+/// A set of objects of the same size class. It's placed at the beginning of
+/// a large chunk.
+struct malloc_slab {
+    /// The element in the list of slabs with free objects.
+    list_elem_t next;
+    /// Free objects. They're linked through their data areas.
+    struct malloc_chunk *free_objs;
+    int class;
+    unsigned num_objs;
+    unsigned num_in_use;
+};
+
+/// Statistics of the heap (like mallinfo(3)).
+struct malloc_stats {
+    /// The size of the heap in bytes: the used part of the static heap and
+    /// spans allocated from the vm server.
+    size_t heap_len;
+    /// The number of spans allocated from the vm server.
+    size_t num_spans;
+    /// The number of bytes allocated by malloc(), including headers.
+    size_t in_use;
+    /// The number of chunks allocated by malloc().
+    size_t num_chunks;
+};
+
 void *malloc(size_t size);
 void *realloc(void *ptr, size_t size);
 void free(void *ptr);
 char *strndup(const char *s, size_t n);
 char *strdup(const char *s);
+void malloc_stats(struct malloc_stats *stats);
 void malloc_init(void);
 
 #endif
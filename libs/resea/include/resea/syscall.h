@@ -6,7 +6,7 @@
 struct message;
 error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags);
 error_t sys_notify(task_t dst, notifications_t notifications);
-error_t sys_timer_set(msec_t timeout);
+msec_t sys_timer_set(msec_t timeout);
 task_t sys_task_create(task_t tid, const char *name, vaddr_t ip, task_t pager,
                        unsigned flags);
 error_t sys_task_destroy(task_t task);
@@ -16,6 +16,9 @@ error_t sys_task_schedule(task_t task, int priority);
 error_t sys_vm_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                    unsigned flags);
 error_t sys_vm_unmap(task_t task, vaddr_t vaddr);
+error_t sys_vm_map_range(task_t task, struct vm_map_range *range);
+error_t sys_vm_unmap_range(task_t task, vaddr_t vaddr, size_t num_pages);
+error_t sys_ool_recv(void *buf, size_t len);
 error_t sys_irq_acquire(unsigned irq);
 error_t sys_irq_release(unsigned irq);
 error_t sys_console_write(const char *buf, size_t len);
@@ -11,6 +11,8 @@ task_t task_self(void);
 error_t vm_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                unsigned flags);
 error_t vm_unmap(task_t task, vaddr_t vaddr);
+error_t vm_map_range(task_t task, struct vm_map_range *range);
+error_t vm_unmap_range(task_t task, vaddr_t vaddr, size_t num_pages);
 error_t task_schedule(task_t task, int priority);
 
 #endif
@@ -1,8 +1,23 @@
 #ifndef __RESEA_TIMER_H__
 #define __RESEA_TIMER_H__
 
+#include <list.h>
 #include <types.h>
 
+/// A timer multiplexed onto the task's kernel timer.
+struct timer {
+    list_elem_t next;
+    /// The expiration time in the task-local clock (in milliseconds).
+    int64_t deadline;
+    /// The function called when the timer expires.
+    void (*callback)(struct timer *timer);
+};
+
 error_t timer_set(msec_t timeout);
+void timer_add(struct timer *timer, msec_t timeout,
+               void (*callback)(struct timer *timer));
+void timer_cancel(struct timer *timer);
+bool timer_expire(void);
+void timer_init(void);
 
 #endif
@@ -2,6 +2,7 @@
 #include <resea/handle.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/timer.h>
 #include <string.h>
 
 extern char __cmdline[];
@@ -16,6 +17,7 @@ __noreturn void resea_init(void) {
     memset(__bss, 0, (vaddr_t) __bss_end - (vaddr_t) __bss);
     malloc_init();
     cmdline_init();
+    timer_init();
     main(__cmdline);
     task_exit();
 }
@@ -2,6 +2,7 @@
 #include <resea/malloc.h>
 #include <resea/printf.h>
 #include <resea/syscall.h>
+#include <resea/timer.h>
 #include <string.h>
 
 /// The internal buffer to receive ool payloads.
@@ -24,52 +25,74 @@ __weak error_t ipc_call_pager(struct message *m) {
 }
 
 #ifndef CONFIG_NOMMU
-static void ool_recv(vaddr_t ptr, size_t len) {
-    struct message m;
-    m.type = OOL_RECV_MSG;
-    m.ool_recv.addr = ptr;
-    m.ool_recv.len = len;
-    error_t err = ipc_call_pager(&m);
-    ASSERT_OK(err);
-    ASSERT(m.type == OOL_RECV_REPLY_MSG);
-}
-
-static vaddr_t ool_send(task_t dst, vaddr_t ptr, size_t len) {
+static error_t ool_send(task_t dst, vaddr_t ptr, size_t len, vaddr_t *id) {
     struct message m;
     m.type = OOL_SEND_MSG;
     m.ool_send.dst = dst;
     m.ool_send.addr = ptr;
     m.ool_send.len = len;
     error_t err = ipc_call_pager(&m);
-    ASSERT_OK(err);
+    if (err != OK) {
+        return err;
+    }
+
     ASSERT(m.type == OOL_SEND_REPLY_MSG);
-    return m.ool_send_reply.id;
+    *id = m.ool_send_reply.id;
+    return OK;
 }
 
-static vaddr_t ool_verify(task_t src, vaddr_t ptr, size_t len) {
+static error_t ool_recv(task_t src, vaddr_t id, vaddr_t ptr, size_t len) {
     struct message m;
-    m.type = OOL_VERIFY_MSG;
-    m.ool_verify.src = src;
-    m.ool_verify.id = ptr;
-    m.ool_verify.len = len;
-    error_t err = ipc_call_pager(&m);
-    if (err != OK) {
-        return 0;
-    }
+    m.type = OOL_RECV_MSG;
+    m.ool_recv.src = src;
+    m.ool_recv.id = id;
+    m.ool_recv.addr = ptr;
+    m.ool_recv.len = len;
+    return ipc_call_pager(&m);
+}
 
-    ASSERT(m.type == OOL_VERIFY_REPLY_MSG);
-    return m.ool_verify_reply.received_at;
+static void ool_discard(task_t dst, vaddr_t id) {
+    struct message m;
+    m.type = OOL_DISCARD_MSG;
+    m.ool_discard.dst = dst;
+    m.ool_discard.id = id;
+    // It fails if the payload has already been freed: `dst` has exited.
+    ipc_call_pager(&m);
 }
 #endif
 
-static void pre_send(task_t dst, struct message *m) {
+static error_t pre_send(task_t dst, struct message *m) {
 #ifndef CONFIG_NOMMU
+    // The kernel copies the OoL payload at `m->ool_ptr` into the receiver's
+    // buffer. Payloads too large for the buffer are passed through the vm
+    // server instead: it shares the pages with the receiver copy-on-write.
     if (!IS_ERROR(m->type) && m->type & MSG_OOL) {
         if (m->type & MSG_STR) {
             m->ool_len = strlen(m->ool_ptr) + 1;
         }
 
-        m->ool_ptr = (void *) ool_send(dst, (vaddr_t) m->ool_ptr, m->ool_len);
+        if (m->ool_len > ool_len) {
+            vaddr_t id;
+            error_t err = ool_send(dst, (vaddr_t) m->ool_ptr, m->ool_len, &id);
+            if (err != OK) {
+                return err;
+            }
+
+            m->type = (m->type & ~MSG_OOL) | MSG_OOL_PAGES;
+            m->ool_ptr = (void *) id;
+        }
+    }
+#endif
+
+    return OK;
+}
+
+/// Discards the OoL payload passed to the vm server in pre_send() since the
+/// message has not been sent.
+static void send_failed(task_t dst, struct message *m) {
+#ifndef CONFIG_NOMMU
+    if (!IS_ERROR(m->type) && m->type & MSG_OOL_PAGES) {
+        ool_discard(dst, (vaddr_t) m->ool_ptr);
     }
 #endif
 }
@@ -77,29 +100,57 @@ static void pre_send(task_t dst, struct message *m) {
 static void pre_recv(void) {
 #ifndef CONFIG_NOMMU
     if (!ool_ptr) {
-        ool_ptr = malloc(ool_len);
-        ool_recv((vaddr_t) ool_ptr, ool_len);
+        // Leave a room for the NUL character appended in post_recv(). The
+        // kernel refuses to send payloads larger than `ool_len` to us with
+        // ERR_TOO_LARGE.
+        ool_ptr = malloc(ool_len + 1);
+        ASSERT_OK(sys_ool_recv(ool_ptr, ool_len));
     }
 #endif
 }
 
 static error_t post_recv(error_t err, struct message *m) {
+    if (IS_OK(err) && m->type == NOTIFICATIONS_MSG
+        && (m->notifications.data & NOTIFY_TIMER)) {
+        // The kernel timer is shared by all timers. Deliver NOTIFY_TIMER to
+        // the caller only if the default timer (`timer_set`) has expired.
+        if (!timer_expire()) {
+            m->notifications.data &= ~NOTIFY_TIMER;
+        }
+    }
+
 #ifndef CONFIG_NOMMU
-    if (!IS_ERROR(m->type) && m->type & MSG_OOL) {
-        // Received a ool payload.
-        m->ool_ptr =
-            (void *) ool_verify(m->src, (vaddr_t) m->ool_ptr, m->ool_len);
+    // `m` is still the message to be sent if the system call has failed.
+    if (IS_OK(err) && !IS_ERROR(m->type) && m->type & MSG_OOL_PAGES) {
+        // Received a large ool payload. Receive it from the vm server.
+        void *buf = malloc(m->ool_len + 1);
+        error_t ool_err =
+            ool_recv(m->src, (vaddr_t) m->ool_ptr, (vaddr_t) buf, m->ool_len);
+        if (ool_err != OK) {
+            WARN_DBG("received an invalid ool payload from #%d: %s", m->src,
+                     err2str(ool_err));
+            free(buf);
+            m->type = INVALID_MSG;
+            return OK;
+        }
+
+        m->type = (m->type & ~MSG_OOL_PAGES) | MSG_OOL;
+        m->ool_ptr = buf;
+    } else if (IS_OK(err) && !IS_ERROR(m->type) && m->type & MSG_OOL) {
+        // Received a ool payload. The kernel has copied it into `ool_ptr`.
         if (!m->ool_ptr) {
-            WARN_DBG("received an invalid oolcopy payload from #%d: %s", m->src,
-                     err2str(err));
+            WARN_DBG("received an invalid ool payload from #%d", m->src);
             m->type = INVALID_MSG;
             return OK;
         }
 
         // We've consumed `ool_ptr` so set NULL to it
         // and reallocate the receiver buffer later.
+        DEBUG_ASSERT(m->ool_ptr == ool_ptr);
         ool_ptr = NULL;
+    }
 
+    if (IS_OK(err) && !IS_ERROR(m->type) && m->type & MSG_OOL) {
         // A mitigation for a non-terminated (malicious) string payload.
         if (m->type & MSG_STR) {
             char *str = m->ool_ptr;
@@ -113,20 +164,28 @@ static error_t post_recv(error_t err, struct message *m) {
     return (IS_OK(err) && m->type < 0) ? m->type : err;
 }
 
-error_t ipc_send(task_t dst, struct message *m) {
+static error_t send(task_t dst, struct message *m, unsigned flags) {
+    int saved_type = m->type;
     void *saved_ool_ptr = m->ool_ptr;
-    pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND);
+    error_t err = pre_send(dst, m);
+    if (err == OK) {
+        err = sys_ipc(dst, 0, m, flags);
+        if (err != OK) {
+            send_failed(dst, m);
+        }
+    }
+
+    m->type = saved_type;
     m->ool_ptr = saved_ool_ptr;
     return err;
 }
 
+error_t ipc_send(task_t dst, struct message *m) {
+    return send(dst, m, IPC_SEND);
+}
+
 error_t ipc_send_noblock(task_t dst, struct message *m) {
-    void *saved_ool_ptr = m->ool_ptr;
-    pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_NOBLOCK);
-    m->ool_ptr = saved_ool_ptr;
-    return err;
+    return send(dst, m, IPC_SEND | IPC_NOBLOCK);
 }
 
 error_t ipc_send_err(task_t dst, error_t error) {
@@ -158,16 +217,35 @@ error_t ipc_recv(task_t src, struct message *m) {
 
 error_t ipc_call(task_t dst, struct message *m) {
     pre_recv();
-    pre_send(dst, m);
-    error_t err = sys_ipc(dst, dst, m, IPC_CALL);
+    error_t err = pre_send(dst, m);
+    if (err != OK) {
+        return err;
+    }
+
+    err = sys_ipc(dst, dst, m, IPC_CALL);
+    if (err != OK) {
+        send_failed(dst, m);
+    }
+
     return post_recv(err, m);
 }
 
 error_t ipc_replyrecv(task_t dst, struct message *m) {
     pre_recv();
-    pre_send(dst, m);
-    unsigned flags = (dst < 0) ? IPC_RECV : (IPC_SEND | IPC_RECV | IPC_NOBLOCK);
-    error_t err = sys_ipc(dst, IPC_ANY, m, flags);
+    if (dst < 0) {
+        return post_recv(sys_ipc(dst, IPC_ANY, m, IPC_RECV), m);
+    }
+
+    error_t err = pre_send(dst, m);
+    if (err != OK) {
+        return err;
+    }
+
+    err = sys_ipc(dst, IPC_ANY, m, IPC_SEND | IPC_RECV | IPC_NOBLOCK);
+    if (err != OK) {
+        send_failed(dst, m);
+    }
+
     return post_recv(err, m);
 }
 
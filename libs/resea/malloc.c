@@ -1,17 +1,72 @@
 #include <list.h>
+#include <message.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/syscall.h>
 #include <string.h>
 
-#define NUM_BINS 16
 extern char __heap[];
 extern char __heap_end[];
 
-static struct malloc_chunk *bins[NUM_BINS];
+/// The unused area at the end of the static heap (`__heap`). Large chunks
+/// are carved from here when no free chunks fit.
+static uint8_t *heap_top;
+static uint8_t *heap_end;
+/// The size of the chunk right before `heap_top`.
+static size_t top_prev_len = 0;
+/// Statistics.
+static struct malloc_stats stats;
+
+/// Free large chunks. `bins[i]` holds chunks whose sizes are in
+/// [2^i, 2^(i+1)).
+static list_t bins[MALLOC_NUM_BINS];
+/// The bitmap of non-empty `bins`.
+static size_t bins_bitmap = 0;
+
+/// Slabs with free objects for each size class.
+static list_t partial_slabs[MALLOC_NUM_CLASSES];
+static const size_t class_sizes[MALLOC_NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+
+STATIC_ASSERT(MALLOC_SLAB_OBJ_MAX == 2048);
+
+/// The minimum size of a large chunk. A free large chunk holds a list
+/// element in its data area.
+#define LARGE_CHUNK_LEN_MIN ALIGN_UP(MALLOC_FRAME_LEN + sizeof(list_elem_t), 16)
+
+#define CHUNK_LEN(chunk)      ((chunk)->len & ~MALLOC_CHUNK_FLAGS)
+#define CHUNK_CAPACITY(chunk) (CHUNK_LEN(chunk) - MALLOC_FRAME_LEN)
+#define NEXT_CHUNK(chunk)                                                      \
+    ((struct malloc_chunk *) ((uint8_t *) (chunk) + CHUNK_LEN(chunk)))
+#define PREV_CHUNK(chunk)                                                      \
+    ((struct malloc_chunk *) ((uint8_t *) (chunk) - (chunk)->prev_len))
+/// The list element of a free large chunk.
+#define FREE_CHUNK_ELEM(chunk) ((list_elem_t *) (chunk)->data)
+/// The next free object in a slab.
+#define NEXT_FREE_OBJ(obj) (*((struct malloc_chunk **) (obj)->data))
+
+static inline int log2_floor(size_t n) {
+    return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(n);
+}
+
+/// Returns the size class for `size` (<= MALLOC_SLAB_OBJ_MAX) in O(1). The
+/// classes are powers of two and their midpoints.
+static int size_to_class(size_t size) {
+    if (size <= 32) {
+        return (size <= 16) ? 0 : 1;
+    }
+
+    // `size` is in (2^shift, 2^(shift + 1)]. Determine which half it is in.
+    int shift = log2_floor(size - 1);
+    int upper_half = ((size - 1) >> (shift - 1)) & 1;
+    return 2 + (shift - 5) * 2 + upper_half;
+}
 
 static void check_buffer_overflow(struct malloc_chunk *chunk) {
-    if (chunk->magic == MALLOC_FREE) {
-        return;
+#ifdef CONFIG_MALLOC_REDZONE
+    if (chunk->magic != MALLOC_IN_USE) {
+        PANIC("detected a broken malloc chunk: ptr=%p", chunk->data);
     }
 
     for (size_t i = 0; i < MALLOC_REDZONE_LEN; i++) {
@@ -20,62 +75,334 @@ static void check_buffer_overflow(struct malloc_chunk *chunk) {
         }
     }
 
+    size_t capacity = CHUNK_CAPACITY(chunk);
     for (size_t i = 0; i < MALLOC_REDZONE_LEN; i++) {
-        if (chunk->data[chunk->capacity + i] != MALLOC_REDZONE_OVRFLOW_MARKER) {
+        if (chunk->data[capacity + i] != MALLOC_REDZONE_OVRFLOW_MARKER) {
             PANIC("detected a malloc buffer overflow: ptr=%p", chunk->data);
         }
     }
+#endif
+}
+
+static void *mark_as_used(struct malloc_chunk *chunk, size_t size) {
+    chunk->len |= MALLOC_CHUNK_IN_USE;
+#ifdef CONFIG_MALLOC_REDZONE
+    chunk->magic = MALLOC_IN_USE;
+    chunk->size = size;
+    memset(chunk->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
+           MALLOC_REDZONE_LEN);
+    memset(&chunk->data[CHUNK_CAPACITY(chunk)], MALLOC_REDZONE_OVRFLOW_MARKER,
+           MALLOC_REDZONE_LEN);
+#endif
+    return chunk->data;
+}
+
+static void mark_as_free(struct malloc_chunk *chunk) {
+    chunk->len &= ~MALLOC_CHUNK_IN_USE;
+#ifdef CONFIG_MALLOC_REDZONE
+    chunk->magic = MALLOC_FREE;
+#endif
+}
+
+/// Returns true if `chunk` is at the end of the static heap: the next one
+/// is the unused area.
+static bool is_top_chunk(struct malloc_chunk *chunk) {
+    return (uint8_t *) NEXT_CHUNK(chunk) == heap_top;
+}
+
+/// Returns true if the chunk covers a whole span: it's the first chunk in a
+/// span and the next one is the fencepost.
+static bool is_whole_span(struct malloc_chunk *chunk) {
+    return chunk->prev_len == 0 && CHUNK_LEN(NEXT_CHUNK(chunk)) == 0
+           && ((uint8_t *) chunk < (uint8_t *) __heap
+               || (uint8_t *) chunk >= heap_end);
+}
+
+/// Updates `prev_len` of the chunk next to `chunk`.
+static void update_next_prev_len(struct malloc_chunk *chunk) {
+    if (is_top_chunk(chunk)) {
+        top_prev_len = CHUNK_LEN(chunk);
+    } else {
+        NEXT_CHUNK(chunk)->prev_len = CHUNK_LEN(chunk);
+    }
+}
+
+// for sparse
+error_t malloc_alloc_pages(size_t num_pages, vaddr_t *vaddr);
+error_t malloc_free_pages(vaddr_t vaddr);
+
+/// Allocates memory pages for the heap. The vm server overrides this since
+/// it can't call itself.
+__weak error_t malloc_alloc_pages(size_t num_pages, vaddr_t *vaddr) {
+#ifdef CONFIG_NOMMU
+    return ERR_UNAVAILABLE;
+#else
+    // Don't use ipc_call(): it may call malloc() to prepare the ool buffer.
+    struct message m;
+    m.type = VM_ALLOC_HEAP_MSG;
+    m.vm_alloc_heap.num_pages = num_pages;
+    error_t err = sys_ipc(VM_TASK, VM_TASK, &m, IPC_CALL);
+    if (err != OK) {
+        return err;
+    }
+
+    if (m.type != VM_ALLOC_HEAP_REPLY_MSG) {
+        return (IS_ERROR(m.type)) ? m.type : ERR_UNAVAILABLE;
+    }
+
+    *vaddr = m.vm_alloc_heap_reply.vaddr;
+    return OK;
+#endif
+}
+
+/// Frees memory pages allocated by malloc_alloc_pages().
+__weak error_t malloc_free_pages(vaddr_t vaddr) {
+#ifdef CONFIG_NOMMU
+    return ERR_UNAVAILABLE;
+#else
+    struct message m;
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = vaddr;
+    error_t err = sys_ipc(VM_TASK, VM_TASK, &m, IPC_CALL);
+    return (err == OK && IS_ERROR(m.type)) ? m.type : err;
+#endif
+}
+
+/// Allocates a span from the vm server: a memory area which has a large
+/// chunk of `len` bytes or more followed by a fencepost. The span is at least
+/// `min_span_len` bytes.
+static struct malloc_chunk *alloc_span(size_t len, size_t min_span_len) {
+    size_t span_len = ALIGN_UP(len + sizeof(struct malloc_chunk), PAGE_SIZE);
+    span_len = MAX(span_len, min_span_len);
+
+    vaddr_t vaddr;
+    if (malloc_alloc_pages(span_len / PAGE_SIZE, &vaddr) != OK) {
+        return NULL;
+    }
+
+    struct malloc_chunk *chunk = (struct malloc_chunk *) vaddr;
+    chunk->prev_len = 0;
+    chunk->len = (span_len - sizeof(struct malloc_chunk)) | MALLOC_CHUNK_LARGE;
+
+    // The fencepost: a zero-length in-use chunk to stop merging.
+    struct malloc_chunk *fencepost = NEXT_CHUNK(chunk);
+    fencepost->prev_len = CHUNK_LEN(chunk);
+    fencepost->len = MALLOC_CHUNK_LARGE | MALLOC_CHUNK_IN_USE;
+
+    stats.heap_len += span_len;
+    stats.num_spans++;
+    return chunk;
+}
+
+/// Returns a free span to the vm server.
+static void free_span(struct malloc_chunk *chunk) {
+    size_t span_len = CHUNK_LEN(chunk) + sizeof(struct malloc_chunk);
+    OOPS_OK(malloc_free_pages((vaddr_t) chunk));
+    stats.heap_len -= span_len;
+    stats.num_spans--;
+}
+
+static void bin_insert(struct malloc_chunk *chunk) {
+    int bin = log2_floor(CHUNK_LEN(chunk));
+    list_push_back(&bins[bin], FREE_CHUNK_ELEM(chunk));
+    bins_bitmap |= 1ul << bin;
+}
+
+static void bin_remove(struct malloc_chunk *chunk) {
+    int bin = log2_floor(CHUNK_LEN(chunk));
+    list_remove(FREE_CHUNK_ELEM(chunk));
+    if (list_is_empty(&bins[bin])) {
+        bins_bitmap &= ~(1ul << bin);
+    }
+}
+
+static struct malloc_chunk *bin_pop(int bin) {
+    list_elem_t *elem = bins[bin].next;
+    struct malloc_chunk *chunk =
+        LIST_CONTAINER(elem, struct malloc_chunk, data);
+    bin_remove(chunk);
+    return chunk;
+}
+
+/// Frees a large chunk and merges it with its free neighbors.
+static void free_large(struct malloc_chunk *chunk) {
+    mark_as_free(chunk);
+
+    struct malloc_chunk *next = NEXT_CHUNK(chunk);
+    if (!is_top_chunk(chunk) && !(next->len & MALLOC_CHUNK_IN_USE)) {
+        bin_remove(next);
+        chunk->len += CHUNK_LEN(next);
+    }
+
+    if (chunk->prev_len) {
+        struct malloc_chunk *prev = PREV_CHUNK(chunk);
+        if (!(prev->len & MALLOC_CHUNK_IN_USE)) {
+            bin_remove(prev);
+            prev->len += CHUNK_LEN(chunk);
+            chunk = prev;
+        }
+    }
+
+    if (is_top_chunk(chunk)) {
+        // The chunk is at the end of the static heap. Give it back to the
+        // unused area.
+        stats.heap_len -= CHUNK_LEN(chunk);
+        heap_top = (uint8_t *) chunk;
+        top_prev_len = chunk->prev_len;
+        return;
+    }
+
+    if (is_whole_span(chunk)) {
+        free_span(chunk);
+        return;
+    }
+
+    update_next_prev_len(chunk);
+    bin_insert(chunk);
 }
 
-static struct malloc_chunk *insert(void *ptr, size_t len) {
-    ASSERT(len > MALLOC_FRAME_LEN);
-    struct malloc_chunk *new_chunk = ptr;
-    new_chunk->magic = MALLOC_FREE;
-    new_chunk->capacity = len - MALLOC_FRAME_LEN;
-    new_chunk->size = 0;
-    new_chunk->next = NULL;
+/// Shrinks a free large chunk to `len` bytes and frees the rest.
+static void split(struct malloc_chunk *chunk, size_t len) {
+    size_t remaining = CHUNK_LEN(chunk) - len;
+    if (remaining < LARGE_CHUNK_LEN_MIN) {
+        return;
+    }
 
-    // Append the new chunk into the linked list.
-    struct malloc_chunk **chunk = &bins[NUM_BINS - 1];
-    while (*chunk != NULL) {
-        check_buffer_overflow(*chunk);
-        chunk = &(*chunk)->next;
+    chunk->len = len | (chunk->len & MALLOC_CHUNK_FLAGS);
+    struct malloc_chunk *new_chunk = NEXT_CHUNK(chunk);
+    new_chunk->prev_len = len;
+    new_chunk->len = remaining | MALLOC_CHUNK_LARGE | MALLOC_CHUNK_IN_USE;
+    free_large(new_chunk);
+}
+
+/// Looks for a free large chunk of at least `len` bytes in the bin for
+/// chunks of `len` bytes. Unlike larger bins, not all chunks in the bin fit.
+static struct malloc_chunk *bin_find(size_t len) {
+    list_t *bin = &bins[log2_floor(len)];
+    for (list_elem_t *elem = bin->next; elem != bin; elem = elem->next) {
+        struct malloc_chunk *chunk =
+            LIST_CONTAINER(elem, struct malloc_chunk, data);
+        if (CHUNK_LEN(chunk) >= len) {
+            bin_remove(chunk);
+            return chunk;
+        }
     }
-    *chunk = new_chunk;
 
-    return new_chunk;
+    return NULL;
 }
 
-static struct malloc_chunk *split(struct malloc_chunk *chunk, size_t len) {
-    size_t new_chunk_len = MALLOC_FRAME_LEN + len;
-    ASSERT(chunk->capacity >= new_chunk_len);
+/// Allocates a large chunk of `len` bytes (including the header).
+static struct malloc_chunk *alloc_large(size_t len) {
+    // Look for a bin where any chunk is large enough: the bin for
+    // 2^ceil(log2(len)) bytes or larger.
+    int min_bin = log2_floor(len - 1) + 1;
+    size_t candidates = bins_bitmap & ~((1ul << min_bin) - 1);
+
+    struct malloc_chunk *chunk;
+    if (len >= MALLOC_SPAN_THRESHOLD && (chunk = alloc_span(len, 0)) != NULL) {
+        // A large chunk gets its own span so that its memory pages are
+        // returned to the vm server as soon as it's freed.
+    } else if (candidates) {
+        chunk = bin_pop(__builtin_ctzl(candidates));
+    } else if ((size_t)(heap_end - heap_top) >= len) {
+        // Carve a new chunk from the unused area.
+        chunk = (struct malloc_chunk *) heap_top;
+        chunk->prev_len = top_prev_len;
+        chunk->len = len | MALLOC_CHUNK_LARGE;
+        heap_top += len;
+        top_prev_len = len;
+        stats.heap_len += len;
+        return chunk;
+    } else {
+        // Look for a large enough chunk in the smaller bin. If there's none,
+        // grow the heap.
+        chunk = bin_find(len);
+        if (!chunk) {
+            chunk = alloc_span(len, MALLOC_SPAN_LEN_MIN);
+            if (!chunk) {
+                return NULL;
+            }
+        }
+    }
 
-    void *new_chunk_ptr =
-        &chunk->data[chunk->capacity + MALLOC_REDZONE_LEN - new_chunk_len];
-    chunk->capacity -= new_chunk_len;
+    // Mark the chunk as used temporarily not to merge the remaining part
+    // into it.
+    chunk->len |= MALLOC_CHUNK_IN_USE;
+    split(chunk, len);
+    chunk->len &= ~MALLOC_CHUNK_IN_USE;
+    return chunk;
+}
 
-    ASSERT(new_chunk_len > MALLOC_FRAME_LEN);
+static struct malloc_slab *new_slab(int class) {
+    struct malloc_chunk *chunk = alloc_large(MALLOC_SLAB_LEN);
+    if (!chunk) {
+        return NULL;
+    }
 
-    struct malloc_chunk *new_chunk = new_chunk_ptr;
-    new_chunk->magic = MALLOC_FREE;
-    new_chunk->capacity = len;
-    new_chunk->size = 0;
-    new_chunk->next = NULL;
+    mark_as_used(chunk, CHUNK_CAPACITY(chunk));
+    struct malloc_slab *slab = (struct malloc_slab *) chunk->data;
+    size_t obj_len = MALLOC_FRAME_LEN + class_sizes[class];
+    uint8_t *objs = (uint8_t *) ALIGN_UP((vaddr_t) &slab[1], 16);
+    uint8_t *end = &chunk->data[CHUNK_CAPACITY(chunk)];
+    slab->class = class;
+    slab->num_objs = (end - objs) / obj_len;
+    slab->num_in_use = 0;
+    slab->free_objs = NULL;
+    for (unsigned i = slab->num_objs; i > 0; i--) {
+        struct malloc_chunk *obj =
+            (struct malloc_chunk *) &objs[(i - 1) * obj_len];
+        obj->slab = slab;
+        obj->len = obj_len;
+        NEXT_FREE_OBJ(obj) = slab->free_objs;
+        slab->free_objs = obj;
+    }
 
-    return new_chunk;
+    list_push_back(&partial_slabs[class], &slab->next);
+    return slab;
 }
 
-static int get_bin_idx_from_size(size_t size) {
-    // If requested size is less or equal to the size of second largest chunk
-    // (the last fixed chunk).
-    for (size_t i = 0; i < NUM_BINS - 1; i++) {
-        if (size <= 1 << i) {
-            return i;
+static struct malloc_chunk *alloc_obj(int class) {
+    list_t *partial = &partial_slabs[class];
+    struct malloc_slab *slab;
+    if (list_is_empty(partial)) {
+        slab = new_slab(class);
+        if (!slab) {
+            return NULL;
         }
+    } else {
+        slab = LIST_CONTAINER(partial->next, struct malloc_slab, next);
     }
 
-    // Return -1 indicating the last, dynamic-sized chunk
-    return -1;
+    struct malloc_chunk *obj = slab->free_objs;
+    slab->free_objs = NEXT_FREE_OBJ(obj);
+    slab->num_in_use++;
+    if (slab->num_in_use == slab->num_objs) {
+        list_remove(&slab->next);
+    }
+
+    return obj;
+}
+
+static void free_obj(struct malloc_chunk *obj) {
+    mark_as_free(obj);
+    struct malloc_slab *slab = obj->slab;
+    list_t *partial = &partial_slabs[slab->class];
+    if (slab->num_in_use == slab->num_objs) {
+        list_push_back(partial, &slab->next);
+    }
+
+    NEXT_FREE_OBJ(obj) = slab->free_objs;
+    slab->free_objs = obj;
+    slab->num_in_use--;
+
+    // Free the slab if it's no longer used. We keep the last one not to
+    // allocate and free a slab repeatedly.
+    if (slab->num_in_use == 0 && partial->next != partial->prev) {
+        list_remove(&slab->next);
+        struct malloc_chunk *chunk =
+            LIST_CONTAINER(slab, struct malloc_chunk, data);
+        free_large(chunk);
+    }
 }
 
 void *malloc(size_t size) {
@@ -85,70 +412,33 @@ void *malloc(size_t size) {
 
     // Align up to 16-bytes boundary. If the size is less than 16 (including
     // size == 0), allocate 16 bytes.
-    size = ALIGN_UP(size, 16);
-
-    int bin_idx = get_bin_idx_from_size(size);
-
-    if (bin_idx != -1 && bins[bin_idx] != NULL) {
-        // Check the list corresponding to that size for a free chunk.
-        struct malloc_chunk *allocated = bins[bin_idx];
-        ASSERT(allocated->magic == MALLOC_FREE);
-
-        allocated->magic = MALLOC_IN_USE;
-        allocated->size = size;
-        memset(allocated->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
-               MALLOC_REDZONE_LEN);
-        memset(&allocated->data[allocated->capacity],
-               MALLOC_REDZONE_OVRFLOW_MARKER, MALLOC_REDZONE_LEN);
-
-        bins[bin_idx] = allocated->next;
-        allocated->next = NULL;
-        return allocated->data;
-    }
-
-    struct malloc_chunk *prev = NULL;
-    for (struct malloc_chunk *chunk = bins[NUM_BINS - 1]; chunk;
-         chunk = chunk->next) {
-        ASSERT(chunk->magic == MALLOC_FREE);
-
-        struct malloc_chunk *allocated = NULL;
-        size_t chunk_size = bin_idx < 0 ? size : (1 << bin_idx);
-        if (chunk->capacity > chunk_size + MALLOC_FRAME_LEN) {
-            allocated = split(chunk, chunk_size);
-        } else if (chunk->capacity >= chunk_size) {
-            allocated = chunk;
-            // Remove chunk from the linked list.
-            if (prev) {
-                // If it was not at the head of the list.
-                prev->next = chunk->next;
-            } else {
-                // If it was at the head of the list.
-                bins[NUM_BINS - 1] = bins[NUM_BINS - 1]->next;
-            }
-        }
+    size_t capacity = ALIGN_UP(size, 16);
 
-        if (allocated) {
-            allocated->magic = MALLOC_IN_USE;
-            allocated->size = size;
-            memset(allocated->underflow_redzone, MALLOC_REDZONE_UNDFLOW_MARKER,
-                   MALLOC_REDZONE_LEN);
-            memset(&allocated->data[allocated->capacity],
-                   MALLOC_REDZONE_OVRFLOW_MARKER, MALLOC_REDZONE_LEN);
-            allocated->next = NULL;
-            return allocated->data;
-        }
-        prev = chunk;
+    struct malloc_chunk *chunk;
+    if (capacity <= MALLOC_SLAB_OBJ_MAX) {
+        chunk = alloc_obj(size_to_class(capacity));
+    } else {
+        chunk = alloc_large(MALLOC_FRAME_LEN + capacity);
+    }
+
+    if (!chunk) {
+        PANIC("out of memory");
     }
 
-    PANIC("out of memory");
+    stats.in_use += CHUNK_LEN(chunk);
+    stats.num_chunks++;
+    return mark_as_used(chunk, size);
 }
 
 static struct malloc_chunk *get_chunk_from_ptr(void *ptr) {
     struct malloc_chunk *chunk =
         (struct malloc_chunk *) ((uintptr_t) ptr - sizeof(struct malloc_chunk));
 
+    if (!(chunk->len & MALLOC_CHUNK_IN_USE)) {
+        PANIC("double-free bug!");
+    }
+
     // Check its magic and underflow/overflow redzones.
-    ASSERT(chunk->magic == MALLOC_IN_USE);
     check_buffer_overflow(chunk);
     return chunk;
 }
@@ -157,21 +447,15 @@ void free(void *ptr) {
     if (!ptr) {
         return;
     }
-    struct malloc_chunk *chunk = get_chunk_from_ptr(ptr);
-    if (chunk->magic == MALLOC_FREE) {
-        PANIC("double-free bug!");
-    }
-
-    chunk->magic = MALLOC_FREE;
-
-    int bin_idx = get_bin_idx_from_size(chunk->capacity);
-    bin_idx = bin_idx < 0 ? NUM_BINS - 1 : bin_idx;
 
-    struct malloc_chunk *head = bins[bin_idx];
-    if (head) {
-        chunk->next = head;
+    struct malloc_chunk *chunk = get_chunk_from_ptr(ptr);
+    stats.in_use -= CHUNK_LEN(chunk);
+    stats.num_chunks--;
+    if (chunk->len & MALLOC_CHUNK_LARGE) {
+        free_large(chunk);
+    } else {
+        free_obj(chunk);
     }
-    bins[bin_idx] = chunk;
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -180,19 +464,24 @@ void *realloc(void *ptr, size_t size) {
     }
 
     struct malloc_chunk *chunk = get_chunk_from_ptr(ptr);
-    size_t prev_size = chunk->size;
-    if (size <= chunk->capacity) {
+    size_t capacity = CHUNK_CAPACITY(chunk);
+    if (size <= capacity) {
         // There's enough room. Keep using the current chunk.
         return ptr;
     }
 
     // There's not enough room. Allocate a new space and copy old data.
     void *new_ptr = malloc(size);
-    memcpy(new_ptr, ptr, prev_size);
+    memcpy(new_ptr, ptr, capacity);
     free(ptr);
     return new_ptr;
 }
 
+/// Returns the statistics of the heap.
+void malloc_stats(struct malloc_stats *s) {
+    memcpy(s, &stats, sizeof(*s));
+}
+
 char *strndup(const char *s, size_t n) {
     char *new_s = malloc(n + 1);
     strncpy2(new_s, s, n + 1);
@@ -204,5 +493,13 @@ char *strdup(const char *s) {
 }
 
 void malloc_init(void) {
-    insert(__heap, (size_t) __heap_end - (size_t) __heap);
+    heap_top = (uint8_t *) ALIGN_UP((vaddr_t) __heap, 16);
+    heap_end = (uint8_t *) __heap_end;
+    for (size_t i = 0; i < MALLOC_NUM_BINS; i++) {
+        list_init(&bins[i]);
+    }
+
+    for (int i = 0; i < MALLOC_NUM_CLASSES; i++) {
+        list_init(&partial_slabs[i]);
+    }
 }
@@ -37,7 +37,7 @@ extern "C" {
     pub fn free(ptr: *mut u8);
     pub fn sys_ipc(dst: task_t, src: task_t, m: *mut Message, flags: c_unsigned) -> error_t;
     pub fn sys_notify(dst: task_t, notifications: notifications_t) -> error_t;
-    pub fn sys_timer_set(timeout: msec_t) -> error_t;
+    pub fn sys_timer_set(timeout: msec_t) -> msec_t;
     pub fn sys_task_create(
         tid: task_t,
         name: *const u8,
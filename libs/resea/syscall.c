@@ -11,7 +11,7 @@ error_t sys_notify(task_t dst, notifications_t notifications) {
     return syscall(SYS_NOTIFY, dst, notifications, 0, 0, 0);
 }
 
-error_t sys_timer_set(msec_t timeout) {
+msec_t sys_timer_set(msec_t timeout) {
     return syscall(SYS_TIMER_SET, timeout, 0, 0, 0, 0);
 }
 
@@ -45,6 +45,18 @@ error_t sys_vm_unmap(task_t task, vaddr_t vaddr) {
     return syscall(SYS_VM_UNMAP, task, vaddr, 0, 0, 0);
 }
 
+error_t sys_vm_map_range(task_t task, struct vm_map_range *range) {
+    return syscall(SYS_VM_MAP_RANGE, task, (uintptr_t) range, 0, 0, 0);
+}
+
+error_t sys_vm_unmap_range(task_t task, vaddr_t vaddr, size_t num_pages) {
+    return syscall(SYS_VM_UNMAP_RANGE, task, vaddr, num_pages, 0, 0);
+}
+
+error_t sys_ool_recv(void *buf, size_t len) {
+    return syscall(SYS_OOL_RECV, (uintptr_t) buf, len, 0, 0, 0);
+}
+
 error_t sys_irq_acquire(unsigned irq) {
     return syscall(SYS_IRQ_ACQUIRE, irq, 0, 0, 0, 0);
 }
@@ -29,6 +29,14 @@ error_t vm_unmap(task_t task, vaddr_t vaddr) {
     return sys_vm_unmap(task, vaddr);
 }
 
+error_t vm_map_range(task_t task, struct vm_map_range *range) {
+    return sys_vm_map_range(task, range);
+}
+
+error_t vm_unmap_range(task_t task, vaddr_t vaddr, size_t num_pages) {
+    return sys_vm_unmap_range(task, vaddr, num_pages);
+}
+
 error_t task_schedule(task_t task, int priority) {
     return sys_task_schedule(task, priority);
 }
@@ -1,8 +1,137 @@
+#include <list.h>
+#include <resea/printf.h>
 #include <resea/syscall.h>
 #include <resea/timer.h>
 
-// TODO: Support multiple timers.
+/// Pending timers sorted by the deadline.
+static list_t timers;
+/// The timer set by timer_set().
+static struct timer default_timer;
+/// The task-local clock in milliseconds. It's updated only when we touch the
+/// kernel timer.
+static int64_t now = 0;
+/// The timeout of the kernel timer currently set (0 if it's not set).
+static msec_t armed = 0;
+/// Set if the kernel timer has expired but we haven't received the
+/// NOTIFY_TIMER yet.
+static bool stale_notification = false;
 
+/// Cancels the kernel timer and brings the clock up to date.
+static void sync_clock(void) {
+    if (!armed) {
+        return;
+    }
+
+    msec_t remaining = sys_timer_set(0);
+    ASSERT(remaining >= 0);
+    if (!remaining) {
+        stale_notification = true;
+    }
+
+    now += armed - remaining;
+    armed = 0;
+}
+
+/// Sets the kernel timer for the nearest timer.
+static void rearm(void) {
+    sync_clock();
+    if (list_is_empty(&timers)) {
+        return;
+    }
+
+    struct timer *nearest = LIST_CONTAINER(timers.next, struct timer, next);
+    msec_t timeout = MAX(nearest->deadline - now, 1);
+    // It returns the remaining time of the previous timer or an error.
+    msec_t remaining = sys_timer_set(timeout);
+    ASSERT(remaining >= 0);
+    armed = timeout;
+}
+
+/// Adds a timer. `callback` is called from IPC functions such as `ipc_recv`
+/// when `timeout` milliseconds has passed. The timer must not be pending.
+void timer_add(struct timer *timer, msec_t timeout,
+               void (*callback)(struct timer *timer)) {
+    DEBUG_ASSERT(timeout > 0);
+    sync_clock();
+    timer->deadline = now + timeout;
+    timer->callback = callback;
+
+    // Keep the list sorted. Timers with the same deadline expire in FIFO order.
+    list_elem_t *prev = timers.prev;
+    while (prev != &timers) {
+        struct timer *t = LIST_CONTAINER(prev, struct timer, next);
+        if (t->deadline <= timer->deadline) {
+            break;
+        }
+        prev = prev->prev;
+    }
+
+    list_insert(prev, prev->next, &timer->next);
+    rearm();
+}
+
+/// Cancels a timer. It does nothing if the timer is not pending.
+void timer_cancel(struct timer *timer) {
+    if (!timer->next.next) {
+        return;
+    }
+
+    bool was_nearest = timers.next == &timer->next;
+    list_remove(&timer->next);
+    if (was_nearest) {
+        rearm();
+    }
+}
+
+/// Sets the task's default timer. The task will receive `NOTIFY_TIMER` in a
+/// `NOTIFICATIONS_MSG` after `timeout` milliseconds. If `timeout` is 0, it
+/// cancels the timer.
 error_t timer_set(msec_t timeout) {
-    return sys_timer_set(timeout);
+    if (timeout < 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    timer_cancel(&default_timer);
+    if (timeout > 0) {
+        timer_add(&default_timer, timeout, NULL);
+    }
+
+    return OK;
+}
+
+/// Calls callbacks of expired timers. Called when the task received
+/// `NOTIFY_TIMER`. Returns true if the default timer has expired.
+bool timer_expire(void) {
+    if (stale_notification) {
+        // We've already reset the kernel timer. Ask the kernel how much time
+        // has passed.
+        stale_notification = false;
+        sync_clock();
+    } else {
+        now += armed;
+        armed = 0;
+    }
+
+    bool default_expired = false;
+    while (!list_is_empty(&timers)) {
+        struct timer *timer = LIST_CONTAINER(timers.next, struct timer, next);
+        if (timer->deadline > now) {
+            break;
+        }
+
+        list_remove(&timer->next);
+        if (timer == &default_timer) {
+            default_expired = true;
+        } else {
+            timer->callback(timer);
+        }
+    }
+
+    rearm();
+    return default_expired;
+}
+
+void timer_init(void) {
+    list_init(&timers);
+    list_nullify(&default_timer.next);
 }
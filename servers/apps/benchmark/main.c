@@ -4,6 +4,7 @@
 #include <resea/printf.h>
 #include <resea/syscall.h>
 #include <string.h>
+#include <vprintf.h>
 
 #ifdef __x86_64__
 static inline uint64_t cycle_counter(void) {
@@ -183,6 +184,97 @@ inline static void end(int i) {
     iters[i].num_exceptions = exception_counter() - iters[i].num_exceptions;
 }
 
+#if defined(CONFIG_TCPIP_SERVER) && defined(CONFIG_TCPIP_LOOPBACK_LOSS)
+/// The size of data transferred in the TCP benchmark.
+#define TCP_BULK_LEN (1024 * 1024)
+#define TCP_CHUNK_LEN 4096
+
+/// Transfers TCP_BULK_LEN bytes over the loopback device in tcpip, dropping
+/// packets at `loss_rate` (in permille).
+static void tcp_bulk_transfer(task_t tcpip_server, uint16_t port,
+                              unsigned loss_rate) {
+    struct message m;
+    m.type = TCPIP_SET_LOOPBACK_LOSS_MSG;
+    m.tcpip_set_loopback_loss.permille = loss_rate;
+    ASSERT_OK(ipc_call(tcpip_server, &m));
+
+    m.type = TCPIP_LISTEN_MSG;
+    m.tcpip_listen.port = port;
+    m.tcpip_listen.backlog = 1;
+    ASSERT_OK(ipc_call(tcpip_server, &m));
+    handle_t listen_handle = m.tcpip_listen_reply.handle;
+
+    m.type = TCPIP_CONNECT_MSG;
+    m.tcpip_connect.dst_addr = 0x7f000001;  // 127.0.0.1
+    m.tcpip_connect.dst_port = port;
+    ASSERT_OK(ipc_call(tcpip_server, &m));
+    handle_t client_handle = m.tcpip_connect_reply.handle;
+
+    // Wait for the 3-way handshake (the SYN could be dropped).
+    handle_t server_handle;
+    while (true) {
+        m.type = TCPIP_ACCEPT_MSG;
+        m.tcpip_accept.handle = listen_handle;
+        error_t err = ipc_call(tcpip_server, &m);
+        if (err == OK) {
+            server_handle = m.tcpip_accept_reply.new_handle;
+            break;
+        }
+
+        ASSERT(err == ERR_NOT_FOUND);
+    }
+
+    uint8_t *buf = malloc(TCP_CHUNK_LEN);
+    size_t sent = 0;
+    size_t received = 0;
+    uint64_t cycles = cycle_counter();
+    while (received < TCP_BULK_LEN) {
+        if (sent < TCP_BULK_LEN) {
+            for (size_t i = 0; i < TCP_CHUNK_LEN; i++) {
+                buf[i] = (sent + i) & 0xff;
+            }
+
+            m.type = TCPIP_WRITE_MSG;
+            m.tcpip_write.handle = client_handle;
+            m.tcpip_write.data = buf;
+            m.tcpip_write.data_len = TCP_CHUNK_LEN;
+            ASSERT_OK(ipc_call(tcpip_server, &m));
+            sent += TCP_CHUNK_LEN;
+        }
+
+        m.type = TCPIP_READ_MSG;
+        m.tcpip_read.handle = server_handle;
+        m.tcpip_read.len = TCP_CHUNK_LEN;
+        ASSERT_OK(ipc_call(tcpip_server, &m));
+        uint8_t *data = m.tcpip_read_reply.data;
+        for (size_t i = 0; i < m.tcpip_read_reply.data_len; i++) {
+            ASSERT(data[i] == ((received + i) & 0xff));
+        }
+
+        received += m.tcpip_read_reply.data_len;
+        free(data);
+    }
+    cycles = cycle_counter() - cycles;
+
+    char name[64];
+    snprintf(name, sizeof(name), "TCP bulk transfer (%d/1000 loss)",
+             loss_rate);
+    uint64_t cycles_per_kb = cycles / (TCP_BULK_LEN / 1024);
+    METRIC(name, cycles_per_kb);
+    INFO("%s: %d cycles per KiB", name, cycles_per_kb);
+
+    // tcpip doesn't reply to close messages.
+    handle_t handles[] = {client_handle, server_handle, listen_handle};
+    for (size_t i = 0; i < sizeof(handles) / sizeof(*handles); i++) {
+        m.type = TCPIP_CLOSE_MSG;
+        m.tcpip_close.handle = handles[i];
+        ASSERT_OK(ipc_send(tcpip_server, &m));
+    }
+
+    free(buf);
+}
+#endif
+
 void main(void) {
     INFO("starting IPC benchmark...");
     task_t server_task = ipc_lookup("benchmark_server");
@@ -234,6 +326,23 @@ void main(void) {
     }
     print_stats("IPC round-trip (simple)");
 
+    //
+    //  IPC round-trip benchmark (FPU-using client)
+    //
+    //  A round-trip consists of two context switches. Since the server does
+    //  not touch the FPU, the kernel should not save/restore our FPU registers
+    //  and this should take as long as the simple one above.
+    //
+    for (int i = 0; i < NUM_ITERS; i++) {
+        static volatile double fpu_value = 1.0;
+        struct message m = {.type = BENCHMARK_NOP_MSG};
+        begin(i);
+        fpu_value = fpu_value * 1.5;
+        ipc_call(server_task, &m);
+        end(i);
+    }
+    print_stats("IPC round-trip (FPU-using client)");
+
     //
     //  IPC round-trip benchmark (with small ool payload)
     //
@@ -277,4 +386,146 @@ void main(void) {
         free(m.benchmark_nop_with_ool_reply.data);
     }
     print_stats("IPC round-trip (with PAGE_SIZE-sized ool)");
+
+    //
+    //  IPC round-trip benchmark (with multi-page ool payload)
+    //
+    uint8_t *large_payload = malloc(CONFIG_OOL_BUFFER_LEN);
+    memset(large_payload, 'A', CONFIG_OOL_BUFFER_LEN);
+    for (int i = 0; i < NUM_ITERS; i++) {
+        struct message m;
+        m.type = BENCHMARK_NOP_WITH_OOL_MSG;
+        m.benchmark_nop_with_ool.data = large_payload;
+        m.benchmark_nop_with_ool.data_len = CONFIG_OOL_BUFFER_LEN;
+
+        begin(i);
+        ipc_call(server_task, &m);
+        end(i);
+        ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
+        free(m.benchmark_nop_with_ool_reply.data);
+    }
+    print_stats("IPC round-trip (with CONFIG_OOL_BUFFER_LEN-sized ool)");
+    free(large_payload);
+
+    //
+    //  IPC round-trip benchmark (with ool payload larger than the kernel
+    //  buffer)
+    //
+    //  The vm server shares the pages of the payload with the receiver
+    //  copy-on-write instead of copying them.
+    //
+    size_t huge_len = 64 * PAGE_SIZE;
+    uint8_t *huge_payload = malloc(huge_len);
+    memset(huge_payload, 'A', huge_len);
+    for (int i = 0; i < NUM_ITERS; i++) {
+        struct message m;
+        m.type = BENCHMARK_NOP_WITH_OOL_MSG;
+        m.benchmark_nop_with_ool.data = huge_payload;
+        m.benchmark_nop_with_ool.data_len = huge_len;
+
+        begin(i);
+        ipc_call(server_task, &m);
+        end(i);
+        ASSERT(m.type == BENCHMARK_NOP_WITH_OOL_REPLY_MSG);
+        free(m.benchmark_nop_with_ool_reply.data);
+    }
+    print_stats("IPC round-trip (with 64-page ool)");
+    free(huge_payload);
+
+    //
+    //  Page fault benchmark
+    //
+    //  The pager allocates a page area for each faulted page. Lookups of page
+    //  areas should not be slowed down as the number of them grows.
+    //
+    size_t num_pages = NUM_ITERS * 4;
+    uint8_t *pages = malloc(num_pages * PAGE_SIZE);
+    uint8_t *first_page = (uint8_t *) ALIGN_UP((vaddr_t) pages, PAGE_SIZE);
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        first_page[i * PAGE_SIZE] = 1;
+        end(i);
+    }
+    print_stats("page fault");
+
+    for (size_t i = NUM_ITERS; i < num_pages - NUM_ITERS - 1; i++) {
+        first_page[i * PAGE_SIZE] = 1;
+    }
+
+    uint8_t *last_pages = &first_page[(num_pages - NUM_ITERS - 1) * PAGE_SIZE];
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        last_pages[i * PAGE_SIZE] = 1;
+        end(i);
+    }
+    print_stats("page fault (with thousands of page areas)");
+    free(pages);
+
+    //
+    //  malloc benchmark
+    //
+    static void *ptrs[NUM_ITERS];
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        ptrs[i] = malloc(64);
+        end(i);
+    }
+    print_stats("malloc (64-bytes)");
+
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        free(ptrs[i]);
+        end(i);
+    }
+    print_stats("free (64-bytes)");
+
+    // A packet buffer allocated and freed every time as in tcpip.
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        free(malloc(1514));
+        end(i);
+    }
+    print_stats("malloc and free (1514-bytes)");
+
+    // Interleaved allocations of various sizes.
+    for (int i = 0; i < NUM_ITERS; i++) {
+        ptrs[i] = malloc(16 << (i % 8));
+    }
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        free(ptrs[(i * 7) % NUM_ITERS]);
+        ptrs[(i * 7) % NUM_ITERS] = malloc(16 << ((i + 3) % 8));
+        end(i);
+    }
+    print_stats("malloc and free (various sizes)");
+    for (int i = 0; i < NUM_ITERS; i++) {
+        free(ptrs[i]);
+    }
+
+    for (int i = 0; i < NUM_ITERS; i++) {
+        begin(i);
+        free(malloc(4 * PAGE_SIZE + 1));
+        end(i);
+    }
+    print_stats("malloc and free (large chunk)");
+
+#if defined(CONFIG_TCPIP_SERVER) && defined(CONFIG_TCPIP_LOOPBACK_LOSS)
+    //
+    //  TCP bulk transfer benchmark
+    //
+    //  Measures the throughput over the loopback device under injected packet
+    //  losses. Lost segments should be recovered mostly by fast retransmits
+    //  instead of retransmission timeouts.
+    //
+    task_t tcpip_server = ipc_lookup("tcpip");
+    static const unsigned loss_rates[] = {0, 10, 50};
+    for (size_t i = 0; i < sizeof(loss_rates) / sizeof(*loss_rates); i++) {
+        tcp_bulk_transfer(tcpip_server, 8000 + i, loss_rates[i]);
+    }
+
+    struct message m;
+    m.type = TCPIP_SET_LOOPBACK_LOSS_MSG;
+    m.tcpip_set_loopback_loss.permille = 0;
+    ASSERT_OK(ipc_call(tcpip_server, &m));
+#endif
 }
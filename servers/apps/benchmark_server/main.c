@@ -10,16 +10,19 @@ void main(void) {
     struct message m;
     ipc_recv(IPC_ANY, &m);
     while (true) {
+        void *data = NULL;
         switch (m.type) {
             case BENCHMARK_NOP_MSG:
                 m.type = BENCHMARK_NOP_REPLY_MSG;
                 break;
             case BENCHMARK_NOP_WITH_OOL_MSG:
-                free(m.benchmark_nop_with_ool.data);
+                // Send back the payload as it is. It's freed after the reply.
+                data = m.benchmark_nop_with_ool.data;
                 m.type = BENCHMARK_NOP_WITH_OOL_REPLY_MSG;
                 break;
         }
 
         ipc_replyrecv(m.src, &m);
+        free(data);
     }
 }
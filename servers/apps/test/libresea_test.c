@@ -1,6 +1,30 @@
 #include "test.h"
+#include <resea/async.h>
+#include <resea/channel.h>
+#include <resea/handle.h>
+#include <resea/ipc.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/task.h>
+#include <resea/timer.h>
+#include <string.h>
+
+static struct timer timers[2];
+static int num_fired = 0;
+static struct timer *fired[2];
+
+static int num_freed_handles = 0;
+
+static void before_handle_free(void *data) {
+    num_freed_handles++;
+}
+
+static void timer_callback(struct timer *timer) {
+    if (num_fired < 2) {
+        fired[num_fired] = timer;
+    }
+    num_fired++;
+}
 
 void libresea_test(void) {
     // malloc
@@ -11,4 +35,81 @@ void libresea_test(void) {
     ptr = malloc(1);
     TEST_ASSERT(ptr != NULL);
     free(ptr);
+
+    // Multiple timers.
+    timer_add(&timers[1], 20, timer_callback);
+    timer_add(&timers[0], 10, timer_callback);
+    TEST_ASSERT(timer_set(30) == OK);
+    while (true) {
+        struct message m;
+        error_t err = ipc_recv(IPC_ANY, &m);
+        TEST_ASSERT(err == OK);
+        if (m.type == NOTIFICATIONS_MSG
+            && (m.notifications.data & NOTIFY_TIMER) != 0) {
+            break;
+        }
+    }
+    TEST_ASSERT(num_fired == 2);
+    TEST_ASSERT(fired[0] == &timers[0]);
+    TEST_ASSERT(fired[1] == &timers[1]);
+
+    // Channel (both ends in this task).
+    struct channel producer, consumer;
+    TEST_ASSERT(channel_create(&producer, task_self(), true, sizeof(int), 4)
+                == OK);
+    TEST_ASSERT(channel_open(&consumer, task_self(), false, producer.shm_id)
+                == OK);
+    int value;
+    TEST_ASSERT(channel_pop(&consumer, &value) == ERR_EMPTY);
+    TEST_ASSERT(channel_prepare_sleep(&consumer));
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT(channel_push(&producer, &i) == OK);
+    }
+    TEST_ASSERT(channel_push(&producer, &value) == ERR_WOULD_BLOCK);
+    TEST_ASSERT(channel_pop(&consumer, &value) == ERR_EMPTY);
+    channel_flush(&producer);
+    struct message m;
+    TEST_ASSERT(ipc_recv(IPC_ANY, &m) == OK);
+    TEST_ASSERT(m.type == NOTIFICATIONS_MSG
+                && (m.notifications.data & NOTIFY_CHANNEL) != 0);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT(channel_pop(&consumer, &value) == OK && value == i);
+    }
+    TEST_ASSERT(channel_pop(&consumer, &value) == ERR_EMPTY);
+    channel_flush(&consumer);
+    TEST_ASSERT(channel_push(&producer, &value) == OK);
+
+    // Handles.
+    task_t owner = task_self();
+    handle_t handles[1000];
+    for (int i = 0; i < 1000; i++) {
+        handles[i] = handle_alloc(owner);
+        TEST_ASSERT(handles[i] > 0);
+        handle_set(owner, handles[i], &handles[i]);
+    }
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT(handle_get(owner, handles[i]) == &handles[i]);
+    }
+    handle_free(owner, handles[10]);
+    TEST_ASSERT(handle_get(owner, handles[10]) == NULL);
+    TEST_ASSERT(handle_alloc(owner) == handles[10]);
+    TEST_ASSERT(handle_get(owner, handles[10]) == NULL);
+    handle_free_all(owner, before_handle_free);
+    TEST_ASSERT(num_freed_handles == 1000);
+    TEST_ASSERT(handle_get(owner, handles[0]) == NULL);
+
+    // Async message queue limit. Note that we can't pull messages sent to
+    // ourselves. They're left in the queue.
+    task_t self = task_self();
+    TEST_ASSERT(async_is_empty(self));
+    bzero(&m, sizeof(m));
+    m.type = BENCHMARK_NOP_MSG;
+    for (int i = 0; i < CONFIG_ASYNC_QUEUE_LEN; i++) {
+        TEST_ASSERT(async_send(self, &m) == OK);
+    }
+    TEST_ASSERT(async_send(self, &m) == ERR_WOULD_BLOCK);
+    TEST_ASSERT(!async_is_empty(self));
+    TEST_ASSERT(ipc_recv(IPC_ANY, &m) == OK);
+    TEST_ASSERT(m.type == NOTIFICATIONS_MSG
+                && (m.notifications.data & NOTIFY_ASYNC) != 0);
 }
@@ -40,4 +40,41 @@ void malloc_test(void) {
     }
     memset(ptr[NUM_PTRS - 1], 0xaa, (1 << 15) + 8);
     free(ptr[NUM_PTRS - 1]);
+
+    // realloc() from a slab object to a large chunk.
+    uint8_t *buf = malloc(100);
+    memset(buf, 0xbb, 100);
+    buf = realloc(buf, 10000);
+    TEST_ASSERT(buf != NULL);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT(buf[i] == 0xbb);
+    }
+    free(buf);
+
+    // Allocate many objects to use multiple slabs.
+    uint8_t *objs[256];
+    for (int i = 0; i < 256; i++) {
+        objs[i] = malloc(200);
+        TEST_ASSERT(((vaddr_t) objs[i] & 15) == 0);
+        memset(objs[i], i, 200);
+    }
+    for (int i = 0; i < 256; i++) {
+        TEST_ASSERT(objs[i][0] == i && objs[i][199] == i);
+        free(objs[i]);
+    }
+
+    // A large chunk is allocated from the vm server and returned on free().
+    struct malloc_stats before, after;
+    malloc_stats(&before);
+    uint8_t *large = malloc(1024 * 1024);
+    memset(large, 0xcc, 1024 * 1024);
+    malloc_stats(&after);
+    TEST_ASSERT(after.num_spans == before.num_spans + 1);
+    TEST_ASSERT(after.heap_len >= before.heap_len + 1024 * 1024);
+    TEST_ASSERT(after.num_chunks == before.num_chunks + 1);
+    free(large);
+    malloc_stats(&after);
+    TEST_ASSERT(after.num_spans == before.num_spans);
+    TEST_ASSERT(after.heap_len == before.heap_len);
+    TEST_ASSERT(after.in_use == before.in_use);
 }
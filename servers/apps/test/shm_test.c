@@ -44,6 +44,45 @@ void shm_util_test(void) {
     TEST_ASSERT(err == ERR_NOT_FOUND);
 }
 
+void shm_multi_page_test(void) {
+    struct message m;
+    error_t err;
+    // Create a multi-page shared memory
+    m.type = SHM_CREATE_MSG;
+    m.shm_create.size = 4;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    int shm_id = m.shm_create_reply.shm_id;
+    // Map it twice: the whole region should be mapped in both
+    bzero(&m, sizeof(m));
+    m.type = SHM_MAP_MSG;
+    m.shm_map.shm_id = shm_id;
+    m.shm_map.writable = true;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    uint8_t *p1 = (uint8_t *) m.shm_map_reply.vaddr;
+    bzero(&m, sizeof(m));
+    m.type = SHM_MAP_MSG;
+    m.shm_map.shm_id = shm_id;
+    m.shm_map.writable = false;
+    err = ipc_call(INIT_TASK, &m);
+    ASSERT_OK(err);
+    uint8_t *p2 = (uint8_t *) m.shm_map_reply.vaddr;
+    for (int i = 0; i < 4; i++) {
+        p1[i * PAGE_SIZE] = 'a' + i;
+    }
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT(p2[i * PAGE_SIZE] == 'a' + i);
+    }
+    // Closing it does not unmap existing mappings
+    bzero(&m, sizeof(m));
+    m.type = SHM_CLOSE_MSG;
+    m.shm_close.shm_id = shm_id;
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(p2[3 * PAGE_SIZE] == 'd');
+}
+
 void shm_access_test(void) {
     struct message m;
     error_t err;
@@ -55,6 +94,12 @@ void shm_access_test(void) {
     err = ipc_call(shm_test, &m);
     ASSERT_OK(err);
     int shm_id = m.shm_test_read_reply.shm_id;
+    // Only the owner is allowed to close it
+    bzero(&m, sizeof(m));
+    m.type = SHM_CLOSE_MSG;
+    m.shm_close.shm_id = shm_id;
+    err = ipc_call(INIT_TASK, &m);
+    TEST_ASSERT(err == ERR_NOT_PERMITTED);
     // Map Shared Memory to task
     bzero(&m, sizeof(m));
     m.type = SHM_MAP_MSG;
@@ -70,5 +115,6 @@ void shm_access_test(void) {
 
 void shm_test(void) {
     shm_util_test();
+    shm_multi_page_test();
     shm_access_test();
 }
@@ -16,7 +16,9 @@ struct mchunk *mm_resolve(struct mm *mm, vaddr_t vaddr) {
     return NULL;
 }
 
-struct mchunk *mm_alloc_mchunk(struct mm *mm, vaddr_t vaddr, size_t len) {
+/// Allocates memory pages from vm. Returns the address of the pages in our
+/// address space.
+static void *alloc_pages(size_t len, paddr_t *paddr) {
     DEBUG_ASSERT(IS_ALIGNED(len, PAGE_SIZE));
 
     struct message m;
@@ -27,32 +29,141 @@ struct mchunk *mm_alloc_mchunk(struct mm *mm, vaddr_t vaddr, size_t len) {
     ASSERT_OK(err);
     ASSERT(m.type == VM_ALLOC_PAGES_REPLY_MSG);
 
+    *paddr = m.vm_alloc_pages_reply.paddr;
+    return (void *) m.vm_alloc_pages_reply.vaddr;
+}
+
+/// Frees memory pages allocated by `alloc_pages`.
+static void free_pages(void *buf) {
+    struct message m;
+    m.type = VM_FREE_PAGES_MSG;
+    m.vm_free_pages.vaddr = (vaddr_t) buf;
+    error_t err = ipc_call(VM_TASK, &m);
+    ASSERT_OK(err);
+    ASSERT(m.type == VM_FREE_PAGES_REPLY_MSG);
+}
+
+struct mchunk *mm_alloc_mchunk(struct mm *mm, vaddr_t vaddr, size_t len) {
     struct mchunk *mchunk = malloc(sizeof(*mchunk));
     mchunk->vaddr = vaddr;
-    mchunk->paddr = m.vm_alloc_pages_reply.paddr;
-    mchunk->buf = (void *) m.vm_alloc_pages_reply.vaddr;
+    mchunk->buf = alloc_pages(len, &mchunk->paddr);
     mchunk->len = len;
+    mchunk->ref_count = malloc(sizeof(*mchunk->ref_count));
+    *mchunk->ref_count = 1;
+    mchunk->cow = false;
     list_push_back(&mm->mchunks, &mchunk->next);
     return mchunk;
 }
 
+/// Adds a mchunk which shares the memory pages with `src` to the child. The
+/// pages are copied on the first write either in the parent or the child.
 struct mchunk *mm_clone_mchunk(struct proc *child, struct mchunk *src) {
-    struct mchunk *dst = mm_alloc_mchunk(&child->mm, src->vaddr, src->len);
-    memcpy(dst->buf, src->buf, dst->len);
+    struct mchunk *dst = malloc(sizeof(*dst));
+    dst->vaddr = src->vaddr;
+    dst->paddr = src->paddr;
+    dst->buf = src->buf;
+    dst->len = src->len;
+    dst->ref_count = src->ref_count;
+    dst->cow = true;
+    src->cow = true;
+    (*src->ref_count)++;
+    list_push_back(&child->mm.mchunks, &dst->next);
     return dst;
 }
 
+/// Unmaps pages in [start, end) from the process. Does nothing if the range
+/// is empty.
+static error_t unmap_range(struct proc *proc, vaddr_t start, vaddr_t end) {
+    if (start == end) {
+        return OK;
+    }
+
+    return vm_unmap_range(proc->task, start, (end - start) / PAGE_SIZE);
+}
+
 errno_t mm_fork(struct proc *parent, struct proc *child) {
     list_init(&child->mm.mchunks);
-    if (parent) {
-        LIST_FOR_EACH (mchunk, &parent->mm.mchunks, struct mchunk, next) {
-            mm_clone_mchunk(child, mchunk);
+    if (!parent) {
+        return 0;
+    }
+
+    // The parent might have mapped the pages writable. Unmap them to remap
+    // read-only on the next access. Adjacent mchunks (e.g. heap pages) are
+    // unmapped at once.
+    vaddr_t start = 0;
+    vaddr_t end = 0;
+    error_t err = OK;
+    LIST_FOR_EACH (mchunk, &parent->mm.mchunks, struct mchunk, next) {
+        bool was_cow = mchunk->cow;
+        mm_clone_mchunk(child, mchunk);
+        if (was_cow || err != OK) {
+            continue;
         }
+
+        if (mchunk->vaddr != end) {
+            err = unmap_range(parent, start, end);
+            start = mchunk->vaddr;
+        }
+
+        end = mchunk->vaddr + mchunk->len;
+    }
+
+    if (err == OK) {
+        err = unmap_range(parent, start, end);
+    }
+
+    if (err != OK) {
+        // The parent's pages are left copy-on-write: they're copied on the
+        // next write as if they're shared.
+        WARN_DBG("%s: failed to unmap pages on fork: %s", parent->name,
+                 err2str(err));
+        mm_clear(&child->mm);
+        return -ENOMEM;
     }
 
     return 0;
 }
 
+/// Removes all mchunks. The memory pages are left to other processes sharing
+/// them, or freed if no one shares them.
+///
+/// The task MUST be destroyed in advance: some mchunks have been passed to the
+/// kernel as page tables of the task.
+void mm_clear(struct mm *mm) {
+    LIST_FOR_EACH (mchunk, &mm->mchunks, struct mchunk, next) {
+        (*mchunk->ref_count)--;
+        if (!*mchunk->ref_count) {
+            free_pages(mchunk->buf);
+            free(mchunk->ref_count);
+        }
+
+        list_remove(&mchunk->next);
+        free(mchunk);
+    }
+}
+
+/// Gives the process its own copy of a copy-on-write mchunk. It's not copied
+/// if other processes no longer share it.
+static error_t break_cow(struct proc *proc, struct mchunk *mchunk) {
+    DEBUG_ASSERT(mchunk->cow);
+
+    if (*mchunk->ref_count > 1) {
+        paddr_t paddr;
+        void *buf = alloc_pages(mchunk->len, &paddr);
+        memcpy(buf, mchunk->buf, mchunk->len);
+        (*mchunk->ref_count)--;
+        mchunk->ref_count = malloc(sizeof(*mchunk->ref_count));
+        *mchunk->ref_count = 1;
+        mchunk->paddr = paddr;
+        mchunk->buf = buf;
+    }
+
+    mchunk->cow = false;
+
+    // Pages in the mchunk might be mapped read-only.
+    return vm_unmap_range(proc->task, mchunk->vaddr, mchunk->len / PAGE_SIZE);
+}
+
 error_t copy_from_user(struct proc *proc, void *dst, vaddr_t src, size_t len) {
     size_t remaining = len;
     while (remaining > 0) {
@@ -90,6 +201,13 @@ error_t copy_to_user(struct proc *proc, vaddr_t dst, const void *src,
             DEBUG_ASSERT(mchunk);
         }
 
+        if (mchunk->cow) {
+            error_t err = break_cow(proc, mchunk);
+            if (err != OK) {
+                return err;
+            }
+        }
+
         memcpy(&mchunk->buf[dst - mchunk->vaddr], src, copy_len);
         dst += copy_len;
         src += copy_len;
@@ -148,10 +266,23 @@ static error_t map_page(struct proc *proc, vaddr_t vaddr, vaddr_t paddr,
     }
 }
 
-static vaddr_t fill_page(struct proc *proc, vaddr_t vaddr, unsigned fault) {
+static vaddr_t fill_page(struct proc *proc, vaddr_t vaddr, unsigned fault,
+                         unsigned *flags) {
     vaddr_t aligned_vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    *flags = MAP_TYPE_READWRITE;
+
+    // Look for the associated mchunk.
+    struct mchunk *mchunk = mm_resolve(&proc->mm, vaddr);
 
     if (fault & EXP_PF_PRESENT) {
+        if (mchunk && mchunk->cow && (fault & EXP_PF_WRITE)) {
+            if (break_cow(proc, mchunk) != OK) {
+                return 0;
+            }
+
+            return (vaddr_t) mchunk->buf + (aligned_vaddr - mchunk->vaddr);
+        }
+
         // Invalid access. For instance the user thread has tried to write to
         // readonly area.
         WARN("%s: invalid memory access at %p (perhaps segfault?)", proc->name,
@@ -159,9 +290,17 @@ static vaddr_t fill_page(struct proc *proc, vaddr_t vaddr, unsigned fault) {
         return 0;
     }
 
-    // Look for the associated mchunk.
-    struct mchunk *mchunk = mm_resolve(&proc->mm, vaddr);
     if (mchunk) {
+        if (mchunk->cow) {
+            if (fault & EXP_PF_WRITE) {
+                if (break_cow(proc, mchunk) != OK) {
+                    return 0;
+                }
+            } else {
+                *flags = MAP_TYPE_READONLY;
+            }
+        }
+
         return (vaddr_t) mchunk->buf + (aligned_vaddr - mchunk->vaddr);
     }
 
@@ -239,7 +378,8 @@ static vaddr_t fill_page(struct proc *proc, vaddr_t vaddr, unsigned fault) {
 }
 
 error_t handle_page_fault(struct proc *proc, vaddr_t vaddr, unsigned fault) {
-    vaddr_t target = fill_page(proc, vaddr, fault);
+    unsigned flags;
+    vaddr_t target = fill_page(proc, vaddr, fault, &flags);
     if (!target) {
         WARN_DBG("failed to fill a page for %s", proc->name);
         // TODO: Kill the proc.
@@ -247,7 +387,6 @@ error_t handle_page_fault(struct proc *proc, vaddr_t vaddr, unsigned fault) {
     }
 
     vaddr_t aligned_vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
-    ASSERT_OK(map_page(proc, aligned_vaddr, target,
-                       MAP_TYPE_READWRITE /* TODO: */, false));
+    ASSERT_OK(map_page(proc, aligned_vaddr, target, flags, false));
     return OK;
 }
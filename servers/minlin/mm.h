@@ -11,6 +11,12 @@ struct mchunk {
     paddr_t paddr;
     void *buf;
     size_t len;
+    /// The number of mchunks (in forked processes) sharing `buf`. The counter
+    /// itself is shared among them.
+    unsigned *ref_count;
+    /// `buf` may be shared with other processes (copy-on-write): it's mapped
+    /// read-only and copied on the first write.
+    bool cow;
 };
 
 struct mm {
@@ -24,8 +30,10 @@ error_t copy_to_user(struct proc *proc, vaddr_t dst, const void *src,
 size_t strncpy_from_user(struct proc *proc, char *dst, vaddr_t src,
                          size_t max_len);
 error_t handle_page_fault(struct proc *proc, vaddr_t vaddr, unsigned fault);
+struct mchunk *mm_resolve(struct mm *mm, vaddr_t vaddr);
 struct mchunk *mm_alloc_mchunk(struct mm *mm, vaddr_t vaddr, size_t len);
 struct mchunk *mm_clone_mchunk(struct proc *child, struct mchunk *src);
 errno_t mm_fork(struct proc *parent, struct proc *child);
+void mm_clear(struct mm *mm);
 
 #endif
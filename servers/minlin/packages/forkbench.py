@@ -0,0 +1,70 @@
+import sys; sys.path.append('..')
+from build import Package
+
+SOURCE = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NUM_ITERS 32
+
+static inline uint64_t cycle_counter(void) {
+    uint32_t eax, edx;
+    __asm__ __volatile__("rdtscp" : "=a"(eax), "=d"(edx)::"%ecx");
+    return (((uint64_t) edx) << 32) | eax;
+}
+
+static char heap[4 * 1024 * 1024];
+
+static void bench(const char *name, size_t touch, int do_exec) {
+    memset(heap, 'A', touch);
+
+    uint64_t min = UINT64_MAX, total = 0;
+    for (int i = 0; i < NUM_ITERS; i++) {
+        uint64_t start = cycle_counter();
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (do_exec) {
+                char *argv[] = {"echo", "-n", NULL};
+                char *envp[] = {NULL};
+                execve("/bin/echo", argv, envp);
+            }
+            _exit(0);
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        uint64_t cycles = cycle_counter() - start;
+        min = (cycles < min) ? cycles : min;
+        total += cycles;
+    }
+
+    printf("forkbench: %s: avg=%llu, min=%llu\n", name,
+           (unsigned long long) (total / NUM_ITERS), (unsigned long long) min);
+}
+
+int main(void) {
+    bench("fork+exit (16KiB touched)", 16 * 1024, 0);
+    bench("fork+exit (4MiB touched)", sizeof(heap), 0);
+    bench("fork+exec (16KiB touched)", 16 * 1024, 1);
+    bench("fork+exec (4MiB touched)", sizeof(heap), 1);
+    return 0;
+}
+"""
+
+class Forkbench(Package):
+    def __init__(self):
+        super().__init__()
+        self.name = "forkbench"
+        self.version = ""
+        self.url = None
+        self.host_deps = ["musl-tools"]
+        self.files = {
+            "/bin/forkbench": "forkbench"
+        }
+
+    def build(self):
+        self.add_file("forkbench.c", SOURCE)
+        self.run("cd /build && musl-gcc -static -O2 -o forkbench forkbench.c")
@@ -135,17 +135,16 @@ errno_t proc_execve(struct proc *proc, const char *path, char *argv[],
                     char *envp[]) {
     // TODO: free resouces on failures
 
-    // Clear the address space.
-    // FIXME: Move into mm.
-    list_init(&proc->mm.mchunks);
-    DEBUG_ASSERT(list_is_empty(&proc->mm.mchunks));
-
     error_t e;
     e = task_destroy(proc->task);
     if (e != OK) {
         return -EINVAL;
     }
 
+    // Clear the address space.
+    mm_clear(&proc->mm);
+    DEBUG_ASSERT(list_is_empty(&proc->mm.mchunks));
+
     e = task_create(proc->task, proc->name, 0, task_self(), TASK_ABI_EMU);
     if (e != OK) {
         return -EINVAL;
@@ -206,7 +205,11 @@ pid_t proc_fork(struct proc *parent) {
     }
 
     fs_fork(parent, child);
-    mm_fork(parent, child);
+    errno_t err = mm_fork(parent, child);
+    if (err < 0) {
+        proc_destroy(child);
+        return err;
+    }
 
     child->parent = parent;
     if (parent) {
@@ -218,8 +221,9 @@ pid_t proc_fork(struct proc *parent) {
         child->phdrs = parent->phdrs;
         child->fsbase = parent->fsbase;
         child->gsbase = parent->gsbase;
-        child->file_header = mm_clone_mchunk(child, parent->file_header);
-        child->stack = mm_clone_mchunk(child, parent->stack);
+        child->file_header =
+            mm_resolve(&child->mm, parent->file_header->vaddr);
+        child->stack = mm_resolve(&child->mm, parent->stack->vaddr);
         memcpy(&child->frame, &parent->frame, sizeof(child->frame));
     } else {
         // The init process.
@@ -235,9 +239,8 @@ pid_t proc_fork(struct proc *parent) {
         child->gsbase = 0;
     }
 
-    error_t err =
-        task_create(child->task, child->name, 0, task_self(), TASK_ABI_EMU);
-    if (err != OK) {
+    if (task_create(child->task, child->name, 0, task_self(), TASK_ABI_EMU)
+        != OK) {
         return -EAGAIN;
     }
 
@@ -258,6 +261,7 @@ void proc_resume(struct proc *proc) {
 
 void proc_destroy(struct proc *proc) {
     // TODO:
+    DEBUG_ASSERT(list_is_empty(&proc->mm.mchunks));
     list_remove(&proc->next);
 }
 
@@ -279,6 +283,12 @@ pid_t proc_try_wait(struct proc *proc, pid_t pid, int *wstatus, int options) {
 
 void proc_exit(struct proc *proc) {
     proc->state = PROC_EXITED;
+
+    // Release the address space now instead of when the parent reaps the
+    // process: otherwise the parent keeps copying the pages shared with it on
+    // writes.
+    ASSERT_OK(task_destroy(proc->task));
+    mm_clear(&proc->mm);
     waitqueue_wake_all(&waiting_procs_wq);
 }
 
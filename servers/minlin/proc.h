@@ -106,6 +106,7 @@ void proc_block(struct proc *proc, struct waitqueue *wq);
 void proc_resume(struct proc *proc);
 pid_t proc_try_wait(struct proc *proc, pid_t pid, int *wstatus, int options);
 void proc_exit(struct proc *proc);
+void proc_destroy(struct proc *proc);
 errno_t proc_execve(struct proc *proc, const char *path, char *argv[],
                     char *envp[]);
 struct proc *proc_lookup_by_task(task_t task);
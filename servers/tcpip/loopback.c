@@ -0,0 +1,76 @@
+#include "loopback.h"
+#include "device.h"
+#include "ipv4.h"
+#include <list.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
+
+/// A packet sent to the loopback device.
+struct loopback_packet {
+    list_elem_t next;
+    mbuf_t pkt;
+};
+
+static device_t loopback_device;
+/// Packets to be received from the loopback device.
+static list_t rx_queue;
+#ifdef CONFIG_TCPIP_LOOPBACK_LOSS
+/// The probability (in permille) of dropping a packet to emulate a lossy
+/// link.
+static unsigned loss_rate = 0;
+static uint32_t random_state = 1;
+
+/// A xorshift pseudo random number generator. It's good enough to decide
+/// which packets to drop.
+static uint32_t loopback_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+#endif
+
+static void loopback_transmit(device_t device, enum ether_type type,
+                              ipaddr_t *dst, mbuf_t payload) {
+#ifdef CONFIG_TCPIP_LOOPBACK_LOSS
+    if (loss_rate && loopback_random() % 1000 < loss_rate) {
+        mbuf_delete(payload);
+        return;
+    }
+#endif
+
+    struct loopback_packet *p = malloc(sizeof(*p));
+    p->pkt = payload;
+    list_push_back(&rx_queue, &p->next);
+}
+
+/// Receives packets sent to the loopback device. Returns false if there're
+/// no packets.
+bool loopback_deliver(void) {
+    bool delivered = false;
+    struct loopback_packet *p;
+    while ((p = LIST_POP_FRONT(&rx_queue, struct loopback_packet, next))) {
+        ipv4_receive(loopback_device, p->pkt);
+        free(p);
+        delivered = true;
+    }
+
+    return delivered;
+}
+
+#ifdef CONFIG_TCPIP_LOOPBACK_LOSS
+void loopback_set_loss_rate(unsigned permille) {
+    loss_rate = MIN(permille, 1000);
+}
+#endif
+
+void loopback_init(void) {
+    list_init(&rx_queue);
+    loopback_device = device_new("lo", loopback_transmit, NULL, NULL);
+    ASSERT(loopback_device);
+
+    ipaddr_t ipaddr = {.type = IP_TYPE_V4, .v4 = 0x7f000001 /* 127.0.0.1 */};
+    ipaddr_t netmask = {.type = IP_TYPE_V4, .v4 = 0xff000000};
+    ipaddr_t gateway = {.type = IP_TYPE_V4, .v4 = IPV4_ADDR_UNSPECIFIED};
+    device_set_ip_addrs(loopback_device, &ipaddr, &netmask, &gateway);
+}
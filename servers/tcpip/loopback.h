@@ -0,0 +1,10 @@
+#ifndef __LOOPBACK_H__
+#define __LOOPBACK_H__
+
+#include <types.h>
+
+bool loopback_deliver(void);
+void loopback_set_loss_rate(unsigned permille);
+void loopback_init(void);
+
+#endif
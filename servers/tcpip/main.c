@@ -2,6 +2,7 @@
 #include "device.h"
 #include "dhcp.h"
 #include "dns.h"
+#include "loopback.h"
 #include "sys.h"
 #include "tcp.h"
 #include "udp.h"
@@ -17,6 +18,14 @@ struct client {
     task_t task;
     handle_t handle;
     tcp_sock_t sock;
+    /// The element in `pending_clients`.
+    list_elem_t pending_next;
+    /// The number of TCPIP_NEW_CLIENT_MSG not yet sent since the task's async
+    /// queue was full.
+    unsigned pending_new_clients;
+    /// Whether TCPIP_RECEIVED_MSG is not yet sent since the task's async queue
+    /// was full.
+    bool pending_received;
 };
 
 struct dns_request {
@@ -28,6 +37,8 @@ struct dns_request {
 static unsigned next_driver_id = 0;
 static list_t drivers;
 static list_t dns_requests;
+/// Clients with notifications to be retried.
+static list_t pending_clients;
 static uint16_t next_dns_query_id = 1;
 static msec_t uptime = 0;
 
@@ -54,11 +65,89 @@ static void transmit(device_t device, mbuf_t pkt) {
     m.type = NET_TX_MSG;
     m.net_tx.payload = payload;
     m.net_tx.payload_len = len;
-    async_send(driver->tid, &m);
+    if (async_send(driver->tid, &m) != OK) {
+        // The driver is too slow. Drop the packet as a NIC does when its TX
+        // queue is full: TCP will retransmit it later.
+        WARN_DBG("dropping a packet to %s", device->name);
+        free(payload);
+    }
+}
+
+static struct client *client_new(task_t task, tcp_sock_t sock) {
+    struct client *c = malloc(sizeof(*c));
+    c->sock = sock;
+    c->task = task;
+    c->handle = handle_alloc(task);
+    c->pending_new_clients = 0;
+    c->pending_received = false;
+    list_nullify(&c->pending_next);
+    handle_set(task, c->handle, c);
+    return c;
+}
+
+/// Sends a notification to the client. Returns false if the client's async
+/// queue is full: the caller should retry later.
+static bool notify_client(struct client *c, int type) {
+    struct message m;
+    bzero(&m, sizeof(m));
+    m.type = type;
+    switch (type) {
+        case TCPIP_NEW_CLIENT_MSG:
+            m.tcpip_new_client.handle = c->handle;
+            break;
+        case TCPIP_RECEIVED_MSG:
+            m.tcpip_received.handle = c->handle;
+            break;
+        default:
+            UNREACHABLE();
+    }
+
+    error_t err = async_send(c->task, &m);
+    if (err == ERR_WOULD_BLOCK) {
+        return false;
+    }
+
+    if (err != OK) {
+        WARN_DBG("failed to notify %d: %s", c->task, err2str(err));
+    }
+
+    return true;
+}
+
+/// Retries pending notifications to the client in deferred_work().
+static void defer_client(struct client *c) {
+    if (!c->pending_next.next) {
+        list_push_back(&pending_clients, &c->pending_next);
+    }
+}
+
+/// Retries notifications which couldn't be sent since the client was too
+/// slow to pull them.
+static void flush_pending_clients(void) {
+    LIST_FOR_EACH (c, &pending_clients, struct client, pending_next) {
+        while (c->pending_new_clients > 0
+               && notify_client(c, TCPIP_NEW_CLIENT_MSG)) {
+            c->pending_new_clients--;
+        }
+
+        if (c->pending_received && notify_client(c, TCPIP_RECEIVED_MSG)) {
+            c->pending_received = false;
+        }
+
+        if (!c->pending_new_clients && !c->pending_received) {
+            list_remove(&c->pending_next);
+        }
+    }
 }
 
 static void deferred_work(void) {
-    tcp_flush();
+    // Packets sent to the loopback device are received here. It may produce
+    // more packets (e.g. ACKs) so repeat until TCP has nothing to send.
+    do {
+        tcp_flush();
+    } while (loopback_deliver());
+
+    flush_pending_clients();
 
     // TODO:
     LIST_FOR_EACH (driver, &drivers, struct driver, next) {
@@ -109,22 +198,29 @@ void sys_process_event(struct event *e) {
     bzero(&m, sizeof(m));
     switch (e->type) {
         case TCP_NEW_CLIENT: {
-            tcp_sock_t sock = e->tcp_new_client.listen_sock;
-            m.type = TCPIP_NEW_CLIENT_MSG;
-            m.tcpip_new_client.handle = sock->client->handle;
-            async_send(sock->client->task, &m);
+            struct client *c = e->tcp_new_client.listen_sock->client;
+            // Keep the order of notifications: don't send a new one while
+            // older ones are pending.
+            if (c->pending_new_clients > 0
+                || !notify_client(c, TCPIP_NEW_CLIENT_MSG)) {
+                c->pending_new_clients++;
+                defer_client(c);
+            }
             break;
         }
         case TCP_RECEIVED: {
-            tcp_sock_t sock = e->tcp_received.sock;
-            if (!sock->client) {
+            struct client *c = e->tcp_received.sock->client;
+            if (!c) {
                 // Not yet accepted by the owner task.
                 break;
             }
 
-            m.type = TCPIP_RECEIVED_MSG;
-            m.tcpip_received.handle = sock->client->handle;
-            async_send(sock->client->task, &m);
+            // A pending TCPIP_RECEIVED_MSG also covers the new data.
+            if (!c->pending_received
+                && !notify_client(c, TCPIP_RECEIVED_MSG)) {
+                c->pending_received = true;
+                defer_client(c);
+            }
             break;
         }
         case DNS_GOT_ANSWER: {
@@ -146,6 +242,7 @@ msec_t sys_uptime(void) {
 
 static void free_handle(void *data) {
     struct client *c = data;
+    list_remove(&c->pending_next);
     tcp_close(c->sock);
 }
 
@@ -153,9 +250,11 @@ void main(void) {
     TRACE("starting...");
     list_init(&drivers);
     list_init(&dns_requests);
+    list_init(&pending_clients);
 
     // Initialize the TCP/IP protocol stack.
     device_init();
+    loopback_init();
     tcp_init();
     udp_init();
     dhcp_init();
@@ -204,11 +303,7 @@ void main(void) {
                 dst_addr.v4 = m.tcpip_connect.dst_addr;
                 tcp_connect(sock, &dst_addr, m.tcpip_connect.dst_port);
 
-                sock->client = malloc(sizeof(*sock->client));
-                sock->client->sock = sock;
-                sock->client->task = m.src;
-                sock->client->handle = handle_alloc(m.src);
-                handle_set(m.src, sock->client->handle, sock->client);
+                sock->client = client_new(m.src, sock);
 
                 m.type = TCPIP_CONNECT_REPLY_MSG;
                 m.tcpip_connect_reply.handle = sock->client->handle;
@@ -223,11 +318,7 @@ void main(void) {
                 tcp_bind(sock, &any_ipaddr, m.tcpip_listen.port);
                 tcp_listen(sock, m.tcpip_listen.backlog);
 
-                sock->client = malloc(sizeof(*sock->client));
-                sock->client->sock = sock;
-                sock->client->task = m.src;
-                sock->client->handle = handle_alloc(m.src);
-                handle_set(m.src, sock->client->handle, sock->client);
+                sock->client = client_new(m.src, sock);
 
                 m.type = TCPIP_LISTEN_REPLY_MSG;
                 m.tcpip_listen_reply.handle = sock->client->handle;
@@ -247,11 +338,7 @@ void main(void) {
                     break;
                 }
 
-                new_sock->client = malloc(sizeof(*new_sock->client));
-                new_sock->client->sock = new_sock;
-                new_sock->client->task = m.src;
-                new_sock->client->handle = handle_alloc(m.src);
-                handle_set(m.src, new_sock->client->handle, new_sock->client);
+                new_sock->client = client_new(m.src, new_sock);
 
                 m.type = TCPIP_ACCEPT_REPLY_MSG;
                 m.tcpip_accept_reply.new_handle = new_sock->client->handle;
@@ -310,6 +397,17 @@ void main(void) {
                 free(m.tcpip_dns_resolve.hostname);
                 break;
             }
+            case TCPIP_SET_LOOPBACK_LOSS_MSG:
+#ifdef CONFIG_TCPIP_LOOPBACK_LOSS
+                loopback_set_loss_rate(m.tcpip_set_loopback_loss.permille);
+                m.type = TCPIP_SET_LOOPBACK_LOSS_REPLY_MSG;
+                ipc_reply(m.src, &m);
+#else
+                // A benchmark-only knob: don't let tasks degrade loopback
+                // connections of others.
+                ipc_reply_err(m.src, ERR_NOT_PERMITTED);
+#endif
+                break;
             case NET_RX_MSG: {
                 struct driver *driver = get_driver_by_tid(m.src);
                 if (!driver) {
@@ -67,12 +67,19 @@ void mbuf_append(mbuf_t mbuf, mbuf_t new_tail) {
 }
 
 void mbuf_append_bytes(mbuf_t mbuf, const void *data, size_t len) {
-    size_t remaining = MBUF_MAX_LEN - mbuf->offset_end;
-    if (len <= remaining) {
-        memcpy(&mbuf->data[mbuf->offset_end], data, len);
-        mbuf->offset_end += len;
-    } else {
-        mbuf_append(mbuf, mbuf_new(data, len));
+    struct mbuf *tail = mbuf;
+    while (tail->next) {
+        tail = tail->next;
+    }
+
+    // Fill the tail first so that a stream of small writes doesn't end up in
+    // a long chain of mostly empty mbufs.
+    size_t copy_len = MIN(len, MBUF_MAX_LEN - tail->offset_end);
+    memcpy(&tail->data[tail->offset_end], data, copy_len);
+    tail->offset_end += copy_len;
+    if (len > copy_len) {
+        const uint8_t *rest = (const uint8_t *) data + copy_len;
+        tail->next = mbuf_new(rest, len - copy_len);
     }
 }
 
@@ -152,6 +159,39 @@ mbuf_t mbuf_peek(mbuf_t mbuf, size_t len) {
     return head;
 }
 
+/// Copies `len` bytes at `offset` into a new mbuf. Unlike mbuf_peek(), the
+/// data is packed into full-sized mbufs: only the last one may have an odd
+/// length, which checksum_update_mbuf() relies on.
+mbuf_t mbuf_slice(mbuf_t mbuf, size_t offset, size_t len) {
+    while (mbuf && offset >= mbuf_len_one(mbuf)) {
+        offset -= mbuf_len_one(mbuf);
+        mbuf = mbuf->next;
+    }
+
+    mbuf_t head = mbuf_alloc();
+    mbuf_t dst = head;
+    while (mbuf && len > 0) {
+        if (dst->offset_end == MBUF_MAX_LEN) {
+            dst->next = mbuf_alloc();
+            dst = dst->next;
+        }
+
+        size_t copy_len = MIN(len, mbuf_len_one(mbuf) - offset);
+        copy_len = MIN(copy_len, MBUF_MAX_LEN - dst->offset_end);
+        memcpy(&dst->data[dst->offset_end], &mbuf->data[mbuf->offset + offset],
+               copy_len);
+        dst->offset_end += copy_len;
+        len -= copy_len;
+        offset += copy_len;
+        if (offset == mbuf_len_one(mbuf)) {
+            mbuf = mbuf->next;
+            offset = 0;
+        }
+    }
+
+    return head;
+}
+
 size_t mbuf_discard(mbuf_t *mbuf, size_t len) {
     size_t remaining = len;
     while (true) {
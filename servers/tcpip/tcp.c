@@ -6,11 +6,17 @@
 #include "sys.h"
 #include <endian.h>
 #include <list.h>
+#include <resea/malloc.h>
 #include <resea/printf.h>
 #include <string.h>
 
 static struct tcp_socket sockets[TCP_SOCKETS_MAX];
 static list_t active_socks;
+static list_t free_socks;
+/// Connected sockets hashed by the local port and the remote endpoint.
+static list_t conn_socks[TCP_CONN_BUCKETS];
+/// Listening sockets hashed by the local port.
+static list_t listen_socks[TCP_LISTEN_BUCKETS];
 
 static void tcp_set_pendings(struct tcp_socket *sock, uint32_t pendings) {
     sock->pendings |= pendings;
@@ -22,22 +28,57 @@ static uint32_t tcp_clear_pendings(struct tcp_socket *sock) {
     return pendings;
 }
 
-static struct tcp_socket *tcp_lookup_local(endpoint_t *ep) {
-    LIST_FOR_EACH (sock, &active_socks, struct tcp_socket, next) {
-        if (!ipaddr_is_unspecified(&sock->local.addr)
-            && !ipaddr_equals(&sock->local.addr, &ep->addr)) {
-            continue;
-        }
+/// Sequence number comparisons (modulo 2^32).
+static inline bool seq_lt(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
 
-        if (sock->local.port != ep->port) {
-            continue;
-        }
+static inline bool seq_gt(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) > 0;
+}
 
-        if (!ipaddr_is_unspecified(&sock->remote.addr)) {
-            continue;
-        }
+static inline bool seq_geq(uint32_t a, uint32_t b) {
+    return !seq_lt(a, b);
+}
 
-        return sock;
+static list_t *conn_bucket(port_t local_port, endpoint_t *remote) {
+    uint32_t h = remote->addr.v4 ^ ((uint32_t) remote->port << 16) ^ local_port;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return &conn_socks[h % TCP_CONN_BUCKETS];
+}
+
+static list_t *listen_bucket(port_t local_port) {
+    return &listen_socks[local_port % TCP_LISTEN_BUCKETS];
+}
+
+/// Adds the socket to the active sockets and the hash table: the one for
+/// connected sockets if the remote endpoint is known or the one for
+/// listening sockets otherwise.
+static void tcp_activate(struct tcp_socket *sock) {
+    list_t *bucket = (ipaddr_is_unspecified(&sock->remote.addr))
+                         ? listen_bucket(sock->local.port)
+                         : conn_bucket(sock->local.port, &sock->remote);
+    list_push_back(bucket, &sock->hash_next);
+    list_push_back(&active_socks, &sock->next);
+}
+
+static bool tcp_local_matches(struct tcp_socket *sock, endpoint_t *ep) {
+    if (!ipaddr_is_unspecified(&sock->local.addr)
+        && !ipaddr_equals(&sock->local.addr, &ep->addr)) {
+        return false;
+    }
+
+    return sock->local.port == ep->port;
+}
+
+static struct tcp_socket *tcp_lookup_local(endpoint_t *ep) {
+    list_t *bucket = listen_bucket(ep->port);
+    LIST_FOR_EACH (sock, bucket, struct tcp_socket, hash_next) {
+        if (tcp_local_matches(sock, ep)) {
+            return sock;
+        }
     }
 
     return NULL;
@@ -45,13 +86,9 @@ static struct tcp_socket *tcp_lookup_local(endpoint_t *ep) {
 
 static struct tcp_socket *tcp_lookup(endpoint_t *dst_ep, endpoint_t *src_ep) {
     // Look for the destination socket.
-    LIST_FOR_EACH (sock, &active_socks, struct tcp_socket, next) {
-        if (!ipaddr_is_unspecified(&sock->local.addr)
-            && !ipaddr_equals(&sock->local.addr, &dst_ep->addr)) {
-            continue;
-        }
-
-        if (sock->local.port != dst_ep->port) {
+    list_t *bucket = conn_bucket(dst_ep->port, src_ep);
+    LIST_FOR_EACH (sock, bucket, struct tcp_socket, hash_next) {
+        if (!tcp_local_matches(sock, dst_ep)) {
             continue;
         }
 
@@ -71,14 +108,8 @@ static struct tcp_socket *tcp_lookup(endpoint_t *dst_ep, endpoint_t *src_ep) {
 }
 
 tcp_sock_t tcp_new(void) {
-    struct tcp_socket *sock = NULL;
-    for (int i = 0; i < TCP_SOCKETS_MAX; i++) {
-        if (!sockets[i].in_use) {
-            sock = &sockets[i];
-            break;
-        }
-    }
-
+    struct tcp_socket *sock =
+        LIST_POP_FRONT(&free_socks, struct tcp_socket, next);
     if (!sock) {
         return NULL;
     }
@@ -87,30 +118,54 @@ tcp_sock_t tcp_new(void) {
     sock->state = TCP_STATE_CLOSED;
     sock->pendings = 0;
     sock->next_seqno = 0;
-    sock->last_seqno = 0;
+    sock->send_seqno = 0;
+    sock->high_seqno = 0;
     sock->last_ack = 0;
     sock->local_winsize = TCP_RX_BUF_SIZE;
+    sock->adv_wnd_edge = 0;
+    sock->remote_winsize = 0;
+    sock->local_wscale = 0;
+    sock->remote_wscale = 0;
+    sock->mss = TCP_MSS_DEFAULT;
     memset(&sock->local.addr, 0, sizeof(ipaddr_t));
     memset(&sock->remote.addr, 0, sizeof(ipaddr_t));
     sock->local.port = 0;
     sock->remote.port = 0;
     sock->rx_buf = mbuf_alloc();
     sock->tx_buf = mbuf_alloc();
+    list_init(&sock->ooo_segs);
+    sock->ooo_len = 0;
+    sock->cwnd = 0;
+    sock->ssthresh = 0;
+    sock->num_dup_acks = 0;
+    sock->in_recovery = false;
+    sock->recover = 0;
+    sock->srtt = 0;
+    sock->rttvar = 0;
+    sock->rto = TCP_RTO_INITIAL;
+    sock->rtt_measured = false;
+    sock->rtt_timing = false;
     sock->retransmit_at = 0;
-    sock->num_retransmits = 0;
     sock->backlog = 0;
     sock->listen_sock = NULL;
     list_init(&sock->backlog_socks);
-    list_nullify(&sock->next);
+    list_nullify(&sock->hash_next);
     list_nullify(&sock->backlog_next);
     return sock;
 }
 
 void tcp_close(tcp_sock_t sock) {
+    LIST_FOR_EACH (seg, &sock->ooo_segs, struct tcp_segment, next) {
+        mbuf_delete(seg->data);
+        free(seg);
+    }
+
     mbuf_delete(sock->rx_buf);
     mbuf_delete(sock->tx_buf);
     list_remove(&sock->next);
+    list_remove(&sock->hash_next);
     sock->in_use = false;
+    list_push_back(&free_socks, &sock->next);
 }
 
 void tcp_bind(tcp_sock_t sock, ipaddr_t *addr, port_t port) {
@@ -145,9 +200,12 @@ void tcp_connect(tcp_sock_t sock, ipaddr_t *dst_addr, port_t dst_port) {
         sock->remote.port = dst_port;
 
         sock->state = TCP_STATE_SYN_SENT;
+        // Offer the window scaling. It's disabled if the remote doesn't
+        // support it.
+        sock->local_wscale = TCP_WSCALE;
         tcp_set_pendings(sock, TCP_PEND_SYN);
 
-        list_push_back(&active_socks, &sock->next);
+        tcp_activate(sock);
         return;
     }
 
@@ -158,7 +216,7 @@ void tcp_connect(tcp_sock_t sock, ipaddr_t *dst_addr, port_t dst_port) {
 void tcp_listen(tcp_sock_t sock, int backlog) {
     sock->state = TCP_STATE_LISTEN;
     sock->backlog = backlog;
-    list_push_back(&active_socks, &sock->next);
+    tcp_activate(sock);
 }
 
 tcp_sock_t tcp_accept(tcp_sock_t sock) {
@@ -180,71 +238,71 @@ tcp_sock_t tcp_accept(tcp_sock_t sock) {
 
 void tcp_write(tcp_sock_t sock, const void *data, size_t len) {
     mbuf_append_bytes(sock->tx_buf, data, len);
-    sock->retransmit_at = 0;
 }
 
 size_t tcp_read(tcp_sock_t sock, void *buf, size_t buf_len) {
     size_t read_len = mbuf_read(&sock->rx_buf, buf, buf_len);
     sock->local_winsize += read_len;
-    return read_len;
-}
-
-void tcp_transmit(tcp_sock_t sock) {
-    if (sock->retransmit_at && sys_uptime() < sock->retransmit_at) {
-        return;
-    }
-
-    uint32_t flags = tcp_clear_pendings(sock);
-    mbuf_t payload = NULL;
-    uint8_t ctrl_flags = 0;
-    switch (sock->state) {
-        case TCP_STATE_ESTABLISHED:
-        case TCP_STATE_CLOSE_WAIT:
-            payload = mbuf_peek(sock->tx_buf, sock->remote_winsize);
-            if (mbuf_len(payload) > 0) {
-                ctrl_flags |= TCP_ACK | TCP_PSH;
-            }
 
-            if (sock->last_seqno == sock->next_seqno) {
-                sock->num_retransmits++;
-            }
-            break;
-        case TCP_STATE_SYN_RECVED:
-            ctrl_flags |= TCP_SYN | TCP_ACK;
-            break;
-        default:
-            break;
+    // Send a window update if the window has been opened by a segment or
+    // more: the remote may be waiting for it (RFC 1122 4.2.3.3).
+    uint32_t edge = sock->last_ack + sock->local_winsize;
+    if (edge - sock->adv_wnd_edge >= TCP_MSS) {
+        tcp_set_pendings(sock, TCP_PEND_ACK);
     }
 
-    if (flags & TCP_PEND_SYN) {
-        ctrl_flags |= TCP_SYN;
-    }
+    return read_len;
+}
 
-    if (flags & TCP_PEND_ACK) {
-        ctrl_flags |= TCP_ACK;
+/// Appends the options for a SYN segment. Returns the length of options.
+static size_t tcp_syn_options(struct tcp_socket *sock, uint8_t *options) {
+    size_t len = 0;
+    options[len++] = TCP_OPT_MSS;
+    options[len++] = 4;
+    options[len++] = TCP_MSS >> 8;
+    options[len++] = TCP_MSS & 0xff;
+
+    if (sock->local_wscale) {
+        options[len++] = TCP_OPT_NOP;
+        options[len++] = TCP_OPT_WSCALE;
+        options[len++] = 3;
+        options[len++] = sock->local_wscale;
     }
 
-    if (flags & TCP_PEND_FIN) {
-        ctrl_flags |= TCP_FIN;
-    }
+    return len;
+}
 
-    if (!mbuf_len(payload) && !ctrl_flags) {
-        // Nothing to send.
-        mbuf_delete(payload);
-        return;
-    }
+/// Sends a segment. `payload` is freed in this function.
+static void tcp_send_segment(struct tcp_socket *sock, uint32_t seqno,
+                             uint8_t ctrl_flags, mbuf_t payload) {
+    struct {
+        struct tcp_header header;
+        uint8_t options[TCP_OPTIONS_LEN_MAX];
+    } __packed seg;
+
+    // The window field in a SYN segment is never scaled (RFC 7323).
+    uint32_t winsize = (ctrl_flags & TCP_SYN)
+                           ? sock->local_winsize
+                           : sock->local_winsize >> sock->local_wscale;
+    size_t options_len =
+        (ctrl_flags & TCP_SYN) ? tcp_syn_options(sock, seg.options) : 0;
+    size_t header_len = sizeof(seg.header) + options_len;
+    DEBUG_ASSERT(options_len % 4 == 0);
 
     // Construct a TCP packet.
-    struct tcp_header header;
-    header.src_port = hton16(sock->local.port);
-    header.dst_port = hton16(sock->remote.port);
-    header.seqno = hton32(sock->next_seqno);
-    header.ackno = (ctrl_flags & TCP_ACK) ? hton32(sock->last_ack) : 0;
-    header.off_and_ns = 5 << 4;
-    header.flags = ctrl_flags;
-    header.win_size = hton16(sock->local_winsize);
-    header.checksum = 0;
-    header.urgent = 0;
+    struct tcp_header *header = &seg.header;
+    header->src_port = hton16(sock->local.port);
+    header->dst_port = hton16(sock->remote.port);
+    header->seqno = hton32(seqno);
+    header->ackno = (ctrl_flags & TCP_ACK) ? hton32(sock->last_ack) : 0;
+    header->off_and_ns = (header_len / 4) << 4;
+    header->flags = ctrl_flags;
+    header->win_size = hton16(MIN(winsize, 0xffff));
+    if (ctrl_flags & TCP_ACK) {
+        sock->adv_wnd_edge = sock->last_ack + sock->local_winsize;
+    }
+    header->checksum = 0;
+    header->urgent = 0;
 
     // Look for the device to determine the source IP address to compute the
     // pseudo header checksum.
@@ -260,12 +318,12 @@ void tcp_transmit(tcp_sock_t sock) {
     checksum_t checksum;
     checksum_init(&checksum);
     checksum_update_mbuf(&checksum, payload);
-    checksum_update(&checksum, &header, sizeof(header));
+    checksum_update(&checksum, &seg, header_len);
 
     // Compute pseudo header checksum.
     switch (sock->remote.addr.type) {
         case IP_TYPE_V4: {
-            size_t total_len = sizeof(header) + mbuf_len(payload);
+            size_t total_len = header_len + mbuf_len(payload);
             checksum_update_uint32(&checksum, hton32(sock->remote.addr.v4));
             checksum_update_uint32(&checksum, hton32(device->ipaddr.v4));
             checksum_update_uint16(&checksum, hton16(total_len));
@@ -274,8 +332,8 @@ void tcp_transmit(tcp_sock_t sock) {
         }  // case IP_TYPE_V4
     }
 
-    header.checksum = checksum_finish(&checksum);
-    mbuf_t pkt = mbuf_new(&header, sizeof(header));
+    header->checksum = checksum_finish(&checksum);
+    mbuf_t pkt = mbuf_new(&seg, header_len);
     if (payload) {
         mbuf_append(pkt, payload);
     }
@@ -286,23 +344,511 @@ void tcp_transmit(tcp_sock_t sock) {
             ipv4_transmit(sock->remote.addr.v4, IPV4_PROTO_TCP, pkt);
             break;
     }
+}
+
+/// Sends `len` bytes in the TX buffer from `seqno` (between `next_seqno` and
+/// `send_seqno` if it's a retransmission).
+static void tcp_send_data(struct tcp_socket *sock, uint32_t seqno,
+                          size_t len) {
+    mbuf_t payload = mbuf_slice(sock->tx_buf, seqno - sock->next_seqno, len);
+    tcp_send_segment(sock, seqno, TCP_ACK | TCP_PSH, payload);
+
+    // Take a RTT sample by the segment unless it's a retransmission (Karn's
+    // algorithm).
+    if (!sock->rtt_timing && seq_geq(seqno, sock->high_seqno)) {
+        sock->rtt_timing = true;
+        sock->rtt_seqno = seqno;
+        sock->rtt_started_at = sys_uptime();
+    }
+
+    if (seq_gt(seqno + len, sock->high_seqno)) {
+        sock->high_seqno = seqno + len;
+    }
+
+    if (!sock->retransmit_at) {
+        sock->retransmit_at = sys_uptime() + sock->rto;
+    }
+}
+
+/// Resends the first unacknowledged segment.
+static void tcp_retransmit(struct tcp_socket *sock) {
+    size_t len = MIN(sock->send_seqno - sock->next_seqno, sock->mss);
+    if (!len) {
+        return;
+    }
+
+    sock->rtt_timing = false;
+    sock->retransmit_at = 0;
+    tcp_send_data(sock, sock->next_seqno, len);
+}
+
+/// Sends new data as long as the congestion window and the remote's receive
+/// window allow. Returns true if it has sent a segment. `timed_out` is true
+/// if the retransmission timer (or the persist timer) has just expired.
+static bool tcp_send_new_data(struct tcp_socket *sock, bool timed_out) {
+    size_t buffered_len = mbuf_len(sock->tx_buf);
+    uint32_t cwnd = sock->cwnd;
+    if (!sock->in_recovery && sock->num_dup_acks < TCP_DUP_ACK_THRESH) {
+        // Limited transmit (RFC 3042): send a new segment for each of the
+        // first duplicate ACKs so that the remote can send enough duplicate
+        // ACKs for the fast retransmit even if the window is small.
+        cwnd += sock->num_dup_acks * sock->mss;
+    }
+
+    uint32_t winsize = MIN(cwnd, sock->remote_winsize);
+    if (sock->send_seqno == sock->next_seqno && buffered_len > 0) {
+        if (!winsize && !timed_out) {
+            // The remote's window is closed. Wait for a window update. In
+            // case it's lost, send a window probe when the timer expires.
+            if (!sock->retransmit_at) {
+                sock->retransmit_at = sys_uptime() + sock->rto;
+            }
+
+            return false;
+        }
+
+        // Nothing is in flight: the timer is not running or it's the persist
+        // timer. Send a 1-byte window probe if the window is still closed.
+        sock->retransmit_at = 0;
+        winsize = MAX(winsize, 1);
+    }
+
+    bool sent = false;
+    while (true) {
+        uint32_t in_flight = sock->send_seqno - sock->next_seqno;
+        if (in_flight >= buffered_len || in_flight >= winsize) {
+            break;
+        }
+
+        size_t unsent_len = buffered_len - in_flight;
+        size_t len = MIN(MIN(unsent_len, winsize - in_flight), sock->mss);
+        if (len < sock->mss && len < unsent_len && in_flight > 0) {
+            // Avoid the silly window syndrome: wait for ACKs to open the
+            // window instead of sending a small segment.
+            break;
+        }
+
+        tcp_send_data(sock, sock->send_seqno, len);
+        sock->send_seqno += len;
+        sent = true;
+    }
 
-    // Update the retransmission timer.
-    sock->retransmit_at =
-        sys_uptime()
-        + MIN(TCP_RXT_MAX_TIMEOUT,
-              TCP_RXT_INITIAL_TIMEOUT << MIN(sock->num_retransmits, 8));
-    sock->last_seqno = sock->next_seqno;
+    return sent;
 }
 
+/// Handles an expiration of the retransmission timer.
+static void tcp_timeout(struct tcp_socket *sock) {
+    sock->retransmit_at = 0;
+    sock->rto = MIN(sock->rto * 2, TCP_RTO_MAX);
+    sock->rtt_timing = false;
+
+    switch (sock->state) {
+        case TCP_STATE_SYN_SENT:
+            tcp_set_pendings(sock, TCP_PEND_SYN);
+            break;
+        case TCP_STATE_SYN_RECVED:
+            tcp_set_pendings(sock, TCP_PEND_ACK);
+            break;
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            if (sock->remote_winsize > 0) {
+                // Not a window probe: the segment has been lost. Restart
+                // from the slow start (RFC 5681).
+                uint32_t in_flight = sock->send_seqno - sock->next_seqno;
+                sock->ssthresh = MAX(in_flight / 2, 2 * sock->mss);
+                sock->cwnd = sock->mss;
+            }
+
+            // Resend unacknowledged data from the first byte.
+            sock->recover = sock->high_seqno;
+            sock->in_recovery = false;
+            sock->num_dup_acks = 0;
+            sock->send_seqno = sock->next_seqno;
+            break;
+        default:
+            break;
+    }
+}
+
+void tcp_transmit(tcp_sock_t sock) {
+    bool timed_out =
+        sock->retransmit_at && sys_uptime() >= sock->retransmit_at;
+    if (timed_out) {
+        tcp_timeout(sock);
+    }
+
+    uint32_t flags = tcp_clear_pendings(sock);
+    uint8_t ctrl_flags = 0;
+    switch (sock->state) {
+        case TCP_STATE_SYN_SENT:
+            if (flags & TCP_PEND_SYN) {
+                tcp_send_segment(sock, sock->next_seqno, TCP_SYN, NULL);
+                sock->retransmit_at = sys_uptime() + sock->rto;
+            }
+            return;
+        case TCP_STATE_SYN_RECVED:
+            if (flags & TCP_PEND_ACK) {
+                tcp_send_segment(sock, sock->next_seqno, TCP_SYN | TCP_ACK,
+                                 NULL);
+                sock->retransmit_at = sys_uptime() + sock->rto;
+            }
+            return;
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            if (tcp_send_new_data(sock, timed_out)) {
+                // The ACK has been piggybacked.
+                flags &= ~TCP_PEND_ACK;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (flags & TCP_PEND_ACK) {
+        ctrl_flags |= TCP_ACK;
+    }
+
+    if (flags & TCP_PEND_FIN) {
+        ctrl_flags |= TCP_FIN;
+    }
+
+    if (!ctrl_flags) {
+        // Nothing to send.
+        return;
+    }
+
+    tcp_send_segment(sock, sock->send_seqno, ctrl_flags, NULL);
+}
+
+struct tcp_options {
+    /// The maximum segment size (zero if not present).
+    uint16_t mss;
+    /// The window scale shift count (-1 if not present).
+    int wscale;
+};
+
+static void tcp_parse_options(const uint8_t *options, size_t len,
+                              struct tcp_options *opts) {
+    opts->mss = 0;
+    opts->wscale = -1;
+    size_t i = 0;
+    while (i < len && options[i] != TCP_OPT_END) {
+        if (options[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= len || options[i + 1] < 2 || i + options[i + 1] > len) {
+            // Malformed options.
+            break;
+        }
+
+        switch (options[i]) {
+            case TCP_OPT_MSS:
+                if (options[i + 1] == 4) {
+                    opts->mss = (options[i + 2] << 8) | options[i + 3];
+                }
+                break;
+            case TCP_OPT_WSCALE:
+                if (options[i + 1] == 3) {
+                    opts->wscale = MIN(options[i + 2], TCP_WSCALE_MAX);
+                }
+                break;
+        }
+
+        i += options[i + 1];
+    }
+}
+
+/// Applies the options in a SYN segment from the remote.
+static void tcp_apply_syn_options(struct tcp_socket *sock,
+                                  struct tcp_options *opts) {
+    sock->mss = MIN(opts->mss ? opts->mss : TCP_MSS_DEFAULT, TCP_MSS);
+    if (opts->wscale >= 0) {
+        sock->local_wscale = TCP_WSCALE;
+        sock->remote_wscale = opts->wscale;
+    } else {
+        // The remote doesn't support window scaling.
+        sock->local_wscale = 0;
+        sock->remote_wscale = 0;
+    }
+}
+
+/// Initializes the send state on a transition into ESTABLISHED.
+static void tcp_established(struct tcp_socket *sock, uint32_t ack,
+                            uint32_t winsize) {
+    sock->state = TCP_STATE_ESTABLISHED;
+    sock->next_seqno = ack;
+    sock->send_seqno = ack;
+    sock->high_seqno = ack;
+    sock->recover = ack - 1;
+    sock->remote_winsize = winsize;
+    sock->retransmit_at = 0;
+    // The initial window (RFC 5681).
+    sock->cwnd = MIN(4 * sock->mss, MAX(2 * sock->mss, 4380));
+    sock->ssthresh = UINT32_MAX;
+}
+
+/// Updates the retransmission timeout by a RTT sample (RFC 6298).
+static void tcp_update_rto(struct tcp_socket *sock, msec_t rtt) {
+    if (!sock->rtt_measured) {
+        sock->srtt = rtt;
+        sock->rttvar = rtt / 2;
+        sock->rtt_measured = true;
+    } else {
+        msec_t delta = (sock->srtt > rtt) ? sock->srtt - rtt : rtt - sock->srtt;
+        sock->rttvar = (3 * sock->rttvar + delta) / 4;
+        sock->srtt = (7 * sock->srtt + rtt) / 8;
+    }
+
+    sock->rto = sock->srtt + 4 * sock->rttvar;
+    sock->rto = MIN(MAX(sock->rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/// Handles a duplicate ACK (RFC 5681 and RFC 6582).
+static void tcp_dup_ack(struct tcp_socket *sock) {
+    sock->num_dup_acks++;
+    if (sock->in_recovery) {
+        // A segment has left the network: inflate the window.
+        sock->cwnd += sock->mss;
+        return;
+    }
+
+    // Don't enter the fast recovery again for losses in the window which we
+    // have already recovered from.
+    if (sock->num_dup_acks != TCP_DUP_ACK_THRESH
+        || !seq_gt(sock->next_seqno, sock->recover)) {
+        return;
+    }
+
+    // The segment is lost. Fast retransmit it.
+    uint32_t in_flight = sock->send_seqno - sock->next_seqno;
+    sock->ssthresh = MAX(in_flight / 2, 2 * sock->mss);
+    sock->recover = sock->high_seqno;
+    sock->in_recovery = true;
+    tcp_retransmit(sock);
+    sock->cwnd = sock->ssthresh + TCP_DUP_ACK_THRESH * sock->mss;
+}
+
+/// Processes the acknowledgement number in a segment. `maybe_dup` is true if
+/// the segment has no data, SYN, nor FIN.
+static void tcp_process_ack(struct tcp_socket *sock, uint32_t ack,
+                            uint32_t winsize, bool maybe_dup) {
+    if (seq_gt(ack, sock->high_seqno)) {
+        // Acknowledges data that we've never sent.
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        return;
+    }
+
+    if (seq_lt(ack, sock->next_seqno)) {
+        // An old ACK.
+        return;
+    }
+
+    if (ack == sock->next_seqno) {
+        if (maybe_dup && winsize == sock->remote_winsize
+            && sock->send_seqno != sock->next_seqno) {
+            tcp_dup_ack(sock);
+        }
+
+        if (!sock->remote_winsize && winsize > 0) {
+            // The window has been opened. The window probe in flight (if
+            // any) has been dropped by the remote: resend it with new data.
+            sock->send_seqno = sock->next_seqno;
+        }
+
+        sock->remote_winsize = winsize;
+        return;
+    }
+
+    uint32_t acked_len = ack - sock->next_seqno;
+    mbuf_discard(&sock->tx_buf, acked_len);
+    sock->next_seqno = ack;
+    if (seq_lt(sock->send_seqno, ack)) {
+        // The remote has received data beyond the point where we're resending
+        // from.
+        sock->send_seqno = ack;
+    }
+
+    sock->remote_winsize = winsize;
+    sock->num_dup_acks = 0;
+
+    if (sock->rtt_timing && seq_gt(ack, sock->rtt_seqno)) {
+        tcp_update_rto(sock, sys_uptime() - sock->rtt_started_at);
+        sock->rtt_timing = false;
+    }
+
+    if (sock->in_recovery) {
+        if (seq_geq(ack, sock->recover)) {
+            // Recovered from all losses in the window. Deflate the window.
+            sock->cwnd = sock->ssthresh;
+            sock->in_recovery = false;
+        } else {
+            // A partial ACK: the next segment is lost too.
+            tcp_retransmit(sock);
+            sock->cwnd -= MIN(acked_len, sock->cwnd);
+            sock->cwnd += sock->mss;
+        }
+    } else if (sock->cwnd < sock->remote_winsize) {
+        // Grow the window unless it's already larger than the remote's
+        // receive window: slow start or congestion avoidance (a segment per
+        // RTT).
+        sock->cwnd += (sock->cwnd < sock->ssthresh)
+                          ? MIN(acked_len, sock->mss)
+                          : MAX(sock->mss * sock->mss / sock->cwnd, 1);
+    }
+
+    // Restart the retransmission timer.
+    sock->retransmit_at = (sock->next_seqno == sock->send_seqno)
+                              ? 0
+                              : sys_uptime() + sock->rto;
+}
+
+/// Moves out-of-order segments which have become contiguous into the
+/// receive buffer.
+static void tcp_reassemble(struct tcp_socket *sock) {
+    LIST_FOR_EACH (seg, &sock->ooo_segs, struct tcp_segment, next) {
+        if (seq_gt(seg->seqno, sock->last_ack)) {
+            break;
+        }
+
+        list_remove(&seg->next);
+        sock->ooo_len -= seg->len;
+
+        uint32_t dup_len = sock->last_ack - seg->seqno;
+        if (dup_len < seg->len) {
+            size_t len = seg->len - dup_len;
+            DEBUG_ASSERT(len <= sock->local_winsize);
+            mbuf_discard(&seg->data, dup_len);
+            mbuf_append(sock->rx_buf, seg->data);
+            sock->last_ack += len;
+            sock->local_winsize -= len;
+        } else {
+            mbuf_delete(seg->data);
+        }
+
+        free(seg);
+    }
+}
+
+/// Queues a segment which arrived ahead of `last_ack`. It takes the
+/// ownership of `payload` if it returns true.
+static bool tcp_enqueue_ooo(struct tcp_socket *sock, uint32_t seq,
+                            mbuf_t payload, size_t len) {
+    // Accept only segments in the window. The total size is also limited
+    // since (malicious) segments could overlap each other.
+    if (seq + len - sock->last_ack > sock->local_winsize
+        || sock->ooo_len + len > sock->local_winsize) {
+        return false;
+    }
+
+    struct tcp_segment *next_seg = NULL;
+    LIST_FOR_EACH (seg, &sock->ooo_segs, struct tcp_segment, next) {
+        if (seg->seqno == seq && seg->len >= len) {
+            // Duplicated.
+            return false;
+        }
+
+        if (seq_gt(seg->seqno, seq)) {
+            next_seg = seg;
+            break;
+        }
+    }
+
+    struct tcp_segment *new_seg = malloc(sizeof(*new_seg));
+    new_seg->seqno = seq;
+    new_seg->len = len;
+    new_seg->data = payload;
+    if (next_seg) {
+        list_insert(next_seg->next.prev, &next_seg->next, &new_seg->next);
+    } else {
+        list_push_back(&sock->ooo_segs, &new_seg->next);
+    }
+
+    sock->ooo_len += len;
+    return true;
+}
+
+/// Processes the data in a segment. It sets `*payload` to NULL if it takes
+/// the ownership.
+static void tcp_process_data(struct tcp_socket *sock, uint32_t seq,
+                             uint8_t flags, mbuf_t *payload) {
+    size_t payload_len = mbuf_len(*payload);
+    if (!payload_len && !(flags & TCP_FIN)) {
+        // No data. Note that we must not reply to an ACK by an ACK.
+        return;
+    }
+
+    if (seq_lt(seq, sock->last_ack)) {
+        // Retransmitted by the remote: we've received (a part of) the data.
+        // Perhaps our ACK has been lost.
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        uint32_t dup_len = sock->last_ack - seq;
+        if (dup_len >= payload_len) {
+            return;
+        }
+
+        mbuf_discard(payload, dup_len);
+        payload_len -= dup_len;
+        seq = sock->last_ack;
+    }
+
+    if (seq != sock->last_ack) {
+        // Some segments before this one are lost or reordered. Send a
+        // duplicate ACK immediately (not coalesced with pending ones) to let
+        // the remote fast retransmit them.
+        tcp_send_segment(sock, sock->send_seqno, TCP_ACK, NULL);
+        if (payload_len > 0
+            && tcp_enqueue_ooo(sock, seq, *payload, payload_len)) {
+            *payload = NULL;
+        } else {
+            stats.tcp_discarded++;
+        }
+        return;
+    }
+
+    // Received data. Copy into the receive buffer.
+    TRACE("tcp: received %d bytes (seq=%x)", payload_len, seq);
+    if (payload_len > 0) {
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+
+        if (sock->local_winsize < payload_len) {
+            // The receive buffer is full.
+            stats.tcp_dropped++;
+            return;
+        }
+
+        mbuf_append(sock->rx_buf, *payload);
+        *payload = NULL;
+        sock->last_ack += payload_len;
+        sock->local_winsize -= payload_len;
+        tcp_reassemble(sock);
+
+        struct event e;
+        e.type = TCP_RECEIVED;
+        e.tcp_received.sock = sock;
+        sys_process_event(&e);
+    }
+
+    if (flags & TCP_FIN) {
+        // Passive close. Acknowlege to FIN.
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        sock->state = TCP_STATE_CLOSE_WAIT;
+        sock->last_ack++;
+    }
+}
+
+/// Processes a received segment. It sets `*payload` to NULL if it takes the
+/// ownership.
 static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
                         port_t src_port, struct tcp_header *header,
-                        mbuf_t payload) {
+                        struct tcp_options *opts, mbuf_t *payload) {
     uint32_t seq = ntoh32(header->seqno);
     uint32_t ack = ntoh32(header->ackno);
     uint8_t flags = header->flags;
+    size_t payload_len = mbuf_len(*payload);
     TRACE("tcp: port=%d, seq=%08x, ack=%08x, len=%d [ %s%s%s]",
-          sock->local.port, seq, ack, mbuf_len(payload),
+          sock->local.port, seq, ack, payload_len,
           (flags & TCP_SYN) ? "SYN " : "", (flags & TCP_FIN) ? "FIN " : "",
           (flags & TCP_ACK) ? "ACK " : "");
 
@@ -321,49 +867,47 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
         // Create a new socket for the client and reply SYN + ACK.
         TRACE("tcp: new client (port=%d)", sock->local.port);
         struct tcp_socket *new_sock = tcp_new();
+        if (!new_sock) {
+            stats.tcp_dropped++;
+            return;
+        }
+
         new_sock->state = TCP_STATE_SYN_RECVED;
         new_sock->last_ack = seq + 1;
         new_sock->listen_sock = sock;
+        tcp_apply_syn_options(new_sock, opts);
         memcpy(&new_sock->local, &sock->local, sizeof(new_sock->local));
         memcpy(&new_sock->remote.addr, src_addr, sizeof(new_sock->remote.addr));
         new_sock->remote.port = src_port;
         list_push_back(&sock->backlog_socks, &new_sock->backlog_next);
-        list_push_back(&active_socks, &new_sock->next);
+        tcp_activate(new_sock);
         tcp_set_pendings(new_sock, TCP_PEND_ACK);
         return;
     }
 
-    if (sock->state != TCP_STATE_SYN_SENT && seq != sock->last_ack) {
-        // Unexpected sequence number.
-        stats.tcp_discarded++;
-        return;
-    }
-
-    sock->remote_winsize = ntoh32(header->win_size);
-    if (sock->state == TCP_STATE_ESTABLISHED) {
-        uint32_t acked_len = ack - sock->next_seqno;
-        if (acked_len > 0) {
-            mbuf_discard(&sock->tx_buf, acked_len);
-            sock->next_seqno += acked_len;
-        }
+    // The window field in a SYN segment is not scaled.
+    uint32_t winsize = ntoh16(header->win_size);
+    if ((flags & TCP_SYN) == 0) {
+        winsize <<= sock->remote_wscale;
     }
 
     switch (sock->state) {
         case TCP_STATE_SYN_SENT: {
-            if ((flags & (TCP_SYN | TCP_ACK)) == 0) {
+            if ((flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK)) {
                 // Invalid (unexpected) packet, ignoring...
                 stats.tcp_discarded++;
                 break;
             }
 
-            sock->next_seqno = ack;
+            tcp_apply_syn_options(sock, opts);
             sock->last_ack = seq + 1;
-            sock->state = TCP_STATE_ESTABLISHED;
-            sock->retransmit_at = 0;
+            tcp_established(sock, ack, winsize);
+            // Acknowledge to the SYN + ACK.
+            tcp_set_pendings(sock, TCP_PEND_ACK);
             break;
         }
         case TCP_STATE_SYN_RECVED: {
-            if ((flags & TCP_ACK) == 0) {
+            if ((flags & TCP_ACK) == 0 || seq != sock->last_ack) {
                 // Invalid (unexpected) packet, ignoring...
                 stats.tcp_discarded++;
                 break;
@@ -371,10 +915,7 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
 
             // Received an ACK to the our SYN + ACK. The connection is now
             // ESTABLISHED.
-            sock->next_seqno = ack;
-            sock->last_ack = seq;
-            sock->state = TCP_STATE_ESTABLISHED;
-            sock->retransmit_at = 0;
+            tcp_established(sock, ack, winsize);
 
             struct event e;
             e.type = TCP_NEW_CLIENT;
@@ -383,38 +924,22 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
             break;
         }
         case TCP_STATE_ESTABLISHED:
-            if (flags & TCP_FIN) {
-                // Passive close. Acknowlege to FIN.
-                tcp_set_pendings(sock, TCP_PEND_ACK);
-                sock->state = TCP_STATE_CLOSE_WAIT;
-                sock->retransmit_at = 0;
-                sock->last_ack++;
+        case TCP_STATE_CLOSE_WAIT:
+            if (flags & TCP_ACK) {
+                bool maybe_dup =
+                    !payload_len && !(flags & (TCP_SYN | TCP_FIN));
+                tcp_process_ack(sock, ack, winsize, maybe_dup);
             }
 
-            // Received data. Copy into the receive buffer.
-            TRACE("tcp: received %d bytes (seq=%x)", mbuf_len(payload), seq);
-            size_t payload_len = mbuf_len(payload);
-            if (payload_len > 0) {
+            if (sock->state == TCP_STATE_ESTABLISHED) {
+                tcp_process_data(sock, seq, flags, payload);
+            } else if (flags & TCP_FIN) {
+                // The remote has retransmitted FIN: our ACK has been lost.
                 tcp_set_pendings(sock, TCP_PEND_ACK);
-
-                if (sock->local_winsize < payload_len) {
-                    // The receive buffer is full.
-                    stats.tcp_dropped++;
-                    break;
-                }
-
-                mbuf_append(sock->rx_buf, payload);
-                sock->last_ack += mbuf_len(payload);
-                sock->local_winsize -= payload_len;
-
-                struct event e;
-                e.type = TCP_RECEIVED;
-                e.tcp_received.sock = sock;
-                sys_process_event(&e);
             }
             break;
         case TCP_STATE_LAST_ACK:
-            if ((flags & TCP_ACK) == 0) {
+            if ((flags & TCP_ACK) == 0 || seq != sock->last_ack) {
                 // Invalid (unexpected) packet, ignoring...
                 stats.tcp_discarded++;
                 break;
@@ -439,14 +964,22 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
 void tcp_receive(ipaddr_t *dst, ipaddr_t *src, mbuf_t pkt) {
     struct tcp_header header;
     if (mbuf_read(&pkt, &header, sizeof(header)) != sizeof(header)) {
+        mbuf_delete(pkt);
         return;
     }
 
+    uint8_t options[TCP_OPTIONS_LEN_MAX];
     size_t offset = (header.off_and_ns >> 4) * 4;
-    if (offset > sizeof(header)) {
-        mbuf_discard(&pkt, offset - sizeof(header));
+    size_t options_len =
+        (offset > sizeof(header)) ? offset - sizeof(header) : 0;
+    if (mbuf_read(&pkt, options, options_len) != options_len) {
+        mbuf_delete(pkt);
+        return;
     }
 
+    struct tcp_options opts;
+    tcp_parse_options(options, options_len, &opts);
+
     uint16_t dst_port = ntoh16(header.dst_port);
     uint16_t src_port = ntoh16(header.src_port);
 
@@ -458,11 +991,11 @@ void tcp_receive(ipaddr_t *dst, ipaddr_t *src, mbuf_t pkt) {
     memcpy(&src_ep.addr, src, sizeof(ipaddr_t));
 
     struct tcp_socket *sock = tcp_lookup(&dst_ep, &src_ep);
-    if (!sock) {
-        return;
+    if (sock) {
+        tcp_process(sock, src, src_port, &header, &opts, &pkt);
     }
 
-    tcp_process(sock, src, src_port, &header, pkt);
+    mbuf_delete(pkt);
 }
 
 void tcp_flush(void) {
@@ -477,7 +1010,17 @@ void tcp_flush(void) {
 
 void tcp_init(void) {
     list_init(&active_socks);
+    list_init(&free_socks);
+    for (int i = 0; i < TCP_CONN_BUCKETS; i++) {
+        list_init(&conn_socks[i]);
+    }
+
+    for (int i = 0; i < TCP_LISTEN_BUCKETS; i++) {
+        list_init(&listen_socks[i]);
+    }
+
     for (int i = 0; i < TCP_SOCKETS_MAX; i++) {
         sockets[i].in_use = false;
+        list_push_back(&free_socks, &sockets[i].next);
     }
 }
@@ -27,32 +27,99 @@ enum tcp_pending_flag {
 
 struct client;
 
-#define TCP_SOCKETS_MAX         512
-#define TCP_RXT_INITIAL_TIMEOUT 500
-#define TCP_RXT_MAX_TIMEOUT     5000
-#define TCP_RX_BUF_SIZE         8192
+#define TCP_SOCKETS_MAX         4096
+/// The number of buckets in the hash table of connected sockets.
+#define TCP_CONN_BUCKETS 1024
+/// The number of buckets in the hash table of listening sockets.
+#define TCP_LISTEN_BUCKETS 64
+/// The retransmission timeout before the first RTT sample (RFC 6298).
+#define TCP_RTO_INITIAL 1000
+/// The lower bound of the retransmission timeout. It's smaller than 1 second
+/// recommended in RFC 6298 (as Linux does) but not smaller than the
+/// resolution of sys_uptime().
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 5000
+#define TCP_RX_BUF_SIZE (256 * 1024)
+/// The window scale we offer. The receive buffer size shifted by this must
+/// fit in the 16-bit window field.
+#define TCP_WSCALE 3
+STATIC_ASSERT((TCP_RX_BUF_SIZE >> TCP_WSCALE) <= 0xffff);
+/// The maximum segment size we accept (the Ethernet MTU minus IPv4 and TCP
+/// headers).
+#define TCP_MSS 1460
+/// The maximum segment size assumed if the remote doesn't tell us.
+#define TCP_MSS_DEFAULT 536
+/// The number of duplicate ACKs which triggers a fast retransmit.
+#define TCP_DUP_ACK_THRESH 3
+
+/// A received segment which is not contiguous to the received data.
+struct tcp_segment {
+    list_elem_t next;
+    uint32_t seqno;
+    size_t len;
+    mbuf_t data;
+};
+
 struct tcp_socket {
     bool in_use;
     enum tcp_state state;
     uint32_t pendings;
     /// The first byte of unacknwoledged by the remote.
     uint32_t next_seqno;
-    /// The seqno which we have sent.
-    uint32_t last_seqno;
+    /// The seqno of the next byte to be sent. Bytes between `next_seqno` and
+    /// this are in flight.
+    uint32_t send_seqno;
+    /// The largest `send_seqno` so far. It differs from `send_seqno` when
+    /// we're resending from `next_seqno` after a retransmission timeout.
+    uint32_t high_seqno;
     /// The last byte received from the remote.
     uint32_t last_ack;
+    /// The free space in the receive buffer.
     uint32_t local_winsize;
+    /// The right edge of the window that we've advertised last.
+    uint32_t adv_wnd_edge;
+    /// The receive window of the remote (already scaled).
     uint32_t remote_winsize;
+    /// The window scale shift counts (zero if not negotiated).
+    uint8_t local_wscale;
+    uint8_t remote_wscale;
+    /// The maximum segment size to send.
+    uint32_t mss;
     endpoint_t local;
     endpoint_t remote;
     mbuf_t rx_buf;
     mbuf_t tx_buf;
+    /// Out-of-order segments sorted by the seqno (`struct tcp_segment`).
+    list_t ooo_segs;
+    /// The total length of `ooo_segs` in bytes.
+    size_t ooo_len;
     size_t backlog;
-    unsigned num_retransmits;
+    /// The congestion window and the slow start threshold (RFC 5681).
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    unsigned num_dup_acks;
+    /// Whether we're in the fast recovery (RFC 6582).
+    bool in_recovery;
+    /// The recovery point: `high_seqno` when the last loss is detected.
+    uint32_t recover;
+    /// The smoothed RTT, its variation and the retransmission timeout in
+    /// milliseconds (RFC 6298).
+    msec_t srtt;
+    msec_t rttvar;
+    msec_t rto;
+    bool rtt_measured;
+    /// Whether a segment is being timed: one at a time as in BSD.
+    bool rtt_timing;
+    uint32_t rtt_seqno;
+    msec_t rtt_started_at;
     msec_t retransmit_at;
     struct tcp_socket *listen_sock;
     list_t backlog_socks;
+    /// The element in the active sockets list, or in the free sockets list
+    /// if it's not in use.
     list_elem_t next;
+    /// The element in the hash table of connected or listening sockets.
+    list_elem_t hash_next;
     list_elem_t backlog_next;
     struct client *client;
 };
@@ -67,6 +134,18 @@ enum tcp_header_flag {
     TCP_ACK = 1 << 4,
 };
 
+enum tcp_option_kind {
+    TCP_OPT_END = 0,
+    TCP_OPT_NOP = 1,
+    TCP_OPT_MSS = 2,
+    TCP_OPT_WSCALE = 3,
+};
+
+/// The maximum length of TCP options.
+#define TCP_OPTIONS_LEN_MAX 40
+/// The maximum window scale shift count (RFC 7323).
+#define TCP_WSCALE_MAX 14
+
 struct tcp_header {
     uint16_t src_port;
     uint16_t dst_port;
@@ -15,30 +15,23 @@
 #include <string.h>
 
 // for sparse
+error_t malloc_alloc_pages(size_t num_pages, vaddr_t *vaddr);
+error_t malloc_free_pages(vaddr_t vaddr);
 error_t ipc_call_pager(struct message *m);
 
-error_t ipc_call_pager(struct message *m) {
-    m->src = VM_TASK;
-    error_t err;
-    switch (m->type) {
-        case OOL_RECV_MSG:
-            err = handle_ool_recv(m);
-            break;
-        case OOL_VERIFY_MSG:
-            err = handle_ool_verify(m);
-            break;
-        case OOL_SEND_MSG:
-            err = handle_ool_send(m);
-            break;
-        default:
-            UNREACHABLE();
-    }
+/// We can't grow the heap by calling ourselves: use the static heap only.
+error_t malloc_alloc_pages(size_t num_pages, vaddr_t *vaddr) {
+    return ERR_UNAVAILABLE;
+}
 
-    if (err != OK) {
-        PANIC("ipc_call_pager failed (%s)", err2str(err));
-    }
+error_t malloc_free_pages(vaddr_t vaddr) {
+    return ERR_UNAVAILABLE;
+}
 
-    return err;
+/// We can't call ourselves: OoL payloads from/to us are always passed through
+/// the kernel.
+error_t ipc_call_pager(struct message *m) {
+    return ERR_NOT_ACCEPTABLE;
 }
 
 static void spawn_servers(void) {
@@ -80,6 +73,8 @@ void main(void) {
     page_alloc_init();
     task_init();
     page_fault_init();
+    ool_init();
+    shm_init();
     spawn_servers();
 
     timer_set(5000);
@@ -106,49 +101,45 @@ void main(void) {
                     service_warn_deadlocked_tasks();
                 }
                 break;
-            case ASYNC_MSG:
+            case ASYNC_MSG: {
                 async_reply(m.src);
+                struct task *task = task_find(m.src);
+                if (task) {
+                    task_flush_pending_exits(task);
+                }
                 break;
-            case OOL_RECV_MSG: {
+            }
+            case OOL_SEND_MSG: {
                 task_t src = m.src;
-                error_t err = handle_ool_recv(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
+                error_t err = handle_ool_send(&m);
+                if (err != OK) {
+                    ipc_reply_err(src, err);
+                    break;
                 }
+
+                ipc_reply(src, &m);
                 break;
             }
-            case OOL_VERIFY_MSG: {
+            case OOL_RECV_MSG: {
                 task_t src = m.src;
-                error_t err = handle_ool_verify(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
+                error_t err = handle_ool_recv(&m);
+                if (err != OK) {
+                    ipc_reply_err(src, err);
+                    break;
                 }
+
+                ipc_reply(src, &m);
                 break;
             }
-            case OOL_SEND_MSG: {
+            case OOL_DISCARD_MSG: {
                 task_t src = m.src;
-                error_t err = handle_ool_send(&m);
-                switch (err) {
-                    case DONT_REPLY:
-                        break;
-                    case OK:
-                        ipc_reply(src, &m);
-                        break;
-                    default:
-                        ipc_reply_err(src, err);
+                error_t err = handle_ool_discard(&m);
+                if (err != OK) {
+                    ipc_reply_err(src, err);
+                    break;
                 }
+
+                ipc_reply(src, &m);
                 break;
             }
             case BENCHMARK_NOP_MSG:
@@ -197,9 +188,10 @@ void main(void) {
                 ASSERT(task->pager == vm_task->tid);
                 ASSERT(m.page_fault.task == task->tid);
 
+                unsigned flags;
                 paddr_t paddr =
                     handle_page_fault(task, m.page_fault.vaddr, m.page_fault.ip,
-                                      m.page_fault.fault);
+                                      m.page_fault.fault, &flags);
                 if (!paddr) {
                     ipc_reply_err(m.src, ERR_NOT_FOUND);
                     break;
@@ -207,8 +199,7 @@ void main(void) {
 
                 vaddr_t aligned_vaddr =
                     ALIGN_DOWN(m.page_fault.vaddr, PAGE_SIZE);
-                ASSERT_OK(map_page(task, aligned_vaddr, paddr,
-                                   MAP_TYPE_READWRITE, false));
+                ASSERT_OK(map_page(task, aligned_vaddr, paddr, flags, false));
                 r.type = PAGE_FAULT_REPLY_MSG;
 
                 ipc_reply(task->tid, &r);
@@ -250,6 +241,37 @@ void main(void) {
                 ipc_reply(m.src, &r);
                 break;
             }
+            case VM_ALLOC_HEAP_MSG: {
+                struct task *task = task_lookup(m.src);
+                ASSERT(task);
+
+                vaddr_t vaddr =
+                    task_heap_alloc(task, m.vm_alloc_heap.num_pages);
+                if (!vaddr) {
+                    ipc_reply_err(m.src, ERR_NO_MEMORY);
+                    break;
+                }
+
+                r.type = VM_ALLOC_HEAP_REPLY_MSG;
+                r.vm_alloc_heap_reply.vaddr = vaddr;
+                ipc_reply(m.src, &r);
+                break;
+            }
+            case VM_FREE_PAGES_MSG: {
+                struct task *task = task_lookup(m.src);
+                ASSERT(task);
+
+                error_t err =
+                    task_page_free_by_vaddr(task, m.vm_free_pages.vaddr);
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                r.type = VM_FREE_PAGES_REPLY_MSG;
+                ipc_reply(m.src, &r);
+                break;
+            }
             case TASK_ALLOC_MSG: {
                 struct task *task = task_alloc(m.task_alloc.pager);
                 if (!task) {
@@ -320,14 +342,14 @@ void main(void) {
             case SHM_CREATE_MSG: {
                 struct task *task = task_lookup(m.src);
                 ASSERT(task);
-                int slot;
-                err = shm_create(task, m.shm_create.size, &slot);
+                int shm_id;
+                err = shm_create(task, m.shm_create.size, &shm_id);
                 if (err != OK) {
                     ipc_reply_err(m.src, err);
                     break;
                 }
                 m.type = SHM_CREATE_REPLY_MSG;
-                m.shm_create_reply.shm_id = slot;
+                m.shm_create_reply.shm_id = shm_id;
                 ipc_reply(m.src, &m);
                 break;
             }
@@ -335,19 +357,25 @@ void main(void) {
                 struct task *task = task_lookup(m.src);
                 error_t err;
                 vaddr_t vaddr;
-                err =
-                    shm_map(task, m.shm_map.shm_id, m.shm_map.writable, &vaddr);
+                size_t num_pages;
+                err = shm_map(task, m.shm_map.shm_id, m.shm_map.writable,
+                              &vaddr, &num_pages);
                 if (err != OK) {
                     ipc_reply_err(m.src, err);
                     break;
                 }
                 m.type = SHM_MAP_REPLY_MSG;
                 m.shm_map_reply.vaddr = vaddr;
+                m.shm_map_reply.size = num_pages;
                 ipc_reply(m.src, &m);
                 break;
             }
             case SHM_CLOSE_MSG: {
-                shm_close(m.shm_close.shm_id);
+                err = shm_close(caller, m.shm_close.shm_id);
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
                 m.type = SHM_CLOSE_REPLY_MSG;
                 ipc_reply(m.src, &m);
                 break;
@@ -1,165 +1,348 @@
 #include "ool.h"
+#include "page_alloc.h"
 #include "page_fault.h"
 #include "task.h"
+#include <list.h>
 #include <message.h>
-#include <resea/ipc.h>
-#include <resea/task.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
 #include <string.h>
 
-static uint8_t __src_page[PAGE_SIZE] __aligned(PAGE_SIZE);
-static uint8_t __dst_page[PAGE_SIZE] __aligned(PAGE_SIZE);
+/// An OoL payload sent but not yet received. Instead of copying the payload,
+/// it holds references to the sender's physical memory pages shared
+/// copy-on-write: a snapshot of the payload.
+struct ool_payload {
+    /// The node in `src->ool_sent`.
+    list_elem_t next;
+    /// The node in `dst->ool_incoming`.
+    list_elem_t dst_next;
+    task_t src;
+    task_t dst;
+    size_t len;
+    /// The offset of the payload in the first page.
+    offset_t offset;
+    size_t num_pages;
+    paddr_t pages[];
+};
 
-static paddr_t vaddr2paddr(struct task *task, vaddr_t vaddr, bool write) {
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
+/// Temporary mappings to copy data between tasks and the physical memory
+/// pages currently mapped at them.
+static vaddr_t src_window = 0;
+static vaddr_t dst_window = 0;
+static paddr_t src_window_paddr = 0;
+static paddr_t dst_window_paddr = 0;
+
+/// Copies `len` bytes between physical memory pages.
+static error_t copy_page(paddr_t dst, offset_t dst_off, paddr_t src,
+                         offset_t src_off, size_t len) {
+    if (src_window_paddr != src) {
+        OK_OR_RETURN(
+            map_page(vm_task, src_window, src, MAP_TYPE_READONLY, false));
+        src_window_paddr = src;
+    }
+
+    if (dst_window_paddr != dst) {
+        OK_OR_RETURN(
+            map_page(vm_task, dst_window, dst, MAP_TYPE_READWRITE, false));
+        dst_window_paddr = dst;
+    }
+
+    memcpy((void *) (dst_window + dst_off), (void *) (src_window + src_off),
+           len);
+    return OK;
+}
+
+/// Returns the page area at `vaddr` in the task. The page is filled as if a
+/// page fault occurred if it's not yet filled, or if it's copy-on-write and
+/// `write` is true.
+static struct page_area *fill_page(struct task *task, vaddr_t vaddr,
+                                   bool write) {
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (!area || (write && area->cow)) {
+        unsigned fault = EXP_PF_USER | (write ? EXP_PF_WRITE : 0);
+        unsigned flags;
+        if (!handle_page_fault(task, vaddr, 0, fault, &flags)) {
+            return NULL;
         }
+
+        area = page_area_lookup(task, vaddr);
     }
 
-    // The page is not mapped. Try filling it with pager.
-    unsigned fault = EXP_PF_USER;
-    fault |= write ? EXP_PF_WRITE : 0;
-    return handle_page_fault(task, vaddr, 0, fault);
+    if (area && write && area->readonly) {
+        return NULL;
+    }
+
+    return area;
 }
 
-error_t handle_ool_recv(struct message *m) {
-    struct task *task = task_lookup(m->src);
-    ASSERT(task);
+/// Takes a snapshot of the page at `vaddr` in the task. The page is shared
+/// copy-on-write if possible: `*marked_cow` is set to true if the caller needs
+/// to unmap the page so that it's mapped read-only. Otherwise, it's copied
+/// into a new page. Returns 0 on failure.
+static paddr_t snapshot_page(struct task *task, vaddr_t vaddr,
+                             bool *marked_cow) {
+    struct page_area *area = fill_page(task, vaddr, false);
+    if (!area) {
+        return 0;
+    }
 
-    //    TRACE("accept: %s: %p %d (old=%p)",
-    //        task->name, m->ool_recv.addr, m->ool_recv.len, task->ool_buf);
-    if (task->ool_buf) {
-        return ERR_ALREADY_EXISTS;
-    }
-
-    task->ool_buf = m->ool_recv.addr;
-    task->ool_len = m->ool_recv.len;
-
-    struct task *sender =
-        LIST_POP_FRONT(&task->ool_sender_queue, struct task, ool_sender_next);
-    if (sender) {
-        struct message m;
-        memcpy(&m, &sender->ool_sender_m, sizeof(m));
-        //        TRACE("%s -> %s: src = %d / %d", task->name, sender->name,
-        //              sender->ool_sender_m.src, m.src);
-        error_t err = handle_ool_send(&m);
-        switch (err) {
-            case OK:
-                ipc_reply(sender->tid, &m);
-                break;
-            case DONT_REPLY:
-                // Do nothing.
-                break;
-            default:
-                OOPS_OK(err);
-                ipc_reply_err(sender->tid, err);
+    paddr_t paddr = area->paddr + (vaddr - area->vaddr);
+    if (area->pinned) {
+        paddr_t copy = page_alloc(1);
+        if (!copy) {
+            return 0;
         }
+
+        if (copy_page(copy, 0, paddr, 0, PAGE_SIZE) != OK) {
+            page_decref(paddr2pfn(copy), 1);
+            return 0;
+        }
+
+        return copy;
     }
 
-    m->type = OOL_RECV_REPLY_MSG;
-    return OK;
+    // Pages not pinned are filled one by one on page faults.
+    DEBUG_ASSERT(area->num_pages == 1);
+    if (!area->cow && !area->readonly) {
+        area->cow = true;
+        *marked_cow = true;
+    }
+
+    page_incref(paddr2pfn(paddr), 1);
+    return paddr;
 }
 
-error_t handle_ool_verify(struct message *m) {
-    struct task *task = task_lookup(m->src);
-    ASSERT(task);
+/// Replaces the page at `vaddr` in the task with `paddr` shared copy-on-write.
+/// Returns false if the page can't be replaced. The caller MUST unmap the page
+/// since the old one might still be mapped.
+static bool share_page(struct task *task, vaddr_t vaddr, paddr_t paddr) {
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (area) {
+        if (area->pinned || area->readonly) {
+            return false;
+        }
 
-    //    TRACE("verify: %s: id=%p len=%d (src=%d)", task->name,
-    //          m->ool_verify.id, m->ool_verify.len, m->src);
-    if (m->ool_verify.src != task->received_ool_from
-        || m->ool_verify.id != task->received_ool_buf
-        || m->ool_verify.len != task->received_ool_len) {
-        return ERR_INVALID_ARG;
+        DEBUG_ASSERT(area->num_pages == 1);
+        page_incref(paddr2pfn(paddr), 1);
+        page_decref(paddr2pfn(area->paddr), 1);
+        page_area_set_paddr(task, area, paddr);
+    } else {
+        // The page has not yet been accessed. Accept only a page which would
+        // be filled with zeroes on a page fault.
+        if (!is_zeroed_page(task, vaddr)) {
+            return false;
+        }
+
+        page_incref(paddr2pfn(paddr), 1);
+        area = task_page_add(task, vaddr, paddr, 1);
     }
 
-    m->type = OOL_VERIFY_REPLY_MSG;
-    m->ool_verify_reply.received_at = task->received_ool_buf;
+    area->cow = true;
+    return true;
+}
 
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
-    return OK;
+/// Fills the receive buffer at `addr` in the task with the payload. Pages at
+/// the same offset in the payload and the buffer are shared instead of being
+/// copied.
+static error_t fill_buffer(struct task *task, struct ool_payload *payload,
+                           vaddr_t addr) {
+    vaddr_t share_start = 0;
+    vaddr_t share_end = 0;
+    error_t err = OK;
+    size_t pos = 0;
+    while (pos < payload->len) {
+        size_t src_pos = payload->offset + pos;
+        paddr_t src_paddr = payload->pages[src_pos / PAGE_SIZE];
+        offset_t src_off = src_pos % PAGE_SIZE;
+        vaddr_t dst_vaddr = addr + pos;
+        offset_t dst_off = dst_vaddr % PAGE_SIZE;
+        size_t copy_len = MIN(payload->len - pos,
+                              MIN(PAGE_SIZE - src_off, PAGE_SIZE - dst_off));
+
+        if (copy_len == PAGE_SIZE && share_page(task, dst_vaddr, src_paddr)) {
+            share_start = (share_start) ? share_start : dst_vaddr;
+            share_end = dst_vaddr + PAGE_SIZE;
+            pos += copy_len;
+            continue;
+        }
+
+        vaddr_t dst_page = ALIGN_DOWN(dst_vaddr, PAGE_SIZE);
+        struct page_area *area = fill_page(task, dst_page, true);
+        if (!area) {
+            err = ERR_INVALID_ARG;
+            break;
+        }
+
+        paddr_t dst_paddr = area->paddr + (dst_page - area->vaddr);
+        err = copy_page(dst_paddr, dst_off, src_paddr, src_off, copy_len);
+        if (err != OK) {
+            break;
+        }
+
+        pos += copy_len;
+    }
+
+    if (share_start) {
+        // Map the shared pages read-only on the next access.
+        unmap_pages(task, share_start, (share_end - share_start) / PAGE_SIZE);
+    }
+
+    return err;
 }
 
-error_t handle_ool_send(struct message *m) {
-    struct task *src_task = task_lookup(m->src);
-    ASSERT(src_task);
+/// Removes the payload from the sender and the receiver, and frees it.
+static void free_payload(struct ool_payload *payload) {
+    list_remove(&payload->next);
+    list_remove(&payload->dst_next);
+    for (size_t i = 0; i < payload->num_pages; i++) {
+        page_decref(paddr2pfn(payload->pages[i]), 1);
+    }
 
-    struct task *dst_task = task_lookup(m->ool_send.dst);
-    if (!dst_task) {
-        return ERR_NOT_FOUND;
+    free(payload);
+}
+
+/// Looks for the payload sent from `src` to `dst`. `id` is given by a task:
+/// don't dereference it until it's found in the list. The sender has at most
+/// CONFIG_OOL_PAYLOADS_PER_TASK payloads.
+static struct ool_payload *lookup_payload(struct task *src, task_t dst,
+                                          vaddr_t id) {
+    LIST_FOR_EACH (payload, &src->ool_sent, struct ool_payload, next) {
+        if ((vaddr_t) payload == id && payload->dst == dst) {
+            return payload;
+        }
     }
 
-    //    TRACE("do_copy: %s -> %s: %p -> %p, len=%d",
-    //        src_task->name, dst_task->name,
-    //        m->ool_send.addr, dst_task->ool_buf,
-    //        m->ool_send.len);
-    if (!dst_task->ool_buf) {
-        memcpy(&src_task->ool_sender_m, m, sizeof(*m));
-        list_push_back(&dst_task->ool_sender_queue, &src_task->ool_sender_next);
-        return DONT_REPLY;
+    return NULL;
+}
+
+error_t handle_ool_send(struct message *m) {
+    struct task *task = task_lookup(m->src);
+    ASSERT(task);
+
+    // Only tasks whose memory is managed by us can share pages.
+    struct task *dst = task_find(m->ool_send.dst);
+    if (!dst || dst == task || dst == vm_task || task->pager != vm_task->tid
+        || dst->pager != vm_task->tid) {
+        return ERR_NOT_ACCEPTABLE;
     }
 
+    vaddr_t addr = m->ool_send.addr;
     size_t len = m->ool_send.len;
-    vaddr_t src_buf = m->ool_send.addr;
-    vaddr_t dst_buf = dst_task->ool_buf;
-    DEBUG_ASSERT(len <= dst_task->ool_len);
-
-    size_t remaining = len;
-    while (remaining > 0) {
-        offset_t src_off = src_buf % PAGE_SIZE;
-        offset_t dst_off = dst_buf % PAGE_SIZE;
-        size_t copy_len =
-            MIN(remaining, MIN(PAGE_SIZE - src_off, PAGE_SIZE - dst_off));
-
-        void *src_ptr;
-        if (src_task == vm_task) {
-            src_ptr = (void *) src_buf;
-        } else {
-            paddr_t src_paddr =
-                vaddr2paddr(src_task, ALIGN_DOWN(src_buf, PAGE_SIZE), false);
-            if (!src_paddr) {
-                task_kill(src_task);
-                return DONT_REPLY;
-            }
-
-            OK_OR_RETURN(map_page(vm_task, (vaddr_t) __src_page, src_paddr,
-                                  MAP_TYPE_READWRITE, true));
-            src_ptr = &__src_page[src_off];
+    if (!len || addr + len < addr) {
+        return ERR_INVALID_ARG;
+    }
+
+    // Payloads are freed when the receiver receives or the sender discards
+    // them. Don't let a sender pin an unbounded number of pages.
+    if (list_len(&task->ool_sent) >= CONFIG_OOL_PAYLOADS_PER_TASK) {
+        return ERR_TRY_AGAIN;
+    }
+
+    vaddr_t start = ALIGN_DOWN(addr, PAGE_SIZE);
+    size_t num_pages = (ALIGN_UP(addr + len, PAGE_SIZE) - start) / PAGE_SIZE;
+    struct ool_payload *payload =
+        malloc(sizeof(*payload) + num_pages * sizeof(paddr_t));
+    payload->src = task->tid;
+    payload->dst = dst->tid;
+    payload->len = len;
+    payload->offset = addr - start;
+    payload->num_pages = 0;
+
+    // Pages newly shared copy-on-write need to be remapped read-only.
+    vaddr_t cow_start = 0;
+    vaddr_t cow_end = 0;
+    error_t err = OK;
+    for (size_t i = 0; i < num_pages; i++) {
+        vaddr_t vaddr = start + i * PAGE_SIZE;
+        bool marked_cow = false;
+        paddr_t paddr = snapshot_page(task, vaddr, &marked_cow);
+        if (!paddr) {
+            err = ERR_INVALID_ARG;
+            break;
         }
 
-        void *dst_ptr;
-        if (dst_task == vm_task) {
-            dst_ptr = (void *) dst_buf;
-        } else {
-            paddr_t dst_paddr =
-                vaddr2paddr(dst_task, ALIGN_DOWN(dst_buf, PAGE_SIZE), true);
-            if (!dst_paddr) {
-                task_kill(dst_task);
-                return ERR_UNAVAILABLE;
-            }
-
-            // Temporarily map the pages into the our address space.
-            OK_OR_RETURN(map_page(vm_task, (vaddr_t) __dst_page, dst_paddr,
-                                  MAP_TYPE_READWRITE, true));
-            dst_ptr = &__dst_page[dst_off];
+        payload->pages[payload->num_pages++] = paddr;
+        if (marked_cow) {
+            cow_start = (cow_start) ? cow_start : vaddr;
+            cow_end = vaddr + PAGE_SIZE;
         }
+    }
 
-        // Copy between the tasks.
-        memcpy(dst_ptr, src_ptr, copy_len);
-        remaining -= copy_len;
-        dst_buf += copy_len;
-        src_buf += copy_len;
+    if (cow_start) {
+        unmap_pages(task, cow_start, (cow_end - cow_start) / PAGE_SIZE);
     }
 
-    dst_task->received_ool_buf = dst_task->ool_buf;
-    dst_task->received_ool_len = m->ool_send.len;
-    dst_task->received_ool_from = src_task->tid;
-    dst_task->ool_buf = 0;
-    dst_task->ool_len = 0;
+    list_push_back(&task->ool_sent, &payload->next);
+    list_push_back(&dst->ool_incoming, &payload->dst_next);
+    if (err != OK) {
+        free_payload(payload);
+        return err;
+    }
 
     m->type = OOL_SEND_REPLY_MSG;
-    m->ool_send_reply.id = dst_task->received_ool_buf;
+    m->ool_send_reply.id = (vaddr_t) payload;
     return OK;
 }
+
+error_t handle_ool_recv(struct message *m) {
+    struct task *task = task_lookup(m->src);
+    ASSERT(task);
+
+    // The sender may have exited: its payloads have been freed then.
+    struct task *src = task_find(m->ool_recv.src);
+    if (!src) {
+        return ERR_NOT_FOUND;
+    }
+
+    struct ool_payload *payload =
+        lookup_payload(src, task->tid, m->ool_recv.id);
+    if (!payload) {
+        return ERR_NOT_FOUND;
+    }
+
+    vaddr_t addr = m->ool_recv.addr;
+    error_t err = ERR_INVALID_ARG;
+    if (m->ool_recv.len == payload->len && addr + payload->len > addr) {
+        err = fill_buffer(task, payload, addr);
+    }
+
+    free_payload(payload);
+    if (err != OK) {
+        return err;
+    }
+
+    m->type = OOL_RECV_REPLY_MSG;
+    return OK;
+}
+
+error_t handle_ool_discard(struct message *m) {
+    struct task *task = task_lookup(m->src);
+    ASSERT(task);
+
+    struct ool_payload *payload =
+        lookup_payload(task, m->ool_discard.dst, m->ool_discard.id);
+    if (!payload) {
+        return ERR_NOT_FOUND;
+    }
+
+    free_payload(payload);
+    m->type = OOL_DISCARD_REPLY_MSG;
+    return OK;
+}
+
+/// Frees OoL payloads sent from or to the task.
+void ool_discard_all(struct task *task) {
+    LIST_FOR_EACH (payload, &task->ool_sent, struct ool_payload, next) {
+        free_payload(payload);
+    }
+
+    LIST_FOR_EACH (payload, &task->ool_incoming, struct ool_payload,
+                   dst_next) {
+        free_payload(payload);
+    }
+}
+
+void ool_init(void) {
+    src_window = virt_page_alloc(vm_task, 1);
+    dst_window = virt_page_alloc(vm_task, 1);
+}
@@ -4,8 +4,11 @@
 #include <types.h>
 
 struct message;
-error_t handle_ool_recv(struct message *m);
+struct task;
 error_t handle_ool_send(struct message *m);
-error_t handle_ool_verify(struct message *m);
+error_t handle_ool_recv(struct message *m);
+error_t handle_ool_discard(struct message *m);
+void ool_discard_all(struct task *task);
+void ool_init(void);
 
 #endif
@@ -4,8 +4,12 @@
 #include <bootinfo.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/task.h>
 
+extern char __free_vaddr[];
 extern char __free_vaddr_end[];
+extern char __zeroed_pages[];
+extern char __zeroed_pages_end[];
 
 size_t num_unused_pages = 0;
 static struct page pages[PAGES_MAX];
@@ -16,13 +20,129 @@ pfn_t paddr2pfn(paddr_t paddr) {
     return (paddr - PAGES_BASE_ADDR) / PAGE_SIZE;
 }
 
+unsigned page_refcount(pfn_t pfn) {
+    ASSERT(pfn < PAGES_MAX);
+    return pages[pfn].ref_count;
+}
+
+/// The number of 64-bit words in the free block bitmap of the order.
+#define BITMAP_WORDS(order) (((PAGES_MAX >> (order)) + 63) / 64)
+/// The number of words in all free block bitmaps: less than twice the number
+/// of the order-0 bitmap.
+#define BITMAP_WORDS_TOTAL (2 * BITMAP_WORDS(0) + BUDDY_MAX_ORDER + 1)
+
+/// Free blocks of each order. Bit `i` is set if the block at `i << order` is
+/// free. Instead of linking free blocks in lists, we keep track of them in
+/// bitmaps (2 bits per page in total) to keep `struct page` small.
+static uint64_t *free_bitmaps[BUDDY_MAX_ORDER + 1];
+static uint64_t free_bitmap_words[BITMAP_WORDS_TOTAL];
+/// The number of free blocks of each order.
+static size_t num_free_blocks[BUDDY_MAX_ORDER + 1];
+/// The index of the first bitmap word which may have a bit set.
+static size_t free_bitmap_hints[BUDDY_MAX_ORDER + 1];
+
+static void push_free_block(pfn_t pfn, unsigned order) {
+    size_t i = pfn >> order;
+    pages[pfn].order = order;
+    free_bitmaps[order][i / 64] |= 1ULL << (i % 64);
+    free_bitmap_hints[order] = MIN(free_bitmap_hints[order], i / 64);
+    num_free_blocks[order]++;
+}
+
+static void remove_free_block(pfn_t pfn) {
+    unsigned order = pages[pfn].order;
+    DEBUG_ASSERT(order <= BUDDY_MAX_ORDER);
+    size_t i = pfn >> order;
+    free_bitmaps[order][i / 64] &= ~(1ULL << (i % 64));
+    num_free_blocks[order]--;
+    pages[pfn].order = ORDER_NONE;
+}
+
+/// Returns a free block of the order or PFN_NONE if there's none.
+static pfn_t find_free_block(unsigned order) {
+    if (!num_free_blocks[order]) {
+        return PFN_NONE;
+    }
+
+    uint64_t *bitmap = free_bitmaps[order];
+    for (size_t w = free_bitmap_hints[order]; w < BITMAP_WORDS(order); w++) {
+        if (bitmap[w]) {
+            free_bitmap_hints[order] = w;
+            return (w * 64 + __builtin_ctzll(bitmap[w])) << order;
+        }
+    }
+
+    UNREACHABLE();
+}
+
+/// Returns a free block to the buddy allocator. It's merged with its buddy
+/// as long as the buddy is also free.
+static void free_block(pfn_t pfn, unsigned order) {
+    while (order < BUDDY_MAX_ORDER) {
+        pfn_t buddy = pfn ^ (1U << order);
+        if (buddy >= PAGES_MAX || pages[buddy].order != order) {
+            break;
+        }
+
+        remove_free_block(buddy);
+        pfn = MIN(pfn, buddy);
+        order++;
+    }
+
+    push_free_block(pfn, order);
+}
+
+/// Returns free pages [pfn, end) to the buddy allocator as large as possible
+/// blocks.
+static void free_range(pfn_t pfn, pfn_t end) {
+    while (pfn < end) {
+        unsigned order = 0;
+        while (order < BUDDY_MAX_ORDER && IS_ALIGNED(pfn, 1U << (order + 1))
+               && pfn + (1U << (order + 1)) <= end) {
+            order++;
+        }
+
+        free_block(pfn, order);
+        pfn += 1U << order;
+    }
+}
+
+/// Takes a free page out of the free block containing it, if any. The rest of
+/// the block is split into smaller free blocks.
+static void take_free_page(pfn_t pfn) {
+    for (unsigned order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        pfn_t base = pfn & ~((1U << order) - 1);
+        if (pages[base].order != order) {
+            continue;
+        }
+
+        remove_free_block(base);
+        while (order > 0) {
+            order--;
+            pfn_t half = base + (1U << order);
+            if (pfn < half) {
+                push_free_block(half, order);
+            } else {
+                push_free_block(base, order);
+                base = half;
+            }
+        }
+
+        return;
+    }
+}
+
 void page_incref(pfn_t pfn, size_t num_pages) {
     ASSERT(pfn + num_pages <= PAGES_MAX);
     for (size_t i = 0; i < num_pages; i++) {
         if (!pages[pfn + i].ref_count) {
+            // The page might be in a free block (e.g. a physical memory
+            // address specified by the task).
+            take_free_page(pfn + i);
             num_unused_pages--;
         }
 
+        ASSERT(pages[pfn + i].ref_count < PAGE_REFCOUNT_MAX);
         pages[pfn + i].ref_count++;
     }
 }
@@ -35,39 +155,81 @@ void page_decref(pfn_t pfn, size_t num_pages) {
 
         if (!pages[pfn + i].ref_count) {
             num_unused_pages++;
+            if (pages[pfn + i].order != ORDER_UNAVAILABLE) {
+                free_block(pfn + i, 0);
+            }
+        }
+    }
+}
+
+/// Looks for continuous free pages by scanning the page array. It's slow and
+/// used only if the buddy allocator fails due to fragmentation.
+static pfn_t find_free_run(size_t num_pages) {
+    size_t len = 0;
+    for (pfn_t pfn = 0; pfn < PAGES_MAX; pfn++) {
+        if (pages[pfn].order == ORDER_UNAVAILABLE || pages[pfn].ref_count > 0) {
+            len = 0;
+            continue;
+        }
+
+        len++;
+        if (len == num_pages) {
+            return pfn + 1 - num_pages;
         }
     }
+
+    return PFN_NONE;
 }
 
-/// Allocates continuous physical memory pages. It always returns a valid
-/// physical address: when it runs out of memory, it panics.
+/// Allocates continuous physical memory pages. Returns 0 if there are no
+/// sufficient free pages: `num_pages` may come from a task.
+///
+/// This is a buddy allocator: the allocated pages are aligned to the power of
+/// two not less than `num_pages`. In other words, large allocations are
+/// aligned to HUGE_PAGE_SIZE so that they can be mapped with huge pages.
 paddr_t page_alloc(size_t num_pages) {
-    LIST_FOR_EACH (region, &regions, struct available_ram_region, next) {
-        pfn_t first = paddr2pfn(region->base);
-        pfn_t end = first + region->num_pages;
-        for (pfn_t base = first; base < end; base++) {
-            size_t i = 0;
-            while (base + i < end) {
-                if (pages[base + i].ref_count > 0) {
-                    break;
-                }
+    DEBUG_ASSERT(num_pages > 0);
+    if (num_pages > num_unused_pages) {
+        return 0;
+    }
 
-                i++;
-                if (i == num_pages) {
-                    break;
-                }
-            }
+    unsigned order = 0;
+    while ((1ULL << order) < num_pages) {
+        order++;
+    }
 
-            if (i == num_pages) {
-                // Found sufficiently large free physical pages.
-                page_incref(base, num_pages);
-                paddr_t paddr = PAGES_BASE_ADDR + base * PAGE_SIZE;
-                return paddr;
-            }
+    // Look for the smallest free block which is large enough.
+    unsigned block_order = order;
+    while (block_order <= BUDDY_MAX_ORDER && !num_free_blocks[block_order]) {
+        block_order++;
+    }
+
+    if (block_order > BUDDY_MAX_ORDER) {
+        // No sufficiently large block is available. The memory is fragmented
+        // but there might be a run of free pages across multiple blocks.
+        pfn_t pfn = find_free_run(num_pages);
+        if (pfn == PFN_NONE) {
+            WARN_DBG("failed to allocate %d pages: out of memory", num_pages);
+            return 0;
         }
+
+        page_incref(pfn, num_pages);
+        return PAGES_BASE_ADDR + pfn * PAGE_SIZE;
     }
 
-    PANIC("out of memory");
+    pfn_t pfn = find_free_block(block_order);
+    remove_free_block(pfn);
+
+    // Split the block and give back the unused part.
+    free_range(pfn + num_pages, pfn + (1U << block_order));
+
+    for (size_t i = 0; i < num_pages; i++) {
+        DEBUG_ASSERT(!pages[pfn + i].ref_count);
+        pages[pfn + i].ref_count = 1;
+    }
+
+    num_unused_pages -= num_pages;
+    return PAGES_BASE_ADDR + pfn * PAGE_SIZE;
 }
 
 static bool is_mappable_paddr_range(paddr_t paddr, size_t num_pages) {
@@ -92,6 +254,10 @@ static bool is_mappable_paddr_range(paddr_t paddr, size_t num_pages) {
 /// non-mappable.
 error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
                         size_t num_pages) {
+    if (!num_pages) {
+        return ERR_INVALID_ARG;
+    }
+
     if (*paddr) {
         if (!IS_ALIGNED(*paddr, PAGE_SIZE)) {
             WARN_DBG("%s: unaligned paddr %p", __func__, *paddr);
@@ -102,72 +268,332 @@ error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
             WARN_DBG("%s: invalid paddr %p", __func__, *paddr);
             return ERR_NOT_ACCEPTABLE;
         }
+    }
 
-        // Map the specified physical memory address.
-        for (size_t i = 0; i < num_pages; i++) {
-            offset_t off = i * PAGE_SIZE;
-            error_t err = map_page(task, *vaddr + off, *paddr + off,
-                                   MAP_TYPE_READWRITE, false);
-            if (err != OK) {
-                return err;
-            }
+    // Allocate physical memory pages first: they run out earlier than the
+    // virtual address space.
+    bool allocated = false;
+    if (!*paddr) {
+        *paddr = page_alloc(num_pages);
+        if (!*paddr) {
+            return ERR_NO_MEMORY;
         }
 
-        page_incref(paddr2pfn(*paddr), num_pages);
-    } else {
-        *paddr = page_alloc(num_pages);
+        allocated = true;
     }
 
+    bool vaddr_allocated = false;
     if (vaddr != NULL && !*vaddr) {
         *vaddr = virt_page_alloc(task, num_pages);
         if (!*vaddr) {
+            if (allocated) {
+                page_decref(paddr2pfn(*paddr), num_pages);
+                *paddr = 0;
+            }
             return ERR_NO_MEMORY;
         }
+
+        vaddr_allocated = true;
     }
 
+    if (!allocated) {
+        // Map the specified physical memory address at once.
+        if (vaddr != NULL) {
+            error_t err = map_pages(task, *vaddr, *paddr, num_pages,
+                                    MAP_TYPE_READWRITE, false);
+            if (err != OK) {
+                if (vaddr_allocated) {
+                    virt_page_free(task, *vaddr, num_pages);
+                    *vaddr = 0;
+                }
+                return err;
+            }
+        }
+
+        page_incref(paddr2pfn(*paddr), num_pages);
+    }
+
+    struct page_area *area =
+        task_page_add(task, (vaddr != NULL) ? *vaddr : 0, *paddr, num_pages);
+    area->pinned = true;
+    return OK;
+}
+
+/// Adds physical memory pages already allocated by page_alloc() to the task's
+/// page areas. The task takes over the reference to the pages.
+struct page_area *task_page_add(struct task *task, vaddr_t vaddr,
+                                paddr_t paddr, size_t num_pages) {
     struct page_area *area = malloc(sizeof(*area));
-    area->vaddr = (vaddr != NULL) ? *vaddr : 0;
-    area->paddr = *paddr;
+    area->vaddr = vaddr;
+    area->paddr = paddr;
     area->num_pages = num_pages;
+    area->cow = false;
+    area->readonly = false;
+    area->pinned = false;
     list_push_back(&task->page_areas, &area->next);
-    return OK;
+    if (area->vaddr) {
+        area->vaddr_node.key = area->vaddr;
+        avl_insert(&task->page_areas_by_vaddr, &area->vaddr_node);
+    }
+    area->paddr_node.key = area->paddr;
+    avl_insert(&task->page_areas_by_paddr, &area->paddr_node);
+    return area;
 }
 
-/// Allocates a virtual address space by so-called the bump pointer allocation
-/// algorithm. Unlike task_page_alloc(), it doesn't maps to a physical memory
-/// pages.
+/// Looks for the page area which contains `vaddr`. Returns NULL if it does not
+/// exist.
+struct page_area *page_area_lookup(struct task *task, vaddr_t vaddr) {
+    // Page areas never overlap: the only candidate is the one which begins
+    // at or just before `vaddr`.
+    struct avl_node *node = avl_find_le(&task->page_areas_by_vaddr, vaddr);
+    if (!node) {
+        return NULL;
+    }
+
+    struct page_area *area = AVL_CONTAINER(node, struct page_area, vaddr_node);
+    if (vaddr >= area->vaddr + area->num_pages * PAGE_SIZE) {
+        return NULL;
+    }
+
+    return area;
+}
+
+/// Replaces the physical memory address of the page area (e.g. when a
+/// copy-on-write page is copied).
+void page_area_set_paddr(struct task *task, struct page_area *area,
+                         paddr_t paddr) {
+    avl_remove(&task->page_areas_by_paddr, &area->paddr_node);
+    area->paddr = paddr;
+    area->paddr_node.key = paddr;
+    avl_insert(&task->page_areas_by_paddr, &area->paddr_node);
+}
+
+/// Allocates a virtual address space. Unlike task_page_alloc(), it doesn't
+/// maps to a physical memory pages. Ranges freed by virt_page_free() are
+/// reused first (first fit) and then the bump pointer is advanced. Returns 0
+/// if the task's virtual address space has been exhausted.
 vaddr_t virt_page_alloc(struct task *task, size_t num_pages) {
-    vaddr_t vaddr = task->free_vaddr;
+    vaddr_t end = (vaddr_t) __free_vaddr_end;
+    if (!num_pages || num_pages > (end - (vaddr_t) __free_vaddr) / PAGE_SIZE) {
+        return 0;
+    }
+
+    // Align to the huge page size as page_alloc() does.
     size_t size = num_pages * PAGE_SIZE;
+    size_t align =
+        (num_pages >= NUM_PAGES_PER_HUGE_PAGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+
+    LIST_FOR_EACH (range, &task->free_vaddr_ranges, struct vaddr_range,
+                   next) {
+        vaddr_t vaddr = ALIGN_UP(range->vaddr, align);
+        vaddr_t range_end = range->vaddr + range->num_pages * PAGE_SIZE;
+        if (vaddr >= range_end || range_end - vaddr < size) {
+            continue;
+        }
+
+        if (vaddr > range->vaddr) {
+            // Keep the gap left by the alignment as a separate range.
+            struct vaddr_range *head = malloc(sizeof(*head));
+            head->vaddr = range->vaddr;
+            head->num_pages = (vaddr - range->vaddr) / PAGE_SIZE;
+            list_insert(range->next.prev, &range->next, &head->next);
+        }
+
+        range->vaddr = vaddr + size;
+        range->num_pages = (range_end - range->vaddr) / PAGE_SIZE;
+        if (!range->num_pages) {
+            list_remove(&range->next);
+            free(range);
+        }
+
+        return vaddr;
+    }
 
-    if (vaddr + size >= (vaddr_t) __free_vaddr_end) {
+    vaddr_t vaddr = ALIGN_UP(task->free_vaddr, align);
+    if (vaddr >= end || end - vaddr <= size) {
         // Task's virtual memory space has been exhausted.
         WARN_DBG("%s: run out of virtual memory space", task->name);
-        task_kill(task);
         return 0;
     }
 
-    task->free_vaddr += size;
+    if (vaddr > task->free_vaddr) {
+        virt_page_free(task, task->free_vaddr,
+                       (vaddr - task->free_vaddr) / PAGE_SIZE);
+    }
+
+    task->free_vaddr = vaddr + size;
+    return vaddr;
+}
+
+/// Returns the virtual address space allocated by virt_page_alloc(). The
+/// caller must have unmapped it.
+void virt_page_free(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    // The free ranges are sorted by the address. Look for the neighbors.
+    list_elem_t *next_elem = &task->free_vaddr_ranges;
+    LIST_FOR_EACH (range, &task->free_vaddr_ranges, struct vaddr_range,
+                   next) {
+        if (range->vaddr > vaddr) {
+            next_elem = &range->next;
+            break;
+        }
+    }
+
+    list_elem_t *prev_elem = next_elem->prev;
+    struct vaddr_range *range = NULL;
+    if (prev_elem != &task->free_vaddr_ranges) {
+        struct vaddr_range *prev =
+            LIST_CONTAINER(prev_elem, struct vaddr_range, next);
+        if (prev->vaddr + prev->num_pages * PAGE_SIZE == vaddr) {
+            range = prev;
+            range->num_pages += num_pages;
+        }
+    }
+
+    if (!range) {
+        range = malloc(sizeof(*range));
+        range->vaddr = vaddr;
+        range->num_pages = num_pages;
+        list_insert(prev_elem, next_elem, &range->next);
+    }
+
+    vaddr_t range_end = range->vaddr + range->num_pages * PAGE_SIZE;
+    if (next_elem != &task->free_vaddr_ranges) {
+        struct vaddr_range *next =
+            LIST_CONTAINER(next_elem, struct vaddr_range, next);
+        if (next->vaddr == range_end) {
+            range->num_pages += next->num_pages;
+            range_end += next->num_pages * PAGE_SIZE;
+            list_remove(&next->next);
+            free(next);
+        }
+    }
+
+    // Give the last range back to the bump pointer to keep the list short.
+    if (range_end == task->free_vaddr) {
+        task->free_vaddr = range->vaddr;
+        list_remove(&range->next);
+        free(range);
+    }
+}
+
+/// Reserves a virtual memory area for the heap. Unlike task_page_alloc(),
+/// physical memory pages are allocated on page faults.
+vaddr_t task_heap_alloc(struct task *task, size_t num_pages) {
+    vaddr_t vaddr = virt_page_alloc(task, num_pages);
+    if (!vaddr) {
+        return 0;
+    }
+
+    struct heap_area *heap = malloc(sizeof(*heap));
+    heap->vaddr = vaddr;
+    heap->num_pages = num_pages;
+    list_push_back(&task->heap_areas, &heap->next);
     return vaddr;
 }
 
+/// Returns true if the page at `vaddr` is filled with zeroes on the first
+/// access: .bss section, stack, the static heap, or a heap area.
+bool is_zeroed_page(struct task *task, vaddr_t vaddr) {
+    if ((vaddr_t) __zeroed_pages <= vaddr
+        && vaddr < (vaddr_t) __zeroed_pages_end) {
+        return true;
+    }
+
+    LIST_FOR_EACH (heap, &task->heap_areas, struct heap_area, next) {
+        if (heap->vaddr <= vaddr
+            && vaddr < heap->vaddr + heap->num_pages * PAGE_SIZE) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void free_page_area(struct page_area *area) {
     page_decref(paddr2pfn(area->paddr), area->num_pages);
     list_remove(&area->next);
     free(area);
 }
 
+/// Removes the page area from the task and frees its pages.
+static void remove_page_area(struct task *task, struct page_area *area) {
+    avl_remove(&task->page_areas_by_paddr, &area->paddr_node);
+    if (area->vaddr) {
+        avl_remove(&task->page_areas_by_vaddr, &area->vaddr_node);
+    }
+
+    free_page_area(area);
+}
+
 /// Frees the physical memory pages allocated for the task. `paddr` is the
 /// beginning of the allocated physical memory area.
 void task_page_free(struct task *task, paddr_t paddr) {
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->paddr == paddr) {
-            free_page_area(area);
-            return;
+    struct avl_node *node = avl_find(&task->page_areas_by_paddr, paddr);
+    if (!node) {
+        OOPS("failed to free paddr=%p in %s (double free?)", paddr,
+             task->name);
+        return;
+    }
+
+    remove_page_area(task,
+                     AVL_CONTAINER(node, struct page_area, paddr_node));
+}
+
+/// Unmaps the heap area and frees the pages filled in it.
+static error_t free_heap_area(struct task *task, struct heap_area *heap) {
+    error_t err = unmap_pages(task, heap->vaddr, heap->num_pages);
+    if (err != OK) {
+        return err;
+    }
+
+    // Pages in a heap area are filled one by one (see handle_page_fault()).
+    for (size_t i = 0; i < heap->num_pages; i++) {
+        struct avl_node *node = avl_find(&task->page_areas_by_vaddr,
+                                         heap->vaddr + i * PAGE_SIZE);
+        if (node) {
+            remove_page_area(task,
+                             AVL_CONTAINER(node, struct page_area, vaddr_node));
+        }
+    }
+
+    virt_page_free(task, heap->vaddr, heap->num_pages);
+    list_remove(&heap->next);
+    free(heap);
+    return OK;
+}
+
+/// Unmaps and frees the memory pages allocated by task_page_alloc() or
+/// task_heap_alloc() at `vaddr`.
+error_t task_page_free_by_vaddr(struct task *task, vaddr_t vaddr) {
+    LIST_FOR_EACH (heap, &task->heap_areas, struct heap_area, next) {
+        if (heap->vaddr == vaddr) {
+            return free_heap_area(task, heap);
         }
     }
 
-    OOPS("failed to free paddr=%p in %s (double free?)", paddr, task->name);
+    struct avl_node *node = avl_find(&task->page_areas_by_vaddr, vaddr);
+    if (!node) {
+        return ERR_NOT_FOUND;
+    }
+
+    struct page_area *area = AVL_CONTAINER(node, struct page_area, vaddr_node);
+    error_t err = unmap_pages(task, area->vaddr, area->num_pages);
+    if (err != OK) {
+        return err;
+    }
+
+    // Recycle the address space if it has been allocated by
+    // virt_page_alloc(): not a page in the program image or a heap area.
+    size_t num_pages = area->num_pages;
+    bool recycle = (vaddr_t) __free_vaddr <= vaddr
+                   && vaddr < (vaddr_t) __free_vaddr_end
+                   && !is_zeroed_page(task, vaddr);
+    remove_page_area(task, area);
+    if (recycle) {
+        virt_page_free(task, vaddr, num_pages);
+    }
+
+    return OK;
 }
 
 /// Frees all memory areas allocated for the task.
@@ -175,6 +601,20 @@ void task_page_free_all(struct task *task) {
     LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
         free_page_area(area);
     }
+
+    LIST_FOR_EACH (heap, &task->heap_areas, struct heap_area, next) {
+        list_remove(&heap->next);
+        free(heap);
+    }
+
+    LIST_FOR_EACH (range, &task->free_vaddr_ranges, struct vaddr_range,
+                   next) {
+        list_remove(&range->next);
+        free(range);
+    }
+
+    avl_init(&task->page_areas_by_vaddr);
+    avl_init(&task->page_areas_by_paddr);
 }
 
 extern struct bootinfo __bootinfo;
@@ -212,8 +652,30 @@ void page_alloc_init(void) {
         list_push_back(&regions, &region->next);
     }
 
+    uint64_t *bitmap = free_bitmap_words;
+    for (unsigned i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        free_bitmaps[i] = bitmap;
+        num_free_blocks[i] = 0;
+        free_bitmap_hints[i] = 0;
+        bitmap += BITMAP_WORDS(i);
+    }
+    DEBUG_ASSERT(bitmap <= &free_bitmap_words[BITMAP_WORDS_TOTAL]);
+
     for (pfn_t i = 0; i < PAGES_MAX; i++) {
         pages[i].ref_count = 0;
+        pages[i].order = ORDER_UNAVAILABLE;
         num_unused_pages++;
     }
+
+    LIST_FOR_EACH (region, &regions, struct available_ram_region, next) {
+        pfn_t start = paddr2pfn(ALIGN_UP(region->base, PAGE_SIZE));
+        pfn_t end = (region->base - PAGES_BASE_ADDR) / PAGE_SIZE
+                    + region->num_pages;
+        end = MIN(end, PAGES_MAX);
+        for (pfn_t pfn = start; pfn < end; pfn++) {
+            pages[pfn].order = ORDER_NONE;
+        }
+
+        free_range(start, end);
+    }
 }
@@ -8,10 +8,32 @@
 typedef unsigned pfn_t;
 #define PAGES_MAX ((4ULL * 1024 * 1024 * 1024) / PAGE_SIZE)
 
+/// The size of a huge page (the 2nd level page table entry). Allocations
+/// larger than this are aligned to it so that the kernel can map them with
+/// huge pages.
+#define HUGE_PAGE_SIZE          (2 * 1024 * 1024)
+#define NUM_PAGES_PER_HUGE_PAGE (HUGE_PAGE_SIZE / PAGE_SIZE)
+
+/// The maximum order of blocks in the buddy allocator: the largest block is
+/// (2^BUDDY_MAX_ORDER * PAGE_SIZE) bytes.
+#define BUDDY_MAX_ORDER 20
+#define ORDER_NONE      0xff
+/// The page is not in an available RAM region (e.g. memory-mapped I/O).
+#define ORDER_UNAVAILABLE 0xfe
+#define PFN_NONE          ((pfn_t) -1)
+#define PAGE_REFCOUNT_MAX ((1U << 24) - 1)
+
+/// A physical memory page. Keep it small: there're PAGES_MAX of them.
 struct page {
-    unsigned ref_count;
+    unsigned ref_count : 24;
+    /// The order of the free block if the page is the first page of a free
+    /// block, ORDER_UNAVAILABLE if the page is not in an available RAM region,
+    /// or ORDER_NONE otherwise.
+    unsigned order : 8;
 };
 
+STATIC_ASSERT(sizeof(struct page) == 4);
+
 struct available_ram_region {
     list_elem_t next;
     paddr_t base;
@@ -25,14 +47,25 @@ extern char __straight_mapping[];
 extern size_t num_unused_pages;
 
 pfn_t paddr2pfn(paddr_t paddr);
+unsigned page_refcount(pfn_t pfn);
 void page_incref(pfn_t pfn, size_t num_pages);
 void page_decref(pfn_t pfn, size_t num_pages);
 paddr_t page_alloc(size_t num_pages);
 struct task;
+struct page_area;
+struct page_area *page_area_lookup(struct task *task, vaddr_t vaddr);
+void page_area_set_paddr(struct task *task, struct page_area *area,
+                         paddr_t paddr);
 error_t task_page_alloc(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
                         size_t num_pages);
+struct page_area *task_page_add(struct task *task, vaddr_t vaddr,
+                                paddr_t paddr, size_t num_pages);
 vaddr_t virt_page_alloc(struct task *task, size_t num_pages);
+void virt_page_free(struct task *task, vaddr_t vaddr, size_t num_pages);
+vaddr_t task_heap_alloc(struct task *task, size_t num_pages);
+bool is_zeroed_page(struct task *task, vaddr_t vaddr);
 void task_page_free(struct task *task, paddr_t paddr);
+error_t task_page_free_by_vaddr(struct task *task, vaddr_t vaddr);
 void task_page_free_all(struct task *task);
 void page_alloc_init(void);
 
@@ -6,49 +6,288 @@
 #include <resea/ipc.h>
 #include <resea/malloc.h>
 #include <resea/task.h>
+#include <resea/timer.h>
 #include <string.h>
 
 extern char __cmdline[];
-extern char __zeroed_pages[];
-extern char __zeroed_pages_end[];
 
 static vaddr_t tmp_page = 0;
+static vaddr_t cow_src_page = 0;
 
-error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
-                 unsigned flags, bool overwrite) {
+/// Pre-zeroed physical memory pages for demand-zero page faults.
+static paddr_t zeroed_pool[CONFIG_ZEROED_POOL_HIGH];
+static unsigned zeroed_pool_len = 0;
+static struct timer zeroed_pool_timer;
+static bool zeroed_pool_refilling = false;
+
+/// A page of a read-only ELF segment shared among tasks spawned from the same
+/// file.
+struct shared_file_page {
+    /// The node in `shared_file_pages` keyed by the offset in the bootfs
+    /// image.
+    struct avl_node node;
+    paddr_t paddr;
+};
+
+static struct avl_tree shared_file_pages;
+
+/// Unmaps pages from the task. The kernel refuses to unmap a part of a huge
+/// page: in that case, the whole huge pages are unmapped and the rest of them
+/// are mapped again on page faults.
+error_t unmap_pages(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    error_t err = vm_unmap_range(task->tid, vaddr, num_pages);
+    if (err == ERR_NOT_ACCEPTABLE) {
+        vaddr_t start = ALIGN_DOWN(vaddr, HUGE_PAGE_SIZE);
+        vaddr_t end = ALIGN_UP(vaddr + num_pages * PAGE_SIZE, HUGE_PAGE_SIZE);
+        err = vm_unmap_range(task->tid, start, (end - start) / PAGE_SIZE);
+    }
+
+    return err;
+}
+
+/// Maps contiguous physical memory pages at `vaddr` in a single system call
+/// (unless the kernel needs more kpages than we've passed).
+error_t map_pages(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                  size_t num_pages, unsigned flags, bool overwrite) {
     if (overwrite) {
-        vm_unmap(task->tid, vaddr);
+        unmap_pages(task, vaddr, num_pages);
     }
 
-    // Calls vm_map multiple times because the kernel needs multiple memory
-    // pages (kpage) for multi-level page table structures.
+    struct vm_map_range range;
+    range.vaddr = vaddr;
+    range.src = paddr;
+    range.num_pages = num_pages;
+    range.flags = flags;
+
+    // In most cases, page table structures have already been allocated. Pass
+    // a single kpage first and give more if the kernel runs out of them.
+    unsigned num_kpages = 1;
     while (true) {
-        paddr_t kpage = 0;
-        error_t err = task_page_alloc(task, NULL, &kpage, 1);
+        range.num_kpages = 0;
+        range.used_kpages = 0;
+        for (unsigned i = 0; i < num_kpages; i++) {
+            paddr_t kpage = 0;
+            error_t err = task_page_alloc(task, NULL, &kpage, 1);
+            if (err != OK) {
+                for (unsigned j = 0; j < range.num_kpages; j++) {
+                    task_page_free(task, range.kpages[j]);
+                }
+                return err;
+            }
+
+            range.kpages[range.num_kpages++] = kpage;
+        }
+
+        error_t err = vm_map_range(task->tid, &range);
+
+        // Free unused kpages. Used ones are now owned by the page table.
+        for (unsigned i = range.used_kpages; i < range.num_kpages; i++) {
+            task_page_free(task, range.kpages[i]);
+        }
+
+        if (err == ERR_TRY_AGAIN) {
+            num_kpages = VM_MAP_KPAGES_MAX;
+            continue;
+        }
+
         if (err != OK) {
-            return err;
+            WARN_DBG("%s: failed to map pages: %s (paddr=%p, vaddr=%p, "
+                     "num_pages=%d)",
+                     task->name, err2str(err), paddr, vaddr, (int) num_pages);
         }
 
-        err = vm_map(task->tid, vaddr, paddr, kpage, flags);
-        switch (err) {
-            case ERR_TRY_AGAIN:
-                continue;
-            default:
-                if (err != OK) {
-                    WARN_DBG(
-                        "%s: failed to map a page: %s (paddr=%p, vaddr=%p, kpage=%p)",
-                        task->name, err2str(err), paddr, vaddr, kpage);
-                }
-                task_page_free(task, kpage);
-                return err;
+        return err;
+    }
+}
+
+error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                 unsigned flags, bool overwrite) {
+    return map_pages(task, vaddr, paddr, 1, flags, overwrite);
+}
+
+/// Maps the whole huge page containing `vaddr` at once if it's in the area and
+/// both virtual and physical addresses are aligned. It saves TLB entries and
+/// page faults on large areas. If it fails, the page is mapped as usual.
+static void map_huge_page(struct task *task, struct page_area *area,
+                          vaddr_t vaddr) {
+    vaddr_t base = ALIGN_DOWN(vaddr, HUGE_PAGE_SIZE);
+    vaddr_t area_end = area->vaddr + area->num_pages * PAGE_SIZE;
+    if (base < area->vaddr || base + HUGE_PAGE_SIZE > area_end) {
+        return;
+    }
+
+    paddr_t paddr = area->paddr + (base - area->vaddr);
+    if (!IS_ALIGNED(paddr, HUGE_PAGE_SIZE)) {
+        return;
+    }
+
+    map_pages(task, base, paddr, NUM_PAGES_PER_HUGE_PAGE, MAP_TYPE_READWRITE,
+              false);
+}
+
+/// Handles a write access to a copy-on-write page: copies the page unless no
+/// other tasks share it anymore. Returns the physical memory address to be
+/// mapped writable or 0 on failure.
+static paddr_t break_cow(struct task *task, struct page_area *area) {
+    DEBUG_ASSERT(area->cow && area->num_pages == 1);
+
+    pfn_t pfn = paddr2pfn(area->paddr);
+    if (page_refcount(pfn) > 1) {
+        paddr_t paddr = page_alloc(1);
+        if (!paddr) {
+            return 0;
+        }
+
+        if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false) != OK
+            || map_page(vm_task, cow_src_page, area->paddr, MAP_TYPE_READONLY,
+                        false)
+                   != OK) {
+            page_decref(paddr2pfn(paddr), 1);
+            return 0;
         }
+
+        memcpy((void *) tmp_page, (void *) cow_src_page, PAGE_SIZE);
+        page_decref(pfn, 1);
+        page_area_set_paddr(task, area, paddr);
+
+        // The shared page might still be mapped (read-only) in the task.
+        unmap_pages(task, area->vaddr, 1);
+    }
+
+    area->cow = false;
+    return area->paddr;
+}
+
+/// Allocates a physical memory page and fills it with zeros.
+static paddr_t alloc_and_zero_page(void) {
+    paddr_t paddr = page_alloc(1);
+    if (!paddr) {
+        return 0;
+    }
+
+    if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false) != OK) {
+        page_decref(paddr2pfn(paddr), 1);
+        return 0;
+    }
+
+    memset((void *) tmp_page, 0, PAGE_SIZE);
+    return paddr;
+}
+
+/// Fills the pre-zeroed page pool up to the high watermark.
+static void zeroed_pool_refill(void) {
+    while (zeroed_pool_len < CONFIG_ZEROED_POOL_HIGH) {
+        paddr_t paddr = alloc_and_zero_page();
+        if (!paddr) {
+            break;
+        }
+
+        zeroed_pool[zeroed_pool_len++] = paddr;
+    }
+}
+
+static void zeroed_pool_timer_callback(struct timer *timer) {
+    zeroed_pool_refilling = false;
+    zeroed_pool_refill();
+}
+
+/// Returns a zero-filled physical memory page. It takes one from the pool if
+/// available, and schedules refilling the pool when the vm server gets idle
+/// (i.e. after handling pending messages) if the pool is running out.
+static paddr_t alloc_zeroed_page(void) {
+    paddr_t paddr;
+    if (zeroed_pool_len > 0) {
+        paddr = zeroed_pool[--zeroed_pool_len];
+    } else {
+        paddr = alloc_and_zero_page();
+    }
+
+    if (zeroed_pool_len < CONFIG_ZEROED_POOL_LOW && !zeroed_pool_refilling) {
+        zeroed_pool_refilling = true;
+        timer_add(&zeroed_pool_timer, 1, zeroed_pool_timer_callback);
+    }
+
+    return paddr;
+}
+
+/// Returns a physical memory page filled with the file data at `vaddr` in the
+/// ELF segment and adds it to the task's page areas. Pages in read-only
+/// segments are shared with other tasks.
+static paddr_t fill_file_page(struct task *task, struct elf64_phdr *phdr,
+                              vaddr_t vaddr) {
+    offset_t offset = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+    bool readonly = (phdr->p_flags & PF_W) == 0;
+    uintptr_t key = task->file->offset + offset;
+
+    paddr_t paddr = 0;
+    if (readonly) {
+        struct avl_node *node = avl_find(&shared_file_pages, key);
+        if (node) {
+            paddr = AVL_CONTAINER(node, struct shared_file_page, node)->paddr;
+            page_incref(paddr2pfn(paddr), 1);
+        }
+    }
+
+    if (!paddr) {
+        paddr = page_alloc(1);
+        if (!paddr) {
+            return 0;
+        }
+
+        if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
+            != OK) {
+            page_decref(paddr2pfn(paddr), 1);
+            return 0;
+        }
+
+        read_file(task->file, offset, (void *) tmp_page, PAGE_SIZE);
+
+        if (readonly) {
+            // Keep the page (by holding a reference) for other tasks.
+            struct shared_file_page *shared = malloc(sizeof(*shared));
+            shared->node.key = key;
+            shared->paddr = paddr;
+            avl_insert(&shared_file_pages, &shared->node);
+            page_incref(paddr2pfn(paddr), 1);
+        }
+    }
+
+    struct page_area *area = task_page_add(task, vaddr, paddr, 1);
+    area->readonly = readonly;
+    return paddr;
+}
+
+/// Fills and maps pages around `vaddr` in the same ELF segment in advance to
+/// save page faults on the following accesses.
+static void fault_around(struct task *task, struct elf64_phdr *phdr,
+                         vaddr_t vaddr) {
+    size_t window = CONFIG_FAULT_AROUND_PAGES * PAGE_SIZE;
+    vaddr_t base = vaddr - (vaddr % window);
+    unsigned flags =
+        (phdr->p_flags & PF_W) ? MAP_TYPE_READWRITE : MAP_TYPE_READONLY;
+    for (vaddr_t v = base; v < base + window; v += PAGE_SIZE) {
+        if (v == vaddr || v < phdr->p_vaddr
+            || v >= phdr->p_vaddr + phdr->p_memsz
+            || v == (vaddr_t) __cmdline || page_area_lookup(task, v)) {
+            continue;
+        }
+
+        paddr_t paddr = fill_file_page(task, phdr, v);
+        if (!paddr) {
+            break;
+        }
+
+        // If it fails, the page will be mapped on the page fault.
+        map_page(task, v, paddr, flags, false);
     }
 }
 
 /// Tries to fill a page at `vaddr` for the task. Returns the allocated physical
-/// memory address on success or 0 on failure.
+/// memory address on success or 0 on failure. `flags` is set to the flags
+/// the page should be mapped with.
 paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
-                          unsigned fault) {
+                          unsigned fault, unsigned *flags) {
+    *flags = MAP_TYPE_READWRITE;
     if (vaddr < PAGE_SIZE) {
         WARN("%s (%d): null pointer dereference at vaddr=%p, ip=%p", task->name,
              task->tid, vaddr, ip);
@@ -59,6 +298,11 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
     vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
 
     if (fault & EXP_PF_PRESENT) {
+        struct page_area *area = page_area_lookup(task, vaddr);
+        if (area && area->cow && (fault & EXP_PF_WRITE)) {
+            return break_cow(task, area);
+        }
+
         // Invalid access. For instance the user thread has tried to write to
         // readonly area.
         WARN("%s: invalid memory access at %p (IP=%p, perhaps segfault?)",
@@ -81,27 +325,35 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
         return paddr;
     }
 
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
+    struct page_area *area = page_area_lookup(task, vaddr);
+    if (area) {
+        if (area->cow) {
+            if (fault & EXP_PF_WRITE) {
+                return break_cow(task, area);
+            }
+
+            *flags = MAP_TYPE_READONLY;
+            return area->paddr;
+        }
+
+        if (area->readonly) {
+            *flags = MAP_TYPE_READONLY;
             return area->paddr + (vaddr - area->vaddr);
         }
+
+        map_huge_page(task, area, vaddr);
+        return area->paddr + (vaddr - area->vaddr);
     }
 
     // Zeroed pages.
-    vaddr_t zeroed_pages_start = (vaddr_t) __zeroed_pages;
-    vaddr_t zeroed_pages_end = (vaddr_t) __zeroed_pages_end;
-    if (zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end) {
+    if (is_zeroed_page(task, vaddr)) {
         // The accessed page is zeroed one (.bss section, stack, or heap).
-        paddr_t paddr = 0;
-        if (task_page_alloc(task, &vaddr, &paddr, 1) != OK) {
+        paddr_t paddr = alloc_zeroed_page();
+        if (!paddr) {
             return 0;
         }
-        if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
-            != OK) {
-            return 0;
-        }
-        memset((void *) tmp_page, 0, PAGE_SIZE);
+
+        task_page_add(task, vaddr, paddr, 1);
         return paddr;
     }
 
@@ -124,17 +376,16 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
 
         if (phdr) {
             // Allocate a page and fill it with the file data.
-            paddr_t paddr = 0;
-            if (task_page_alloc(task, &vaddr, &paddr, 1) != OK) {
+            paddr_t paddr = fill_file_page(task, phdr, vaddr);
+            if (!paddr) {
                 return 0;
             }
-            if (map_page(vm_task, tmp_page, paddr, MAP_TYPE_READWRITE, false)
-                != OK) {
-                return 0;
+
+            if ((phdr->p_flags & PF_W) == 0) {
+                *flags = MAP_TYPE_READONLY;
             }
-            size_t offset_in_segment = (vaddr - phdr->p_vaddr) + phdr->p_offset;
-            read_file(task->file, offset_in_segment, (void *) tmp_page,
-                      PAGE_SIZE);
+
+            fault_around(task, phdr, vaddr);
             return paddr;
         }
     }
@@ -146,4 +397,7 @@ paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
 
 void page_fault_init(void) {
     tmp_page = virt_page_alloc(vm_task, 1);
+    cow_src_page = virt_page_alloc(vm_task, 1);
+    avl_init(&shared_file_pages);
+    zeroed_pool_refill();
 }
@@ -4,10 +4,13 @@
 #include <types.h>
 
 struct task;
+error_t unmap_pages(struct task *task, vaddr_t vaddr, size_t num_pages);
+error_t map_pages(struct task *task, vaddr_t vaddr, paddr_t paddr,
+                  size_t num_pages, unsigned flags, bool overwrite);
 error_t map_page(struct task *task, vaddr_t vaddr, paddr_t paddr,
                  unsigned flags, bool overwrite);
 paddr_t handle_page_fault(struct task *task, vaddr_t vaddr, vaddr_t ip,
-                          unsigned fault);
+                          unsigned fault, unsigned *flags);
 void page_fault_init(void);
 
 #endif
@@ -1,69 +1,115 @@
 #include "shm.h"
 #include "page_alloc.h"
 #include "page_fault.h"
-#include <string.h>
+#include <resea/malloc.h>
 
-static struct shm shared_mems[NUM_SHARED_MEMS_MAX];
+/// Shared memory regions indexed by their IDs.
+static struct avl_tree shms;
+static int next_shm_id = 0;
 
-int shm_check_available(void) {
-    int i;
-    for (i = 0; i < NUM_SHARED_MEMS_MAX && shared_mems[i].inuse; i++);
-    
-    if (i == NUM_SHARED_MEMS_MAX) {
-        return -1;
+/// Allocates a shared memory region of `num_pages` pages owned by the task.
+error_t shm_create(struct task *task, size_t num_pages, int *shm_id) {
+    if (!num_pages) {
+        return ERR_INVALID_ARG;
     }
 
-    return i;
+    if (next_shm_id < 0) {
+        // All IDs have been used up.
+        return ERR_UNAVAILABLE;
+    }
+
+    // page_alloc() fails if `num_pages` exceeds the number of free pages.
+    paddr_t paddr = page_alloc(num_pages);
+    if (!paddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    struct shm *shm = malloc(sizeof(*shm));
+    shm->shm_id = next_shm_id++;
+    shm->owner = task;
+    shm->paddr = paddr;
+    shm->len = num_pages;
+    shm->node.key = shm->shm_id;
+    avl_insert(&shms, &shm->node);
+    list_push_back(&task->shms, &shm->next);
+
+    *shm_id = shm->shm_id;
+    return OK;
 }
 
-error_t shm_create(struct task *task, size_t size, int *slot) {
-    *slot = shm_check_available();
-    if (*slot < 0) {
-        return ERR_UNAVAILABLE;
+/// Maps the whole shared memory region into the task. The mapping keeps the
+/// physical memory pages alive until the task exits. `num_pages` is set to
+/// the size of the region.
+error_t shm_map(struct task *task, int shm_id, bool writable, vaddr_t *vaddr,
+                size_t *num_pages) {
+    struct shm *shm = shm_lookup(shm_id);
+    if (shm == NULL) {
+        return ERR_NOT_FOUND;
+    }
+
+    *vaddr = virt_page_alloc(task, shm->len);
+    if (!*vaddr) {
+        return ERR_NO_MEMORY;
     }
 
-    paddr_t paddr = 0;
-    vaddr_t vaddr;
-    error_t err = task_page_alloc(task, &vaddr, &paddr, size);
+    unsigned flags = (writable) ? MAP_TYPE_READWRITE : MAP_TYPE_READONLY;
+    error_t err = map_pages(task, *vaddr, shm->paddr, shm->len, flags, false);
     if (err != OK) {
+        virt_page_free(task, *vaddr, shm->len);
         return err;
     }
 
-    shared_mems[*slot].inuse = true;
-    shared_mems[*slot].shm_id = *slot;
-    shared_mems[*slot].len = size;
-    shared_mems[*slot].paddr = paddr;
+    page_incref(paddr2pfn(shm->paddr), shm->len);
+    struct page_area *area = task_page_add(task, *vaddr, shm->paddr, shm->len);
+    area->readonly = !writable;
+    area->pinned = true;
+    *num_pages = shm->len;
     return OK;
 }
 
-error_t shm_map(struct task *task, int shm_id, bool writable, vaddr_t *vaddr) {
-    struct shm* shm = shm_lookup(shm_id);
+static void destroy_shm(struct shm *shm) {
+    avl_remove(&shms, &shm->node);
+    list_remove(&shm->next);
+    page_decref(paddr2pfn(shm->paddr), shm->len);
+    free(shm);
+}
+
+/// Closes the shared memory region. Tasks which have already mapped it can
+/// keep using it.
+error_t shm_close(struct task *task, int shm_id) {
+    struct shm *shm = shm_lookup(shm_id);
     if (shm == NULL) {
         return ERR_NOT_FOUND;
     }
 
-    *vaddr = virt_page_alloc(task, shm->len);
-    int flag = (writable) ? MAP_TYPE_READWRITE : MAP_TYPE_READONLY;
-    error_t err = map_page(task, *vaddr, shm->paddr, flag, true);
-    return err;
+    if (shm->owner != task) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    destroy_shm(shm);
+    return OK;
 }
 
-void shm_close(int shm_id) {
-    struct shm* shm = shm_lookup(shm_id);
-    if (shm != NULL) {
-        shm->inuse = false;
+/// Closes all shared memory regions owned by the task.
+void shm_close_all(struct task *task) {
+    LIST_FOR_EACH (shm, &task->shms, struct shm, next) {
+        destroy_shm(shm);
     }
 }
 
-struct shm* shm_lookup(int shm_id) {
-    int i;
-    for (i = 0; i < NUM_SHARED_MEMS_MAX; i++) {
-        if (shared_mems[i].shm_id == shm_id) {
-            if (shared_mems[i].inuse == false) {
-                return NULL;
-            }
-            return &shared_mems[i];
-        }
+struct shm *shm_lookup(int shm_id) {
+    if (shm_id < 0) {
+        return NULL;
+    }
+
+    struct avl_node *node = avl_find(&shms, shm_id);
+    if (!node) {
+        return NULL;
     }
-    return NULL;
+
+    return AVL_CONTAINER(node, struct shm, node);
+}
+
+void shm_init(void) {
+    avl_init(&shms);
 }
@@ -2,19 +2,33 @@
 #define __SHM_H__
 
 #include "task.h"
+#include <avl.h>
+#include <list.h>
 #include <types.h>
 
+/// A shared memory region. The physical memory pages are reference counted:
+/// they're freed once the region is closed and all tasks which mapped it have
+/// exited.
 struct shm {
-    bool inuse;
+    /// The element in the owner's `shms`.
+    list_elem_t next;
+    /// The node in the shared memory table keyed by `shm_id`.
+    struct avl_node node;
     int shm_id;
+    /// The task which created the region. Only the owner is allowed to close
+    /// it. It's closed automatically when the owner exits.
+    struct task *owner;
     paddr_t paddr;
+    /// The number of pages.
     size_t len;
 };
 
-#define NUM_SHARED_MEMS_MAX 32
-int shm_check_available(void);
-error_t shm_create(struct task* task, size_t size, int* slot);
-error_t shm_map(struct task* task, int shm_id, bool writable, vaddr_t* vaddr);
-void shm_close(int shm_id);
-struct shm* shm_lookup(int shm_id);
+error_t shm_create(struct task *task, size_t num_pages, int *shm_id);
+error_t shm_map(struct task *task, int shm_id, bool writable, vaddr_t *vaddr,
+                size_t *num_pages);
+error_t shm_close(struct task *task, int shm_id);
+void shm_close_all(struct task *task);
+struct shm *shm_lookup(int shm_id);
+void shm_init(void);
+
 #endif
@@ -1,6 +1,8 @@
 #include "task.h"
 #include "bootfs.h"
+#include "ool.h"
 #include "page_alloc.h"
+#include "shm.h"
 #include <elf/elf.h>
 #include <message.h>
 #include <resea/async.h>
@@ -25,6 +27,16 @@ struct task *task_lookup(task_t tid) {
     return task;
 }
 
+/// Looks for the task in the our task table. Unlike task_lookup(), it returns
+/// NULL if `tid` is invalid or not in use (e.g. a task ID given by a task).
+struct task *task_find(task_t tid) {
+    if (tid <= 0 || tid > CONFIG_NUM_TASKS || !tasks[tid - 1].in_use) {
+        return NULL;
+    }
+
+    return &tasks[tid - 1];
+}
+
 /// Allocates a task ID.
 struct task *task_alloc(task_t pager) {
     // Look for an unused task ID.
@@ -61,18 +73,19 @@ static void init_task_struct(struct task *task, const char *name,
     task->pager = vm_task->tid;
     task->in_use = true;
     task->free_vaddr = (vaddr_t) __free_vaddr;
-    task->ool_buf = 0;
-    task->ool_len = 0;
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
-    list_init(&task->ool_sender_queue);
-    list_nullify(&task->ool_sender_next);
+    list_init(&task->free_vaddr_ranges);
     strncpy2(task->name, name, sizeof(task->name));
     strncpy2(task->cmdline, cmdline, sizeof(task->cmdline));
     strncpy2(task->waiting_for, "", sizeof(task->waiting_for));
     list_init(&task->page_areas);
+    avl_init(&task->page_areas_by_vaddr);
+    avl_init(&task->page_areas_by_paddr);
+    list_init(&task->heap_areas);
     list_init(&task->watchers);
+    list_init(&task->shms);
+    list_init(&task->ool_sent);
+    list_init(&task->ool_incoming);
+    list_init(&task->pending_exits);
 }
 
 /// Execute a ELF file. Returns an task ID on success or an error on failure.
@@ -139,16 +152,48 @@ task_t task_spawn_by_cmdline(const char *name_with_cmdline) {
     return task_spawn(file, cmdline);
 }
 
+/// Sends a TASK_EXITED_MSG to the watcher. Returns false if the watcher's
+/// async queue is full.
+static bool notify_exited(struct task *watcher, task_t task) {
+    struct message m;
+    bzero(&m, sizeof(m));
+    m.type = TASK_EXITED_MSG;
+    m.task_exited.task = task;
+    return async_send(watcher->tid, &m) != ERR_WOULD_BLOCK;
+}
+
+/// Retries TASK_EXITED_MSGs which couldn't be sent since the watcher was too
+/// slow to pull async messages. Called when the watcher pulls them.
+void task_flush_pending_exits(struct task *watcher) {
+    LIST_FOR_EACH (p, &watcher->pending_exits, struct pending_exit, next) {
+        if (!notify_exited(watcher, p->task)) {
+            break;
+        }
+
+        list_remove(&p->next);
+        free(p);
+    }
+}
+
 void task_kill(struct task *task) {
     LIST_FOR_EACH (w, &task->watchers, struct task_watcher, next) {
-        struct message m;
-        bzero(&m, sizeof(m));
-        m.type = TASK_EXITED_MSG;
-        m.task_exited.task = task->tid;
-        async_send(w->watcher->tid, &m);
+        // Keep the order of notifications: don't send a new one while older
+        // ones are pending.
+        if (!list_is_empty(&w->watcher->pending_exits)
+            || !notify_exited(w->watcher, task->tid)) {
+            struct pending_exit *p = malloc(sizeof(*p));
+            p->task = task->tid;
+            list_push_back(&w->watcher->pending_exits, &p->next);
+        }
+
         free(w);
     }
 
+    LIST_FOR_EACH (p, &task->pending_exits, struct pending_exit, next) {
+        list_remove(&p->next);
+        free(p);
+    }
+
     LIST_FOR_EACH (service, &services, struct service, next) {
         if (service->task == task->tid) {
             list_remove(&service->next);
@@ -156,6 +201,8 @@ void task_kill(struct task *task) {
         }
     }
 
+    shm_close_all(task);
+    ool_discard_all(task);
     task_page_free_all(task);
     task_destroy(task->tid);
     task->in_use = false;
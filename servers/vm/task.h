@@ -1,6 +1,7 @@
 #ifndef __TASK_H__
 #define __TASK_H__
 
+#include <avl.h>
 #include <list.h>
 #include <message.h>
 #include <types.h>
@@ -11,9 +12,37 @@
 /// when the task exit.
 struct page_area {
     list_elem_t next;
+    /// The node in `task->page_areas_by_vaddr`. Not used if `vaddr` is 0.
+    struct avl_node vaddr_node;
+    /// The node in `task->page_areas_by_paddr`.
+    struct avl_node paddr_node;
     vaddr_t vaddr;
     paddr_t paddr;
     size_t num_pages;
+    /// The physical page may be shared with other tasks (copy-on-write): it's
+    /// mapped read-only and copied on a write access.
+    bool cow;
+    /// The pages are mapped read-only and writes to them are not allowed.
+    bool readonly;
+    /// The physical pages must not be replaced (e.g. DMA buffers and shared
+    /// memory): they're never shared copy-on-write.
+    bool pinned;
+};
+
+/// A virtual memory area reserved for the heap (`vm.alloc_heap`). Its pages
+/// are filled with zeroes on page faults.
+struct heap_area {
+    list_elem_t next;
+    vaddr_t vaddr;
+    size_t num_pages;
+};
+
+/// A virtual address range freed by virt_page_free() and reused by
+/// virt_page_alloc().
+struct vaddr_range {
+    list_elem_t next;
+    vaddr_t vaddr;
+    size_t num_pages;
 };
 
 /// Task Control Block (TCB).
@@ -28,17 +57,25 @@ struct task {
     struct elf64_ehdr *ehdr;
     struct elf64_phdr *phdrs;
     vaddr_t free_vaddr;
+    /// Freed virtual address ranges below `free_vaddr` sorted by the address
+    /// (`struct vaddr_range`).
+    list_t free_vaddr_ranges;
     list_t page_areas;
-    vaddr_t ool_buf;
-    size_t ool_len;
-    task_t received_ool_from;
-    vaddr_t received_ool_buf;
-    size_t received_ool_len;
-    list_t ool_sender_queue;
-    list_elem_t ool_sender_next;
-    struct message ool_sender_m;
+    /// Indices of `page_areas` to look for an area in O(log n).
+    struct avl_tree page_areas_by_vaddr;
+    struct avl_tree page_areas_by_paddr;
+    list_t heap_areas;
     char waiting_for[SERVICE_NAME_LEN];
     list_t watchers;
+    /// Shared memory regions owned by the task.
+    list_t shms;
+    /// OoL payloads sent from the task and not yet received.
+    list_t ool_sent;
+    /// OoL payloads sent to the task and not yet received.
+    list_t ool_incoming;
+    /// TASK_EXITED_MSGs to be sent to the task once it pulls async messages
+    /// (`struct pending_exit`).
+    list_t pending_exits;
 };
 
 struct service {
@@ -52,6 +89,12 @@ struct task_watcher {
     struct task *watcher;
 };
 
+/// A TASK_EXITED_MSG not yet sent since the watcher's async queue was full.
+struct pending_exit {
+    list_elem_t next;
+    task_t task;
+};
+
 extern struct task *vm_task;
 
 struct task *task_alloc(task_t pager);
@@ -59,9 +102,11 @@ void task_free(struct task *task);
 task_t task_spawn(struct bootfs_file *file, const char *cmdline);
 task_t task_spawn_by_cmdline(const char *name_with_cmdline);
 struct task *task_lookup(task_t tid);
+struct task *task_find(task_t tid);
 void task_kill(struct task *task);
 void task_watch(struct task *watcher, struct task *task);
 void task_unwatch(struct task *watcher, struct task *task);
+void task_flush_pending_exits(struct task *watcher);
 void service_register(struct task *task, const char *name);
 task_t service_wait(struct task *task, const char *name);
 void service_warn_deadlocked_tasks(void);
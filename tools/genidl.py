@@ -313,6 +313,13 @@ def c_generator(args, idl):
                 flags += "| MSG_STR"
         return flags
 
+    def msg_short_flag(msg, suffix=""):
+        # Let the compiler decide whether the fields fit into a short message:
+        # their size depends on the target ABI.
+        name = f"{msg['namespace']}_".lstrip("_") + msg['name'] + suffix
+        return f"| (sizeof(struct {name}_fields) <= MESSAGE_SHORT_PAYLOAD_LEN" \
+            " ? MSG_SHORT : 0)"
+
     def resolve_type(ns, type_):
         prefix = f"{ns}_".lstrip("_")
         if type_["name"] in user_types:
@@ -372,6 +379,7 @@ def c_generator(args, idl):
     renderer.filters["const_def"] = const_def
     renderer.filters["type_def"] = type_def
     renderer.filters["msg_type"] = msg_type
+    renderer.filters["msg_short_flag"] = msg_short_flag
     renderer.filters["msg_str"] = lambda m: f"{m['namespace']}.".lstrip(
         ".") + m['name']
     template = renderer.from_string("""\
@@ -443,9 +451,9 @@ struct {{ msg | msg_name }}_reply_fields {{ "{" }}
 {% endfor %}
 
 {%- for msg in msgs %}
-#define {{ msg | msg_name | upper }}_MSG ({{ msg.args_id }}{{ msg.args | msg_type }})
+#define {{ msg | msg_name | upper }}_MSG ({{ msg.args_id }}{{ msg.args | msg_type }}{{ msg | msg_short_flag }})
 {%- if not msg.oneway %}
-#define {{ msg | msg_name | upper }}_REPLY_MSG ({{ msg.rets_id }}{{ msg.rets | msg_type }})
+#define {{ msg | msg_name | upper }}_REPLY_MSG ({{ msg.rets_id }}{{ msg.rets | msg_type }}{{ msg | msg_short_flag("_reply") }})
 {%- endif %}
 {%- endfor %}
 